@@ -0,0 +1,111 @@
+// Reads the JEDEC ID of a SPI flash on every FT2232H plugged in, once a second. All the dongles
+// are found in one bus scan and opened in parallel. Unplug and replug any of them while it runs,
+// it's picked up again without a restart.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::FtdiDeviceInfo;
+using mpsse_protocol::FtdiDeviceManager;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::Status;
+
+namespace {
+
+constexpr uint16_t kVendor = 0x0403;
+constexpr uint16_t kProduct = 0x6010;
+
+struct Slot {
+  std::unique_ptr<FtdiDevice> dev;
+  // Declared after dev, so destroyed first.
+  std::unique_ptr<MpsseSpi> spi;
+};
+
+class Rack {
+public:
+  // Takes `dev` if the SPI can be set up on it.
+  void Attach(const FtdiDeviceInfo &info, std::unique_ptr<FtdiDevice> dev) {
+    if (dev == nullptr) return;
+    Slot slot{std::move(dev), nullptr};
+    slot.spi = MpsseSpi::Create(slot.dev.get(), 0, 0, 10);
+    if (slot.spi == nullptr) {
+      std::fprintf(stderr, "%s: cannot open SPI\n", info.port_path.c_str());
+      return;
+    }
+    std::printf("%s: attached\n", info.port_path.c_str());
+    std::lock_guard lock(mutex_);
+    slots_[info.port_path] = std::move(slot);
+  }
+
+  void Detach(const FtdiDeviceInfo &info) {
+    std::printf("%s: detached\n", info.port_path.c_str());
+    std::lock_guard lock(mutex_);
+    slots_.erase(info.port_path);
+  }
+
+  void ReadIds() {
+    std::lock_guard lock(mutex_);
+    for (auto &[port_path, slot] : slots_) {
+      const uint8_t cmd[] = {0x9f};
+      uint8_t jedec[3];
+      Status st = slot.spi->Transaction(cmd, 1, jedec, 3);
+      if (st.ok()) {
+        std::printf("%s: %02x%02x%02x\n", port_path.c_str(), jedec[0], jedec[1], jedec[2]);
+      } else {
+        std::printf("%s: %s\n", port_path.c_str(), st.human().c_str());
+      }
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::map<std::string, Slot> slots_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::unique_ptr<FtdiDeviceManager> manager = FtdiDeviceManager::Create();
+  DIE_IF(manager == nullptr, "Cannot create the device manager");
+  // Declared after the manager, so its devices close first.
+  Rack rack;
+
+  std::vector<FtdiDeviceInfo> found;
+  Status st = manager->Enumerate(kVendor, kProduct, &found);
+  DIE_IF(!st.ok(), "Enumerate() failed: %s", st.human().c_str());
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<FtdiDevice>> devs = manager->OpenAll(found);
+  std::printf("Opened %zu devices in %.1f ms\n", found.size(),
+              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                  .count());
+  for (size_t i = 0; i < found.size(); i++) rack.Attach(found[i], std::move(devs[i]));
+
+  st = manager->Watch(
+      kVendor, kProduct,
+      [&](const FtdiDeviceInfo &info) { rack.Attach(info, manager->Open(info)); },
+      [&](const FtdiDeviceInfo &info) { rack.Detach(info); });
+  DIE_IF(!st.ok(), "Watch() failed: %s", st.human().c_str());
+
+  while (true) {
+    rack.ReadIds();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+}
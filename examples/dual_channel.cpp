@@ -0,0 +1,71 @@
+// Both channels of an FT2232H at full speed from one process: SPI bulk writes on channel A
+// (e.g. a display) and MCP9808 reads over I2C on channel B, each on its own thread.
+// Prints the throughput of each channel every second, to see whether they contend for USB.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiChip;
+using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::Status;
+
+constexpr uint8_t kMcp9808Addr7 = 0x18;
+constexpr uint8_t kMcp9808RegTemperature = 0x5;
+
+int main(int argc, char *argv[]) {
+  std::unique_ptr<FtdiChip> chip = FtdiChip::OpenVendorProduct(0x0403, 0x6010);
+  DIE_IF(chip == nullptr, "Cannot open chip");
+  DIE_IF(chip->channels() < 2, "Need a chip with 2 MPSSE channels");
+  std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(chip->channel(0), 0, 0, 30);
+  DIE_IF(spi == nullptr, "Cannot open SPI");
+  std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(chip->channel(1));
+  DIE_IF(i2c == nullptr, "Cannot open I2C");
+
+  std::atomic<bool> stop = false;
+  std::thread spi_thread([&]() {
+    std::vector<uint8_t> frame(320 * 480 * 2, 0x55);
+    while (!stop) {
+      Status st = spi->Transaction(frame.data(), frame.size(), nullptr, 0);
+      DIE_IF(!st.ok(), "SPI failed: %s", st.human().c_str());
+    }
+  });
+  std::thread i2c_thread([&]() {
+    while (!stop) {
+      uint8_t reg = kMcp9808RegTemperature;
+      uint8_t temp[2];
+      Status st = i2c->Transaction(kMcp9808Addr7, &reg, 1, temp, 2);
+      DIE_IF(!st.ok(), "I2C failed: %s", st.human().c_str());
+    }
+  });
+
+  for (int s = 0; s < 10; s++) {
+    chip->ResetStats();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (int i = 0; i < chip->channels(); i++) {
+      FtdiChip::ChannelStats st = chip->Stats(i);
+      std::printf("%c: TX %8.1f KiB/s  RX %8.1f KiB/s   ", 'A' + i, st.tx_bytes_per_s / 1024,
+                  st.rx_bytes_per_s / 1024);
+    }
+    std::printf("\n");
+  }
+  stop = true;
+  spi_thread.join();
+  i2c_thread.join();
+  return 0;
+}
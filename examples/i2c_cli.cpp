@@ -6,10 +6,12 @@
 #include <cctype>
 #include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "mpsse_protocol.h"
 
@@ -54,8 +56,47 @@ const char *GetPrompt(EditLine *el) { return "i2c>"; }
 void PrintHelp() {
   std::printf("Usage:\n");
   std::printf("<dev> is the 7-bits device address\n");
-  std::printf("  scan                Scan the bus\n");
-  std::printf("  read <dev> <reg>    Read one byte from device's register\n");
+  std::printf("  scan                       Scan the bus\n");
+  std::printf("  read <dev> <reg>           Read one byte from device's register\n");
+  std::printf("  dump <dev> [<first> <last>] Read registers one by one, 0x00-0xff by default\n");
+}
+
+// Decimal, or hex with 0x.
+bool ParseByte(const std::string &s, uint8_t *out) {
+  char *end = nullptr;
+  long v = std::strtol(s.c_str(), &end, 0);
+  if (end == s.c_str() || *end != '\0' || v < 0 || v > 0xff) return false;
+  *out = v;
+  return true;
+}
+
+// Same layout as i2cdetect.
+void PrintScan(const std::vector<uint8_t> &found, uint8_t first, uint8_t last) {
+  std::printf("    ");
+  for (int col = 0; col < 16; col++) std::printf(" %x ", col);
+  for (int addr = 0; addr < 0x80; addr++) {
+    if (addr % 16 == 0) std::printf("\n%02x: ", addr);
+    if (addr < first || addr > last) {
+      std::printf("   ");
+    } else if (std::find(found.begin(), found.end(), addr) != found.end()) {
+      std::printf("%02x ", addr);
+    } else {
+      std::printf("-- ");
+    }
+  }
+  std::printf("\n");
+}
+
+void PrintDump(uint8_t first, const std::vector<uint8_t> &values) {
+  for (size_t i = 0; i < values.size(); i++) {
+    const int reg = first + i;
+    if (i == 0 || reg % 16 == 0) std::printf("%s%02x: ", i == 0 ? "" : "\n", reg & 0xf0);
+    if (i == 0) {
+      for (int pad = 0; pad < reg % 16; pad++) std::printf("   ");
+    }
+    std::printf("%02x ", values[i]);
+  }
+  std::printf("\n");
 }
 
 } // namespace
@@ -124,12 +165,48 @@ int main(int argc, char *argv[]) {
     if (match("help", 1)) {
       PrintHelp();
     } else if (match("scan", 1)) {
-      for (int dev = 8; dev < 0x80; dev++) {
-        Status st = i2c->Transaction(dev, nullptr, 0, nullptr, 0);
-        std::printf("Device addr 0x%02x : %s\n", dev, st.human().c_str());
+      std::vector<uint8_t> found;
+      auto start = std::chrono::steady_clock::now();
+      Status st = i2c->Scan(&found);
+      auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+      if (!st.ok()) {
+        std::printf("Scan failed: %s\n", st.human().c_str());
+        continue;
       }
+      PrintScan(found, 0x08, 0x77);
+      std::printf("%zu device(s) in %.1f ms\n", found.size(), elapsed.count());
     } else if (match("read", 3)) {
-      std::printf("Not implemented\n");
+      uint8_t addr, reg, value;
+      if (!ParseByte(str_args[1], &addr) || addr > 0x7f || !ParseByte(str_args[2], &reg)) {
+        std::printf("Invalid address or register\n");
+        continue;
+      }
+      Status st = i2c->ReadRegisters(addr, std::span(&reg, 1), 1, &value);
+      if (st.ok()) {
+        std::printf("0x%02x\n", value);
+      } else {
+        std::printf("Read failed: %s\n", st.human().c_str());
+      }
+    } else if (match("dump", 2) || match("dump", 4)) {
+      uint8_t addr, first = 0x00, last = 0xff;
+      bool valid = ParseByte(str_args[1], &addr) && addr <= 0x7f;
+      if (line_argc == 4) {
+        valid = valid && ParseByte(str_args[2], &first) && ParseByte(str_args[3], &last) &&
+                first <= last;
+      }
+      if (!valid) {
+        std::printf("Invalid address or register range\n");
+        continue;
+      }
+      std::vector<uint8_t> regs;
+      for (int reg = first; reg <= last; reg++) regs.push_back(reg);
+      std::vector<uint8_t> values(regs.size());
+      Status st = i2c->ReadRegisters(addr, regs, 1, values.data());
+      if (!st.ok()) {
+        std::printf("Dump failed: %s\n", st.human().c_str());
+        continue;
+      }
+      PrintDump(first, values);
     } else {
       std::printf("Unknown command\n");
     }
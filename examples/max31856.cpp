@@ -1,4 +1,3 @@
-#include <arpa/inet.h>
 #include <chrono>
 #include <cstdio>
 #include <ftdi.h>
@@ -7,6 +6,7 @@
 #include <thread>
 
 #include "mpsse_protocol.h"
+#include "mpsse_sensor.h"
 
 #define DIE_IF(cond, fmt, ...)                                                           \
   do {                                                                                   \
@@ -18,11 +18,15 @@
 
 using mpsse_protocol::FtdiDevice;
 using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::RegisterCache;
+using mpsse_protocol::SpiRegisterBus;
 using mpsse_protocol::Status;
 
 #define MAX31856_WRITE 0x80
 #define MAX31856_CONFIG0 0x00
 #define MAX31856_CONFIG1 0x01
+// CJTH, CJTL, LTCBH, LTCBM, LTCBL: read as one block, the address auto increments.
+#define MAX31856_CJTH 0x0a
 
 int main(int argc, char *argv[]) {
   std::unique_ptr<FtdiDevice> dev =
@@ -31,32 +35,39 @@ int main(int argc, char *argv[]) {
   // MAX31856 supportes CPOL=0 or 1 but CPHA must be 1
   std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(dev.get(), 1, 1);
   DIE_IF(spi == nullptr, "Cannot open SPI");
+  mpsse_protocol::MpsseGpio gpio = spi->Gpio();
 
+  // CR0 is volatile: the one-shot bit clears itself, so every trigger has to go out.
+  using R = RegisterCache::Register;
+  RegisterCache regs(std::make_unique<SpiRegisterBus>(spi.get(), MAX31856_WRITE),
+                     {{MAX31856_CONFIG0, 1, R::kVolatile},
+                      {MAX31856_CONFIG1, 1, R::kCached},
+                      {MAX31856_CJTH, 5, R::kVolatile}});
 
-  uint8_t data[6];
-  // Write CR1
-  data[0] = MAX31856_CONFIG1 | MAX31856_WRITE;
-  data[1] = 0x23; // TypeK, 4sample avg, needs 243ms
-  Status st = spi->Transaction(data, 2, nullptr, 0);
-  DIE_IF(!st.ok(), "SPI Transaction failed: CR1");
-
+  uint8_t data[5];
   while(true) {
+    // Write CR1. Goes to the bus the first time only.
+    data[0] = 0x23; // TypeK, 4sample avg, needs 243ms
+    Status st = regs.Write(MAX31856_CONFIG1, data);
+    DIE_IF(!st.ok(), "SPI Transaction failed: CR1");
+
     // Trigger
-    data[0] = MAX31856_CONFIG0 | MAX31856_WRITE;
-    data[1] = 0x40; // One shot
-    st = spi->Transaction(data, 2, nullptr, 0);
+    data[0] = 0x40; // One shot
+    st = regs.Write(MAX31856_CONFIG0, data);
     DIE_IF(!st.ok(), "SPI Transaction failed: CR0");
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    // DRDY (active low) -> ADBUS5. Returns as soon as the conversion is done, instead of
+    // sleeping for the worst case.
+    st = gpio.WaitOnPin5(/*high=*/false, std::chrono::milliseconds(500));
+    DIE_IF(!st.ok(), "Waiting for DRDY failed: %s", st.human().c_str());
 
     // Read
-    data[0] = 0xa;
-    st = spi->Transaction(data, 1, data + 1, 5);
+    st = regs.Read(MAX31856_CJTH, data);
     DIE_IF(!st.ok(), "SPI Transaction failed: Read");
 
     //
-    int16_t cj_data = (data[1] << 8) | data[2];
-    int32_t tc_data = (data[3] << 24) | (data[4] << 16) | (data[5] << 8);
+    int16_t cj_data = (data[0] << 8) | data[1];
+    int32_t tc_data = (data[2] << 24) | (data[3] << 16) | (data[4] << 8);
     // std::printf("Raw value %#x %#x\n", cj_data, tc_data);
     std::printf("CJ-TC: %9.2f %9.2f °C\n", static_cast<float>(cj_data >> 2) / 64,
                 static_cast<float>(tc_data >> 13) / 128);
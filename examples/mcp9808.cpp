@@ -1,4 +1,3 @@
-#include <arpa/inet.h>
 #include <cstdio>
 #include <ftdi.h>
 #include <iostream>
@@ -7,6 +6,7 @@
 #include <thread>
 
 #include "mpsse_protocol.h"
+#include "mpsse_sensor.h"
 
 #define DIE_IF(cond, fmt, ...)                                                           \
   do {                                                                                   \
@@ -17,7 +17,9 @@
   } while (0)
 
 using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::I2cRegisterBus;
 using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::RegisterCache;
 using mpsse_protocol::Status;
 
 #define MCP9808_ADDR7 0x18
@@ -34,44 +36,44 @@ int main(int argc, char *argv[]) {
   std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(dev.get());
   DIE_IF(i2c == nullptr, "Cannot open i2c");
 
+  // Only the temperature changes, the rest is read once.
+  using R = RegisterCache::Register;
+  RegisterCache regs(std::make_unique<I2cRegisterBus>(i2c.get(), MCP9808_ADDR7),
+                     {{MCP9808_REG_TEMPERATURE, 2, R::kVolatile},
+                      {MCP9808_REG_MANUFACTURER_ID, 2, R::kConstant},
+                      {MCP9808_REG_DEVID_REV, 2, R::kConstant},
+                      {MCP9808_REG_RESOLUTION, 1, R::kCached}});
+
   int round = 0;
   while (1) {
     std::printf("== Round #%d ==\n", ++round);
     {
-      uint8_t tx_data = MCP9808_REG_MANUFACTURER_ID;
-      uint16_t rx_data;
-      Status st = i2c->Transaction(MCP9808_ADDR7, &tx_data, 1, &rx_data, 2);
-      DIE_IF(!st.ok(), "Failed to get Manufacturer ID.");
-      std::printf("Manufacturer ID: %#06x\n", ntohs(rx_data));
-    }
-    {
-      uint8_t tx_data = MCP9808_REG_DEVID_REV;
-      uint8_t rx_data[2];
-      Status st = i2c->Transaction(MCP9808_ADDR7, &tx_data, 1, &rx_data, 2);
-      DIE_IF(!st.ok(), "Failed to get DevID / Rev.");
-      std::printf("Device ID: %#04x\nRevision: %#04x\n", rx_data[0], rx_data[1]);
+      // Only written the first time.
+      uint8_t resolution = 3;
+      Status st = regs.Write(MCP9808_REG_RESOLUTION, &resolution);
+      DIE_IF(!st.ok(), "Failed to set Resolution.");
     }
-    {
-      uint8_t tx_data = MCP9808_REG_RESOLUTION;
-      uint8_t rx_data;
-      Status st = i2c->Transaction(MCP9808_ADDR7, &tx_data, 1, &rx_data, 1);
-      DIE_IF(!st.ok(), "Failed to get Resolution.");
-      switch (rx_data) {
-      case 0:  std::printf("Resolution: 0.5    °C\n"); break;
-      case 1:  std::printf("Resolution: 0.25   °C\n"); break;
-      case 2:  std::printf("Resolution: 0.125  °C\n"); break;
-      case 3:  std::printf("Resolution: 0.0625 °C\n"); break;
-      default: std::printf("Resolution: unknown(%d)\n", rx_data);
-      }
-    }
-    {
-      uint8_t tx_data = MCP9808_REG_TEMPERATURE;
-      uint16_t rx_data;
-      Status st = i2c->Transaction(MCP9808_ADDR7, &tx_data, 1, &rx_data, 2);
-      DIE_IF(!st.ok(), "Failed to get Temperature.");
-      double temp = (double)((int16_t)(ntohs(rx_data) << 3) >> 3) / 16.0;
-      printf("Temperature: (%#06x) %f°C\n", ntohs(rx_data), temp);
+    // All four in one bus transaction, of which only the temperature after the first round.
+    const uint8_t order[] = {MCP9808_REG_MANUFACTURER_ID, MCP9808_REG_DEVID_REV,
+                             MCP9808_REG_RESOLUTION, MCP9808_REG_TEMPERATURE};
+    uint8_t rx_data[7];
+    Status st = regs.Read(order, rx_data);
+    DIE_IF(!st.ok(), "Failed to read registers: %s", st.human().c_str());
+
+    std::printf("Manufacturer ID: %#06x\n", (rx_data[0] << 8) | rx_data[1]);
+    std::printf("Device ID: %#04x\nRevision: %#04x\n", rx_data[2], rx_data[3]);
+    switch (rx_data[4]) {
+    case 0:  std::printf("Resolution: 0.5    °C\n"); break;
+    case 1:  std::printf("Resolution: 0.25   °C\n"); break;
+    case 2:  std::printf("Resolution: 0.125  °C\n"); break;
+    case 3:  std::printf("Resolution: 0.0625 °C\n"); break;
+    default: std::printf("Resolution: unknown(%d)\n", rx_data[4]);
     }
+    uint16_t raw = (rx_data[5] << 8) | rx_data[6];
+    double temp = (double)((int16_t)(raw << 3) >> 3) / 16.0;
+    printf("Temperature: (%#06x) %f°C\n", raw, temp);
+    std::printf("Bus transactions: %lu, cache hits: %lu\n", regs.stats().transfers,
+                regs.stats().read_hits);
 
     std::this_thread::sleep_for(std::chrono::seconds(1));
   }
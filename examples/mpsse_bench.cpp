@@ -0,0 +1,198 @@
+// Benchmark of the protocol classes on a reference FT2232H rig.
+//
+// Channel A: SPI (nothing needs to be connected, MISO reads whatever it floats at), then
+//            WS2812B (a strip is optional).
+// Channel B: I2C, needs a device that ACKs at --i2c-addr (default 0x18, MCP9808).
+//
+// Prints a table, and with --json <path> writes the results as JSON for regression tracking:
+//   {"version": 1, "results": [{"bench": "spi_write", "clock_khz": 30000, "size": 256,
+//     "iterations": 200, "errors": 0, "tps": ..., "bytes_per_s": ..., "p50_us": ...,
+//     "p99_us": ...}, ...]}
+//
+// Build without the address sanitizer for meaningful numbers:
+//   make clean && make SANITIZE= examples/mpsse_bench
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <ftdi.h>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::MpsseWs2812b;
+using mpsse_protocol::Status;
+
+namespace {
+
+struct Result {
+  std::string bench;
+  double clock_khz;
+  size_t size;
+  int iterations;
+  int errors;
+  double tps;
+  double bytes_per_s;
+  double p50_us;
+  double p99_us;
+};
+
+// Time `iterations` calls of `op`, each moving `bytes` of payload. A few warm-up calls first.
+Result Measure(const std::string &bench, double clock_khz, size_t bytes, int iterations,
+               const std::function<Status()> &op) {
+  using Clock = std::chrono::steady_clock;
+  for (int i = 0; i < 3; i++) op();
+
+  std::vector<double> latency_us;
+  latency_us.reserve(iterations);
+  int errors = 0;
+  auto start = Clock::now();
+  for (int i = 0; i < iterations; i++) {
+    auto t0 = Clock::now();
+    if (!op().ok()) errors++;
+    latency_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::sort(latency_us.begin(), latency_us.end());
+  auto percentile = [&](double p) {
+    return latency_us[std::min<size_t>(latency_us.size() - 1, p * latency_us.size())];
+  };
+  Result r{bench, clock_khz, bytes, iterations, errors, iterations / elapsed,
+           bytes * iterations / elapsed, percentile(0.5), percentile(0.99)};
+  std::printf("%-12s %9.0f kHz %7zu B  %9.1f tps %10.1f KiB/s  p50 %9.1f us  p99 %9.1f us%s\n",
+              r.bench.c_str(), r.clock_khz, r.size, r.tps, r.bytes_per_s / 1024, r.p50_us, r.p99_us,
+              r.errors ? "  ERRORS" : "");
+  return r;
+}
+
+void BenchSpi(FtdiDevice *dev, int iterations, std::vector<Result> *results) {
+  std::vector<uint8_t> tx(65536, 0xa5);
+  std::vector<uint8_t> rx(65536);
+  for (float mhz : {1.0f, 10.0f, 30.0f}) {
+    std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(dev, 0, 0, mhz);
+    DIE_IF(spi == nullptr, "Cannot open SPI");
+    const double khz = dev->MpsseClockKhz();
+    for (size_t size : {1, 16, 256, 4096, 65536}) {
+      // Keep the slow runs short.
+      int n = std::max<int>(10, std::min<double>(iterations, iterations * 256.0 / size * mhz / 10));
+      results->push_back(Measure("spi_write", khz, size, n, [&]() {
+        return spi->Transaction(tx.data(), size, nullptr, 0);
+      }));
+      results->push_back(Measure("spi_read", khz, size, n, [&]() {
+        return spi->Transaction(tx.data(), 1, rx.data(), size);
+      }));
+    }
+  }
+}
+
+void BenchI2c(FtdiDevice *dev, uint8_t addr7, int iterations, std::vector<Result> *results) {
+  uint8_t rx[16];
+  for (float khz : {100.0f, 400.0f, 1000.0f}) {
+    std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(dev, khz);
+    DIE_IF(i2c == nullptr, "Cannot open I2C");
+    for (size_t size : {1, 2, 16}) {
+      uint8_t reg = 0;
+      results->push_back(Measure("i2c_read", dev->MpsseClockKhz(), size, iterations, [&]() {
+        return i2c->Transaction(addr7, &reg, 1, rx, size);
+      }));
+    }
+  }
+}
+
+void BenchWs2812b(FtdiDevice *dev, int iterations, std::vector<Result> *results) {
+  std::unique_ptr<MpsseWs2812b> leds = MpsseWs2812b::Create(dev);
+  DIE_IF(leds == nullptr, "Cannot open WS2812B");
+  for (size_t count : {1, 64, 512, 4096}) {
+    std::vector<uint32_t> frame(count, 0x010203);
+    int n = std::max<int>(10, std::min<double>(iterations, iterations * 64.0 / count));
+    // Size counts the LEDs' RGB bytes.
+    results->push_back(Measure("ws2812b", dev->MpsseClockKhz(), count * 3, n, [&]() {
+      return leds->SendFrame(frame);
+    }));
+  }
+}
+
+bool WriteJson(const char *path, const std::vector<Result> &results) {
+  FILE *f = std::fopen(path, "w");
+  if (f == nullptr) return false;
+  std::fprintf(f, "{\"version\": 1, \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    std::fprintf(f,
+                 "  {\"bench\": \"%s\", \"clock_khz\": %.1f, \"size\": %zu, \"iterations\": %d, "
+                 "\"errors\": %d, \"tps\": %.2f, \"bytes_per_s\": %.1f, \"p50_us\": %.2f, "
+                 "\"p99_us\": %.2f}%s\n",
+                 r.bench.c_str(), r.clock_khz, r.size, r.iterations, r.errors, r.tps, r.bytes_per_s,
+                 r.p50_us, r.p99_us, i + 1 < results.size() ? "," : "");
+  }
+  std::fprintf(f, "]}\n");
+  return std::fclose(f) == 0;
+}
+
+void PrintHelp() {
+  std::printf("Usage: mpsse_bench [--json <path>] [--iterations <n>] [--i2c-addr <addr7>]\n");
+  std::printf("                   [--skip-spi] [--skip-i2c] [--skip-ws2812b]\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const char *json_path = nullptr;
+  int iterations = 200;
+  uint8_t i2c_addr = 0x18;
+  bool spi = true, i2c = true, ws2812b = true;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--json" && has_value) {
+      json_path = argv[++i];
+    } else if (arg == "--iterations" && has_value) {
+      iterations = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--i2c-addr" && has_value) {
+      i2c_addr = std::stoi(argv[++i], nullptr, 0);
+    } else if (arg == "--skip-spi") {
+      spi = false;
+    } else if (arg == "--skip-i2c") {
+      i2c = false;
+    } else if (arg == "--skip-ws2812b") {
+      ws2812b = false;
+    } else {
+      PrintHelp();
+      return 1;
+    }
+  }
+
+  std::vector<Result> results;
+  if (spi || ws2812b) {
+    std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_A);
+    DIE_IF(dev == nullptr, "Cannot open channel A");
+    if (spi) BenchSpi(dev.get(), iterations, &results);
+    if (ws2812b) BenchWs2812b(dev.get(), iterations, &results);
+  }
+  if (i2c) {
+    std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_B);
+    DIE_IF(dev == nullptr, "Cannot open channel B");
+    BenchI2c(dev.get(), i2c_addr, iterations, &results);
+  }
+
+  if (json_path) DIE_IF(!WriteJson(json_path, results), "Cannot write %s", json_path);
+  return 0;
+}
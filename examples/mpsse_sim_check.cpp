@@ -0,0 +1,257 @@
+// Runs the protocol classes against MpsseSim, no hardware needed, and checks how many USB
+// transfers and round trips each operation takes. Exits with 1 if one got worse than its budget,
+// so a batching regression fails `make check`. Each feature also gets a check of what it put on
+// the wire.
+//
+// Wire time is the simulator's estimate for a real FT2232H, host time is what the host side
+// (encoding, buffering, the simulator itself) took here.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+#include "mpsse_protocol.h"
+#include "mpsse_sensor.h"
+#include "mpsse_sim.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::I2cRegisterBus;
+using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::MpsseRecording;
+using mpsse_protocol::MpsseSim;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::MpsseWs2812b;
+using mpsse_protocol::RegisterCache;
+using mpsse_protocol::Status;
+
+namespace {
+
+struct Sim {
+  MpsseSim *sim;
+  std::unique_ptr<FtdiDevice> dev;
+};
+
+Sim OpenSim() {
+  auto owned = std::make_unique<MpsseSim>();
+  MpsseSim *sim = owned.get();
+  auto dev = FtdiDevice::OpenTransport(std::move(owned));
+  DIE_IF(dev == nullptr, "Cannot open the simulator");
+  return {sim, std::move(dev)};
+}
+
+// What the host clocked out, from the simulator's shifts. Reads clock out zeros.
+struct Wire {
+  std::vector<uint8_t> bytes;
+  // Single bits: I2C ACKs and NACKs, the host's and the peripheral's.
+  std::vector<uint8_t> bits;
+  // 7-bit I2C addresses that ACK the byte before them, empty to ACK everything.
+  std::vector<uint8_t> present;
+
+  void Clear() {
+    bytes.clear();
+    bits.clear();
+  }
+  // Times `seq` shows up in the bytes.
+  size_t Count(std::initializer_list<uint8_t> seq) const {
+    size_t n = 0;
+    auto it = bytes.begin();
+    while ((it = std::search(it, bytes.end(), seq.begin(), seq.end())) != bytes.end()) {
+      n++;
+      it++;
+    }
+    return n;
+  }
+};
+
+void Listen(MpsseSim *sim, Wire *wire) {
+  sim->SetShift([wire](uint8_t out, int bits) -> uint8_t {
+    if (bits == 1) {
+      wire->bits.push_back(out & 1);
+      // Low is ACK. Only read back when it's the peripheral's.
+      const auto &present = wire->present;
+      const uint8_t last = wire->bytes.empty() ? 0 : wire->bytes.back();
+      const bool ack = present.empty() || std::count(present.begin(), present.end(), last >> 1);
+      return ack ? 0 : 0xff;
+    }
+    if (bits == 8) wire->bytes.push_back(out);
+    return 0;
+  });
+}
+
+bool Expect(const char *name, bool cond, const char *what) {
+  if (!cond) std::printf("%-16s WRONG: %s\n", name, what);
+  return cond;
+}
+
+// Run `op` `iterations` times and compare the per-call transfers with the budget.
+bool Check(const char *name, MpsseSim *sim, int iterations, uint64_t max_writes,
+           uint64_t max_round_trips, const std::function<Status()> &op) {
+  sim->ResetStats();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    Status st = op();
+    DIE_IF(!st.ok(), "%s failed: %s", name, st.human().c_str());
+  }
+  double host_us =
+      std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+  const MpsseSim::Stats &s = sim->stats();
+  const uint64_t writes = s.usb_writes / iterations;
+  const uint64_t round_trips = s.round_trips / iterations;
+  const bool ok = writes <= max_writes && round_trips <= max_round_trips;
+  std::printf("%-16s %6lu/%-3lu %6lu/%-3lu %8lu %8lu %10.1f %10.2f  %s\n", name, writes, max_writes,
+              round_trips, max_round_trips, s.tx_bytes / iterations, s.rx_bytes / iterations,
+              s.wire_time.count() / 1e3 / iterations, host_us / iterations, ok ? "ok" : "REGRESSED");
+  if (s.latency_timer_flushes > 0) {
+    std::printf("%-16s %lu reads waited for the latency timer, missing SEND_IMMEDIATE?\n", "",
+                s.latency_timer_flushes);
+  }
+  return ok;
+}
+
+} // namespace
+
+int main() {
+  constexpr int kIterations = 100;
+  bool ok = true;
+  std::printf("%-16s %10s %10s %8s %8s %10s %10s\n", "", "writes", "trips", "tx B", "rx B",
+              "wire us", "host us");
+
+  {
+    Sim s = OpenSim();
+    std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(s.dev.get(), 400);
+    DIE_IF(i2c == nullptr, "Cannot open I2C");
+    Wire wire;
+    Listen(s.sim, &wire);
+    uint8_t reg = 0x05;
+    uint8_t rx[16];
+    int nack_index = 0;
+    ok &= Check("i2c_transaction", s.sim, kIterations, 12, 4, [&]() {
+      return i2c->Transaction(0x18, &reg, 1, rx, 2);
+    });
+    ok &= Check("i2c_batch", s.sim, kIterations, 1, 1, [&]() {
+      return i2c->BatchTransaction(0x18, &reg, 1, rx, 16, &nack_index);
+    });
+    // A monitoring loop on cached configuration: one transfer for the data registers only.
+    using R = RegisterCache::Register;
+    RegisterCache cache(std::make_unique<I2cRegisterBus>(i2c.get(), 0x18),
+                        {{0x05, 2, R::kVolatile}, {0x06, 2, R::kConstant}, {0x08, 1, R::kCached}});
+    const uint8_t poll[] = {0x06, 0x08, 0x05};
+    wire.Clear();
+    ok &= Check("i2c_regcache", s.sim, kIterations, 1, 1, [&]() {
+      uint8_t resolution = 3;
+      Status st = cache.Write(0x08, &resolution);
+      if (st.ok()) st = cache.Read(poll, rx);
+      return st;
+    });
+    // Address 0x30/0x31 is 0x18 writing/reading.
+    ok &= Expect("i2c_regcache", wire.Count({0x30, 0x08, 0x03}) == 1, "0x08 not written once");
+    ok &= Expect("i2c_regcache", wire.Count({0x30, 0x08, 0x31}) == 0, "0x08 read back");
+    ok &= Expect("i2c_regcache", wire.Count({0x30, 0x06, 0x31}) == 1, "0x06 not read once");
+    ok &= Expect("i2c_regcache", wire.Count({0x30, 0x05, 0x31}) == kIterations,
+                 "0x05 not read every time");
+    // Pipelined, one write and one read per 256 bytes on top of the transaction.
+    std::vector<uint8_t> eeprom(4096);
+    wire.Clear();
+    ok &= Check("i2c_read_4k", s.sim, 10, 27, 19, [&]() {
+      return i2c->Transaction(0x50, &reg, 1, eeprom.data(), eeprom.size());
+    });
+    // 3 peripheral ACKs, then the host's: a NACK on the last byte only, across the chunks.
+    const size_t acks = 3 + eeprom.size();
+    bool nack_last = wire.bits.size() == 10 * acks;
+    for (size_t i = 0; nack_last && i < wire.bits.size(); i++) {
+      nack_last = wire.bits[i] == (i % acks == acks - 1);
+    }
+    ok &= Expect("i2c_read_4k", nack_last, "NACK not on the last byte only");
+    // A few write chunks of queued probes, one read for all the ACKs.
+    std::vector<uint8_t> found;
+    wire.present = {0x18, 0x50};
+    ok &= Check("i2c_scan", s.sim, 10, 4, 1, [&]() { return i2c->Scan(&found); });
+    ok &= Expect("i2c_scan", found == wire.present, "Wrong devices found");
+    wire.present.clear();
+    // Recorded once, replayed with the ACK checks: one write, one read.
+    MpsseRecording init;
+    for (uint8_t i = 0; i < 16; i++) {
+      const uint8_t cmd[] = {0x80, i};
+      DIE_IF(!i2c->BufferTransaction(0x3c, cmd, {}).ok(), "Cannot buffer");
+    }
+    DIE_IF(!i2c->BufferRecord(&init).ok(), "Cannot record");
+    ok &= Check("i2c_replay", s.sim, kIterations, 1, 1, [&]() { return i2c->Replay(init); });
+    std::vector<uint8_t> regs(64);
+    for (size_t i = 0; i < regs.size(); i++) regs[i] = i;
+    std::vector<uint8_t> dump(regs.size());
+    ok &= Check("i2c_dump_64", s.sim, 10, 5, 1, [&]() {
+      return i2c->ReadRegisters(0x18, regs, 1, dump.data());
+    });
+  }
+
+  {
+    Sim s = OpenSim();
+    std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(s.dev.get(), 0, 0, 30);
+    DIE_IF(spi == nullptr, "Cannot open SPI");
+    Wire wire;
+    Listen(s.sim, &wire);
+    std::vector<uint8_t> tx(65536, 0xa5);
+    std::vector<uint8_t> rx(65536);
+    ok &= Check("spi_small", s.sim, kIterations, 1, 1, [&]() {
+      return spi->Transaction(tx.data(), 4, rx.data(), 16);
+    });
+    ok &= Check("spi_write_64k", s.sim, 10, 3, 0, [&]() {
+      return spi->Transaction(tx.data(), tx.size(), nullptr, 0);
+    });
+    ok &= Check("spi_read_64k", s.sim, 10, 1, 1, [&]() {
+      return spi->Transaction(tx.data(), 1, rx.data(), rx.size());
+    });
+    uint8_t jedec_cmd[] = {0x9f};
+    uint8_t jedec[3];
+    ok &= Check("spi_coalesced", s.sim, kIterations, 1, 1, [&]() {
+      Status st = Status::Ok();
+      for (int i = 0; i < 8; i++) st |= spi->BufferTransaction(jedec_cmd, {}, jedec, 3);
+      if (st.ok()) st = spi->Flush();
+      return st;
+    });
+    // Same, pre-encoded, with another command patched into the first one every time.
+    MpsseRecording reads;
+    for (int i = 0; i < 8; i++) {
+      DIE_IF(!spi->BufferTransaction(jedec_cmd, {}, jedec, 3).ok(), "Cannot buffer");
+    }
+    spi->BufferRecord(&reads);
+    DIE_IF(reads.FindSlot(jedec_cmd) != 0, "No slot");
+    uint8_t replayed[24];
+    const uint8_t unique_id_cmd[] = {0x4b};
+    const std::span<const uint8_t> patches[] = {unique_id_cmd};
+    wire.Clear();
+    ok &= Check("spi_replay", s.sim, kIterations, 1, 1, [&]() {
+      return spi->Replay(reads, replayed, patches);
+    });
+    // The command, then 3 bytes read, 8 times.
+    bool patched = wire.bytes.size() == kIterations * 32;
+    for (size_t i = 0; patched && i < wire.bytes.size(); i += 4) {
+      patched = wire.bytes[i] == (i % 32 == 0 ? 0x4b : 0x9f);
+    }
+    ok &= Expect("spi_replay", patched, "Patched command not sent");
+  }
+
+  {
+    Sim s = OpenSim();
+    std::unique_ptr<MpsseWs2812b> leds = MpsseWs2812b::Create(s.dev.get());
+    DIE_IF(leds == nullptr, "Cannot open WS2812B");
+    std::vector<uint32_t> frame(512, 0x102030);
+    ok &= Check("ws2812b_512", s.sim, kIterations, 1, 0, [&]() { return leds->SendFrame(frame); });
+  }
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+// Logs an MCP9808 at 1 Hz (I2C, channel B) and a MAX31856 at 2 Hz (SPI, channel A) as CSV lines
+// on stdout, through one SamplingScheduler. Acquisition runs on the scheduler's thread, the main
+// thread prints what it finds in the ring, so a slow terminal never delays acquisition.
+//
+// The MAX31856 runs in automatic conversion mode, every read gets the latest conversion.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "mpsse_protocol.h"
+#include "mpsse_sensor.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiChip;
+using mpsse_protocol::I2cRegisterBus;
+using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::RegisterCache;
+using mpsse_protocol::Sample;
+using mpsse_protocol::SampleRing;
+using mpsse_protocol::SamplingScheduler;
+using mpsse_protocol::SpiRegisterBus;
+using mpsse_protocol::Status;
+
+constexpr uint8_t kMcp9808Addr7 = 0x18;
+constexpr uint8_t kMcp9808RegTemperature = 0x5;
+constexpr uint8_t kMax31856Config0 = 0x00;
+constexpr uint8_t kMax31856Config1 = 0x01;
+constexpr uint8_t kMax31856Cjth = 0x0a;
+
+int main(int argc, char *argv[]) {
+  std::unique_ptr<FtdiChip> chip = FtdiChip::OpenVendorProduct(0x0403, 0x6010);
+  DIE_IF(chip == nullptr, "Cannot open chip");
+  DIE_IF(chip->channels() < 2, "Need a chip with 2 MPSSE channels");
+  // MAX31856 supportes CPOL=0 or 1 but CPHA must be 1
+  std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(chip->channel(0), 1, 1);
+  DIE_IF(spi == nullptr, "Cannot open SPI");
+  std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(chip->channel(1));
+  DIE_IF(i2c == nullptr, "Cannot open I2C");
+
+  I2cRegisterBus mcp9808(i2c.get(), kMcp9808Addr7);
+  SpiRegisterBus max31856(spi.get());
+  {
+    using R = RegisterCache::Register;
+    // Flushed in map order: CR1 before conversions start.
+    RegisterCache config(std::make_unique<SpiRegisterBus>(spi.get()),
+                         {{kMax31856Config1, 1, R::kCached}, {kMax31856Config0, 1, R::kCached}},
+                         RegisterCache::kWriteBack);
+    uint8_t cr1 = 0x23; // TypeK, 4sample avg
+    uint8_t cr0 = 0x80; // Automatic conversion
+    Status st = config.Write(kMax31856Config1, &cr1);
+    st |= config.Write(kMax31856Config0, &cr0);
+    if (st.ok()) st = config.Flush();
+    DIE_IF(!st.ok(), "Cannot configure MAX31856: %s", st.human().c_str());
+  }
+
+  SamplingScheduler sched(256);
+  const int mcp_id = sched.AddSensor(&mcp9808, {{kMcp9808RegTemperature, 2}}, std::chrono::seconds(1));
+  const int max_id = sched.AddSensor(&max31856, {{kMax31856Cjth, 5}}, std::chrono::milliseconds(500));
+  DIE_IF(mcp_id < 0 || max_id < 0, "Cannot add the sensors");
+
+  // Subscribe before starting, so nothing is missed.
+  SampleRing<Sample>::Reader reader = sched.ring().NewReader();
+  sched.Start();
+  const auto start = std::chrono::steady_clock::now();
+  std::printf("time_s,sensor,celsius\n");
+  std::vector<Sample> samples(64);
+  uint64_t dropped = 0;
+  while (true) {
+    size_t n = reader.Drain(samples);
+    for (size_t i = 0; i < n; i++) {
+      const Sample &s = samples[i];
+      const double t = std::chrono::duration<double>(s.time - start).count();
+      if (s.sensor == static_cast<uint32_t>(mcp_id)) {
+        uint16_t raw = (s.data[0] << 8) | s.data[1];
+        std::printf("%.6f,mcp9808,%.4f\n", t, static_cast<double>((int16_t)(raw << 3) >> 3) / 16);
+      } else {
+        int32_t tc_data = (s.data[2] << 24) | (s.data[3] << 16) | (s.data[4] << 8);
+        std::printf("%.6f,max31856,%.4f\n", t, static_cast<double>(tc_data >> 13) / 128);
+      }
+    }
+    if (reader.dropped() > dropped) {
+      std::fprintf(stderr, "%lu samples dropped\n", reader.dropped() - dropped);
+      dropped = reader.dropped();
+    }
+    std::fflush(stdout);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
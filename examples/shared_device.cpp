@@ -0,0 +1,67 @@
+// One interface shared by three threads through an FtdiDeviceQueue: a W25Qxx flash (CS ADBUS3)
+// is read by two threads while a third one blinks an LED on ADBUS4.
+// Their requests are coalesced into shared USB transfers.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <ftdi.h>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::FtdiDeviceQueue;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::Status;
+
+int main(int argc, char *argv[]) {
+  std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_A);
+  DIE_IF(dev == nullptr, "Cannot open dev");
+  std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(dev.get(), 0, 0, 10);
+  DIE_IF(spi == nullptr, "Cannot open SPI");
+
+  std::atomic<bool> stop = false;
+  {
+    FtdiDeviceQueue queue(dev.get());
+    std::vector<std::thread> threads;
+    for (uint32_t addr : {0u, 0x1000u}) {
+      threads.emplace_back([&, addr]() {
+        while (!stop) {
+          uint8_t cmd[] = {0x03, static_cast<uint8_t>(addr >> 16), static_cast<uint8_t>(addr >> 8),
+                           static_cast<uint8_t>(addr)};
+          uint8_t data[256];
+          Status st = queue.Run([&](FtdiDevice *) {
+            return spi->BufferTransaction(cmd, {}, data, sizeof(data));
+          });
+          DIE_IF(!st.ok(), "Read at %#x failed: %s", addr, st.human().c_str());
+        }
+      });
+    }
+    threads.emplace_back([&]() {
+      for (int i = 0; !stop; i++) {
+        Status st = queue.UpdateLowerPins((i & 1) << 4, 1 << 4, 1 << 4);
+        DIE_IF(!st.ok(), "Blink failed: %s", st.human().c_str());
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      }
+    });
+
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    stop = true;
+    for (auto &t : threads) t.join();
+    std::printf("%lu requests in %lu batches\n", queue.requests(), queue.batches());
+  }
+  return 0;
+}
@@ -0,0 +1,72 @@
+// Two SPI devices on one interface: a MAX31856 (mode 3, 1 MHz) on ADBUS3 and a W25Qxx flash
+// (mode 0, 30 MHz) on ADBUS4.
+// Each round triggers a conversion and reads the flash ID in one USB write, then reads the
+// temperature.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#include <ftdi.h>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::MpsseSpiBus;
+using mpsse_protocol::Status;
+
+#define MAX31856_WRITE 0x80
+#define MAX31856_CONFIG0 0x00
+#define MAX31856_CONFIG1 0x01
+
+int main(int argc, char *argv[]) {
+  std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_A);
+  DIE_IF(dev == nullptr, "Cannot open dev");
+  std::unique_ptr<MpsseSpiBus> bus = MpsseSpiBus::Create(dev.get());
+  DIE_IF(bus == nullptr, "Cannot open SPI bus");
+  // MAX31856 supportes CPOL=0 or 1 but CPHA must be 1
+  std::unique_ptr<MpsseSpi> tc = bus->AddDevice(3, 1, 1, 1);
+  DIE_IF(tc == nullptr, "Cannot add MAX31856");
+  std::unique_ptr<MpsseSpi> flash = bus->AddDevice(4, 0, 0, 30);
+  DIE_IF(flash == nullptr, "Cannot add flash");
+
+  uint8_t cr1[] = {MAX31856_CONFIG1 | MAX31856_WRITE, 0x23}; // TypeK, 4sample avg, needs 243ms
+  Status st = tc->Transaction(cr1, 2, nullptr, 0);
+  DIE_IF(!st.ok(), "SPI Transaction failed: CR1");
+
+  while (true) {
+    // Both devices in one USB write. The bus switches mode and clock in between.
+    uint8_t trigger[] = {MAX31856_CONFIG0 | MAX31856_WRITE, 0x40}; // One shot
+    uint8_t jedec_cmd[] = {0x9f};
+    uint8_t jedec[3];
+    st = tc->BufferTransaction(trigger, {});
+    st |= flash->BufferTransaction(jedec_cmd, {}, jedec, 3);
+    if (st.ok()) st = bus->Flush();
+    DIE_IF(!st.ok(), "Coalesced transactions failed: %s", st.human().c_str());
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    uint8_t cmd[] = {0xa};
+    uint8_t data[5];
+    st = tc->Transaction(cmd, 1, data, 5);
+    DIE_IF(!st.ok(), "SPI Transaction failed: Read");
+
+    int16_t cj_data = (data[0] << 8) | data[1];
+    int32_t tc_data = (data[2] << 24) | (data[3] << 16) | (data[4] << 8);
+    std::printf("Flash %02x %02x %02x, CJ-TC: %9.2f %9.2f °C\n", jedec[0], jedec[1], jedec[2],
+                static_cast<float>(cj_data >> 2) / 64, static_cast<float>(tc_data >> 13) / 128);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+}
@@ -4,10 +4,13 @@
 
 #include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <span>
 #include <thread>
 
+#include "mpsse_display.h"
 #include "mpsse_protocol.h"
 
 #define DIE_IF(cond, fmt, ...)                                                                          \
@@ -18,8 +21,11 @@
     }                                                                                                   \
   } while (0)
 
+using mpsse_protocol::DirtyFramebuffer;
+using mpsse_protocol::DirtyRect;
 using mpsse_protocol::FtdiDevice;
 using mpsse_protocol::MpsseI2c;
+using mpsse_protocol::MpsseRecording;
 using mpsse_protocol::Status;
 
 // clang-format off
@@ -141,52 +147,104 @@ void fill_char(char ch, uint8_t upper_fbuf[], uint8_t lower_fbuf[], ssize_t fbuf
 
 // SSD1306 has special sequence for I2C commands.
 // First byte is command, followed by data for that command.
-void write_cmd(MpsseI2c *i2c, std::initializer_list<uint32_t> cmd_data) {
-  auto buf = std::make_unique<uint8_t[]>(cmd_data.size() * 2);
+// Returns the bytes in buf.
+size_t encode_cmd(std::initializer_list<uint32_t> cmd_data, uint8_t (&buf)[16]) {
+  DIE_IF(cmd_data.size() * 2 > sizeof(buf), "Too many commands");
   int i = 0;
   for (uint32_t b : cmd_data) {
     buf[i * 2] = 0x80; // Co = 1, D/C# = 0
     buf[i * 2 + 1] = b;
     i++;
   }
-  auto st = i2c->Transaction(OLED_ADDR, buf.get(), cmd_data.size() * 2, nullptr, 0);
+  return cmd_data.size() * 2;
+}
+
+void write_cmd(MpsseI2c *i2c, std::initializer_list<uint32_t> cmd_data) {
+  uint8_t buf[16];
+  const size_t len = encode_cmd(cmd_data, buf);
+  auto st = i2c->BatchTransaction(OLED_ADDR, buf, len, nullptr, 0);
   DIE_IF(!st.ok(), "I2C command error: %s", st.human().c_str());
 }
 
+void buffer_cmd(MpsseI2c *i2c, std::initializer_list<uint32_t> cmd_data) {
+  uint8_t buf[16];
+  const size_t len = encode_cmd(cmd_data, buf);
+  auto st = i2c->BufferTransaction(OLED_ADDR, std::span(buf, len), {});
+  DIE_IF(!st.ok(), "I2C command error: %s", st.human().c_str());
+}
+
+// Initialization sequence according to datasheet
+// QG-2864KMBEG01 Yello & Blue dual color: Vcc Generated by Internal DC/DC Circuit
+// Note the order of the diagram doesn't quite match the code example: code example is used.
+// Recorded once into a file, later runs replay it in one write and check the ACKs in one read.
+void init_display(MpsseI2c *i2c) {
+  constexpr const char *kRecording = "ssd1306_init.mpsse";
+  MpsseRecording init;
+  if (!init.Load(kRecording).ok()) {
+    buffer_cmd(i2c, {0xAE});       /*display off*/
+    buffer_cmd(i2c, {0x00});       /*set lower column address*/
+    buffer_cmd(i2c, {0x10});       /*set higher column address*/
+    buffer_cmd(i2c, {0x40});       /*set display start line*/
+    buffer_cmd(i2c, {0xB0});       /*set page address*/
+    buffer_cmd(i2c, {0x81, 0xcf}); /*contract control*/
+    buffer_cmd(i2c, {0xA1});       /*set segment remap*/
+    buffer_cmd(i2c, {0xA6});       /*normal / reverse*/
+    buffer_cmd(i2c, {0xA8, 0x3F}); /*multiplex ratio, duty = 1/64*/
+    buffer_cmd(i2c, {0xC8});       /*Com scan direction*/
+    buffer_cmd(i2c, {0xD3, 0x00}); /*set display offset*/
+    buffer_cmd(i2c, {0xD5, 0x80}); /*set osc division*/
+    buffer_cmd(i2c, {0xD9, 0xf1}); /*set pre-charge period*/
+    buffer_cmd(i2c, {0xDA, 0x12}); /*set COM pins*/
+    buffer_cmd(i2c, {0xdb, 0x40}); /*set vcomh*/
+    buffer_cmd(i2c, {0x8d, 0x14}); /*set charge pump enable*/
+    buffer_cmd(i2c, {0xAF});       /*display ON*/
+    Status st = i2c->BufferRecord(&init);
+    DIE_IF(!st.ok(), "Cannot record the init sequence: %s", st.human().c_str());
+    st = init.Save(kRecording);
+    if (!st.ok()) std::fprintf(stderr, "%s\n", st.human().c_str());
+  }
+  Status st = i2c->Replay(init);
+  DIE_IF(!st.ok(), "I2C init error: %s", st.human().c_str());
+}
+
 void write_data(MpsseI2c *i2c, const void *data, size_t len) {
-  auto buf = std::make_unique<uint8_t[]>(len + 1);
-  buf[0] = 0x40; // Co=0, D/C# = 1
-  std::copy(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + len, buf.get() + 1);
-  auto st = i2c->Transaction(OLED_ADDR, buf.get(), len + 1, nullptr, 0);
+  const uint8_t control = 0x40; // Co=0, D/C# = 1
+  auto st = i2c->BatchTransaction(OLED_ADDR, std::span(&control, 1),
+                                  std::span(static_cast<const uint8_t *>(data), len));
   DIE_IF(!st.ok(), "I2C data error: %s", st.human().c_str());
 }
 
-void write_text(MpsseI2c *i2c, int line, const char *s) {
+// What the display should show: 8 pages of 128 columns, one byte per column.
+constexpr int kPages = 8;
+constexpr int kColumns = 128;
+uint8_t frame[kPages * kColumns];
+
+// Render into the frame, flush_display() sends it.
+void write_text(int line, const char *s) {
   DIE_IF(line < 0 || line > 3, "invalid line");
 
-  auto ufbuf = std::make_unique<uint8_t[]>(128);
-  auto lfbuf = std::make_unique<uint8_t[]>(128);
-  std::memset(ufbuf.get(), 0, 128);
-  std::memset(lfbuf.get(), 0, 128);
+  uint8_t *ufbuf = frame + line * 2 * kColumns;
+  uint8_t *lfbuf = ufbuf + kColumns;
+  std::memset(ufbuf, 0, kColumns);
+  std::memset(lfbuf, 0, kColumns);
   int col = 0;
   while (*s != '\0') {
-    fill_char(*s, ufbuf.get(), lfbuf.get(), 128, &col);
+    fill_char(*s, ufbuf, lfbuf, kColumns, &col);
     s++;
   }
-
-  write_cmd(i2c, {0xB0u + line * 2});
-  write_data(i2c, ufbuf.get(), 128);
-  write_cmd(i2c, {0xB0u + line * 2 + 1});
-  write_data(i2c, lfbuf.get(), 128);
 }
 
-void clear_screen(MpsseI2c *i2c) {
-  auto fbuf = std::make_unique<uint8_t[]>(128);
-  std::memset(fbuf.get(), 0, 128);
-  for (int i = 0; i < 8; i++) {
-    write_cmd(i2c, {0xB0u + i});
-    write_data(i2c, fbuf.get(), 128);
-  }
+// Send the changed parts of the frame. A window costs a few command bytes and a round trip, worth
+// about 16 data bytes at 100 kHz.
+void flush_display(MpsseI2c *i2c, DirtyFramebuffer *fb) {
+  Status st = fb->Update(frame, [i2c](const DirtyRect &rect, std::span<const uint8_t> data) {
+    for (int page = rect.y0; page < rect.y1; page++) {
+      write_cmd(i2c, {0xB0u + page, 0x00u | (rect.x0 & 0xf), 0x10u | (rect.x0 >> 4)});
+      write_data(i2c, data.data() + (page - rect.y0) * rect.width(), rect.width());
+    }
+    return Status::Ok();
+  });
+  DIE_IF(!st.ok(), "Display update failed: %s", st.human().c_str());
 }
 
 int main(int argc, char *argv[]) {
@@ -195,28 +253,11 @@ int main(int argc, char *argv[]) {
   std::unique_ptr<MpsseI2c> i2c = MpsseI2c::Create(dev.get(), /*khz=*/100);
   DIE_IF(i2c == nullptr, "Cannot open i2c");
 
-  // Initialization sequence according to datasheet
-  // QG-2864KMBEG01 Yello & Blue dual color: Vcc Generated by Internal DC/DC Circuit
-  // Note the order of the diagram doesn't quite match the code example: code example is used.
-  write_cmd(i2c.get(), {0xAE});       /*display off*/
-  write_cmd(i2c.get(), {0x00});       /*set lower column address*/
-  write_cmd(i2c.get(), {0x10});       /*set higher column address*/
-  write_cmd(i2c.get(), {0x40});       /*set display start line*/
-  write_cmd(i2c.get(), {0xB0});       /*set page address*/
-  write_cmd(i2c.get(), {0x81, 0xcf}); /*contract control*/
-  write_cmd(i2c.get(), {0xA1});       /*set segment remap*/
-  write_cmd(i2c.get(), {0xA6});       /*normal / reverse*/
-  write_cmd(i2c.get(), {0xA8, 0x3F}); /*multiplex ratio, duty = 1/64*/
-  write_cmd(i2c.get(), {0xC8});       /*Com scan direction*/
-  write_cmd(i2c.get(), {0xD3, 0x00}); /*set display offset*/
-  write_cmd(i2c.get(), {0xD5, 0x80}); /*set osc division*/
-  write_cmd(i2c.get(), {0xD9, 0xf1}); /*set pre-charge period*/
-  write_cmd(i2c.get(), {0xDA, 0x12}); /*set COM pins*/
-  write_cmd(i2c.get(), {0xdb, 0x40}); /*set vcomh*/
-  write_cmd(i2c.get(), {0x8d, 0x14}); /*set charge pump enable*/
-  write_cmd(i2c.get(), {0xAF});       /*display ON*/
-
-  clear_screen(i2c.get());
+  init_display(i2c.get());
+
+  DirtyFramebuffer fb(kColumns, kPages, /*cell_bytes=*/1, /*window_overhead=*/16);
+  // The first update clears the whole screen.
+  flush_display(i2c.get(), &fb);
   std::printf("Display initialized\n");
 
   char sbuf[128];
@@ -224,7 +265,7 @@ int main(int argc, char *argv[]) {
   while (true) {
     for (int i = 0; i < 1; i++) {
       std::sprintf(sbuf, "Ctr: %d%%", counter * (i + 1));
-      write_text(i2c.get(), i, sbuf);
+      write_text(i, sbuf);
     }
 
     int mod = counter % 150;
@@ -234,10 +275,12 @@ int main(int argc, char *argv[]) {
         for (int j = 0; j < 10; j++) {
           s += static_cast<char>(0x20 + (mod / 50) * 30 + i * 10 + j);
         }
-        write_text(i2c.get(), i, s.c_str());
+        write_text(i, s.c_str());
       }
     }
 
+    flush_display(i2c.get(), &fb);
+
     counter++;
     usleep(100'000);
   }
@@ -1,13 +1,19 @@
 // Tested on https://www.lcdwiki.com/4.0inch_Capacitive_SPI_Module_ST7796
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <array>
+#include <cctype>
 #include <chrono>
 #include <cstdint>
 #include <initializer_list>
 #include <memory>
 #include <opencv2/opencv.hpp>
+#include <span>
+#include <string>
 #include <thread>
 
+#include "mpsse_display.h"
 #include "mpsse_protocol.h"
 
 #define DIE_IF(cond, fmt, ...)                                                                          \
@@ -28,14 +34,19 @@
   do {                                                                                                  \
     Status s = (st);                                                                                    \
     if (!s.ok()) {                                                                                      \
-      fprintf(stderr, "%s\n", st.human().c_str());                                                      \
+      fprintf(stderr, "%s\n", s.human().c_str());                                                       \
       exit(1);                                                                                          \
     }                                                                                                   \
   } while (0)
 
+using mpsse_protocol::DirtyFramebuffer;
+using mpsse_protocol::DirtyRect;
 using mpsse_protocol::FtdiDevice;
 using mpsse_protocol::MpsseGpio;
+using mpsse_protocol::MpsseRecording;
 using mpsse_protocol::MpsseSpi;
+using mpsse_protocol::Rgb888Image;
+using mpsse_protocol::Rotation;
 using mpsse_protocol::Status;
 
 #define CMD_RDID1 0xda
@@ -61,20 +72,27 @@ public:
   // }
 
   // Issue one byte command then multiple params
-  Status CommandWrite(uint8_t cmd, std::initializer_list<uint8_t> params) {
-    std::vector<uint8_t> p{params.begin(), params.end()};
-
-    RETURN_IF_ERR(BufferCommand());
-    RETURN_IF_ERR(spi_->Transaction(&cmd, 1, nullptr, 0));
-    if (p.size() > 0) {
-      RETURN_IF_ERR(BufferData());
-      RETURN_IF_ERR(spi_->Transaction(p.data(), p.size(), nullptr, 0));
+  // Command and parameters straight from the list into the buffer.
+  Status BufferCommandWrite(uint8_t cmd, std::initializer_list<uint8_t> params) {
+    Status st = BufferCommand();
+    st |= spi_->BufferTransaction(std::span(&cmd, 1), {});
+    if (params.size() > 0) {
+      st |= BufferData();
+      st |= spi_->BufferTransaction(std::span(params.begin(), params.size()), {});
     }
-    return Status::Ok();
+    return st;
+  }
+
+  Status CommandWrite(uint8_t cmd, std::initializer_list<uint8_t> params) {
+    Status st = BufferCommandWrite(cmd, params);
+    if (st.ok()) st = spi_->Flush();
+    if (!st.ok()) spi_->BufferClear();
+    return st;
   }
 
   // Drive nRST pin Low then high.
   Status Reset() {
+    fb_.Invalidate();
     gpio_->SetLowerPins(0b0000'0000, 0b0011'0000);
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     gpio_->SetLowerPins(0b0010'0000, 0b0011'0000);
@@ -82,35 +100,63 @@ public:
     return Status::Ok();
   }
 
+  // Encoded once and replayed in one write, from a file after the first run.
   Status Init() {
+    if (init_.empty() && !init_.Load(kInitRecording).ok()) {
+      Status st = BufferInit();
+      if (!st.ok()) {
+        spi_->BufferClear();
+        return st;
+      }
+      spi_->BufferRecord(&init_);
+      Status saved = init_.Save(kInitRecording);
+      if (!saved.ok()) std::fprintf(stderr, "%s\n", saved.human().c_str());
+    }
+    RETURN_IF_ERR(spi_->Replay(init_));
+    return window_.empty() ? RecordWindow() : Status::Ok();
+  }
+
+  // The whole init sequence, buffered.
+  Status BufferInit() {
     // clang-format off
     // 0xf0 control was here
-    RETURN_IF_ERR(CommandWrite(0x36, {0x48}));       // MADCTL = MX | RGB (BGR?)
-    RETURN_IF_ERR(CommandWrite(0x3a, {0x05}));       // Intf Pixel Fmt = D2 | D0 (16bit)
-    RETURN_IF_ERR(CommandWrite(0xb0, {0x80}));       // IFMODE = SPI_EN !! Why is this bit set?
-    RETURN_IF_ERR(CommandWrite(0xb6, {0x00, 0x02})); // !! datasheet say has 3 param, why only 2 here?
-    RETURN_IF_ERR(CommandWrite(0xb5, {0x02, 0x03, 0x00, 0x04})); // Blank porch control
-    RETURN_IF_ERR(CommandWrite(0xb1, {0x80, 0x10}));             // Frame rate control
-    RETURN_IF_ERR(CommandWrite(0xb4, {0x00}));                   // Display inversion control
-    RETURN_IF_ERR(CommandWrite(0xb7, {0xc6}));                   // Entry mode set
-    RETURN_IF_ERR(CommandWrite(0xc5, {0x1c}));                   // Vcom ctrl - some voltage stuff?
-    RETURN_IF_ERR(CommandWrite(0xe4, {0x31}));                   // !! undocumented cmd
-    RETURN_IF_ERR(CommandWrite(0xe8, {0x40, 0x8A, 0x00, 0x00, 0x29, 0x19, 0xA5, 0x33}));
-                                                                 // Display output ctrl adjust
-    RETURN_IF_ERR(CommandWrite(0xc2, {})); // Power ctrl 3 !! where's the param?
-    RETURN_IF_ERR(CommandWrite(0xa7, {})); // !! undocumented cmd
-    RETURN_IF_ERR(CommandWrite(0xe0, {0xF0, 0x09, 0x13, 0x12, 0x12, 0x2B, 0x3C, 0x44, 0x4B, 0x1B, 0x18, 0x17, 0x1D, 0x21}));
-                                           // positive gamma ctrl
-    RETURN_IF_ERR(CommandWrite(0xe1, {0xF0, 0x09, 0x13, 0x0C, 0x0D, 0x27, 0x3B, 0x44, 0x4D, 0x0B, 0x17, 0x17, 0x1D, 0x21}));
-                                           // negative gamma ctrl
+    RETURN_IF_ERR(BufferCommandWrite(0x36, {0x48}));       // MADCTL = MX | RGB (BGR?)
+    RETURN_IF_ERR(BufferCommandWrite(0x3a, {0x05}));       // Intf Pixel Fmt = D2 | D0 (16bit)
+    RETURN_IF_ERR(BufferCommandWrite(0xb0, {0x80}));       // IFMODE = SPI_EN !! Why is this bit set?
+    RETURN_IF_ERR(BufferCommandWrite(0xb6, {0x00, 0x02})); // !! datasheet say has 3 param, why only 2 here?
+    RETURN_IF_ERR(BufferCommandWrite(0xb5, {0x02, 0x03, 0x00, 0x04})); // Blank porch control
+    RETURN_IF_ERR(BufferCommandWrite(0xb1, {0x80, 0x10}));             // Frame rate control
+    RETURN_IF_ERR(BufferCommandWrite(0xb4, {0x00}));                   // Display inversion control
+    RETURN_IF_ERR(BufferCommandWrite(0xb7, {0xc6}));                   // Entry mode set
+    RETURN_IF_ERR(BufferCommandWrite(0xc5, {0x1c}));                   // Vcom ctrl - some voltage stuff?
+    RETURN_IF_ERR(BufferCommandWrite(0xe4, {0x31}));                   // !! undocumented cmd
+    RETURN_IF_ERR(BufferCommandWrite(0xe8, {0x40, 0x8A, 0x00, 0x00, 0x29, 0x19, 0xA5, 0x33}));
+                                                                       // Display output ctrl adjust
+    RETURN_IF_ERR(BufferCommandWrite(0xc2, {})); // Power ctrl 3 !! where's the param?
+    RETURN_IF_ERR(BufferCommandWrite(0xa7, {})); // !! undocumented cmd
+    RETURN_IF_ERR(BufferCommandWrite(0xe0, {0xF0, 0x09, 0x13, 0x12, 0x12, 0x2B, 0x3C, 0x44, 0x4B, 0x1B, 0x18, 0x17, 0x1D, 0x21}));
+                                                 // positive gamma ctrl
+    RETURN_IF_ERR(BufferCommandWrite(0xe1, {0xF0, 0x09, 0x13, 0x0C, 0x0D, 0x27, 0x3B, 0x44, 0x4D, 0x0B, 0x17, 0x17, 0x1D, 0x21}));
+                                                 // negative gamma ctrl
     // 0xf0 control was here
-    RETURN_IF_ERR(CommandWrite(0x13, {})); // normal display mode on
-    RETURN_IF_ERR(CommandWrite(0x11, {})); // sleep out
-    RETURN_IF_ERR(CommandWrite(0x29, {})); // display on
+    RETURN_IF_ERR(BufferCommandWrite(0x13, {})); // normal display mode on
+    RETURN_IF_ERR(BufferCommandWrite(0x11, {})); // sleep out
+    RETURN_IF_ERR(BufferCommandWrite(0x29, {})); // display on
     // clang-format on
     return Status::Ok();
   }
 
+  // Fastest clock RDDID (0xd3) reads back the ID at. The 9 dummy bits are masked off.
+  Status CalibrateClock(uint16_t id) {
+    const uint8_t cmd = 0xd3;
+    const uint32_t bits = static_cast<uint32_t>(id) << 7;
+    const uint8_t expected[] = {0, static_cast<uint8_t>(bits >> 16), static_cast<uint8_t>(bits >> 8),
+                                static_cast<uint8_t>(bits)};
+    const uint8_t mask[] = {0x00, 0x7f, 0xff, 0x80};
+    RETURN_IF_ERR(BufferCommand());
+    return spi_->CalibrateCached("spi_clock.txt", "st7796s", std::span(&cmd, 1), expected, mask, 30);
+  }
+
   Status ReadId(uint16_t *id) {
     uint32_t tmp;
     uint8_t cmd = 0xd3;
@@ -124,109 +170,161 @@ public:
     return Status::Ok();
   }
 
+  // Send the parts of a 320x480 RGB565 frame that changed since the last one.
+  Status DrawFrame(std::span<const uint8_t> frame) {
+    return fb_.Update(frame, [this](const DirtyRect &rect, std::span<const uint8_t> data) {
+      RETURN_IF_ERR(BufferWindow(rect));
+      return spi_->Transaction(data.data(), data.size(), nullptr, 0);
+    });
+  }
+
   Status FillColor(uint16_t color565) {
-    constexpr int kTotalBytes = 320 * 480 * 2;
-    int sent = 0;
-    auto buf = std::make_unique<uint8_t[]>(kTotalBytes);
+    frame_.resize(kFrameBytes);
     for (int i = 0; i < 320 * 480; i++) {
-      buf[i * 2] = color565 >> 8;
-      buf[i * 2 + 1] = color565;
+      frame_[i * 2] = color565 >> 8;
+      frame_[i * 2 + 1] = color565;
     }
+    return DrawFrame(frame_);
+  }
 
-    RETURN_IF_ERR(CommandWrite(0x2a, {0, 0, 1, 0x3f})); // column = [0, 320)
-    RETURN_IF_ERR(CommandWrite(0x2b, {0, 0, 1, 0xdf})); // column = [0, 480)
-    RETURN_IF_ERR(CommandWrite(0x2c, {}));
-    RETURN_IF_ERR(BufferData());
-    while (sent < kTotalBytes) {
-      int to_send = kTotalBytes - sent;
-      if (to_send > 30720) to_send = 30720;
-      RETURN_IF_ERR(spi_->Transaction(buf.get() + sent, to_send, nullptr, 0));
-      sent += to_send;
-    }
-    return Status::Ok();
+  Status FillPic(const std::vector<uint8_t> &data) {
+    DIE_IF(data.size() != kFrameBytes, "invalid data size");
+    return DrawFrame(data);
   }
 
-  Status FillPic(const std::vector<uint8_t> data) {
-    constexpr int kTotalBytes = 320 * 480 * 2;
-    int sent = 0;
-    DIE_IF(data.size() != kTotalBytes, "invalid data size");
+  // Convert and send a whole frame, double buffered: the conversion into one buffer overlaps the
+  // transmission of the other. Bypasses the dirty tracking, video changes everywhere anyway.
+  Status StreamFrame(const Rgb888Image &src, Rotation rotation) {
+    const int index = stream_index_;
+    stream_index_ ^= 1;
+    // The transfer from two frames ago may still be reading this buffer.
+    RETURN_IF_ERR(spi_->Wait(stream_tickets_[index]));
+    std::vector<uint8_t> &buf = stream_bufs_[index];
+    buf.resize(kFrameBytes);
+    RETURN_IF_ERR(mpsse_protocol::ConvertToRgb565(src, rotation, 320, 480, buf));
+    fb_.Invalidate();
+    RETURN_IF_ERR(BufferWindow({0, 0, 320, 480}));
+    return spi_->TransactionAsync(buf.data(), buf.size(), &stream_tickets_[index]);
+  }
+
+private:
+  static constexpr size_t kFrameBytes = 320 * 480 * 2;
+  // Setting a window is buffered into the same USB write as its pixels, so it costs about one
+  // round trip, a few hundred pixels at 10 MHz.
+  static constexpr int kWindowOverhead = 512;
+
+  static constexpr const char *kInitRecording = "st7796s_init.mpsse";
+
+  static std::array<uint8_t, 4> Be16Pair(int v0, int v1) {
+    return {static_cast<uint8_t>(v0 >> 8), static_cast<uint8_t>(v0), static_cast<uint8_t>(v1 >> 8),
+            static_cast<uint8_t>(v1)};
+  }
 
-    RETURN_IF_ERR(CommandWrite(0x2a, {0, 0, 1, 0x3f})); // column = [0, 320)
-    RETURN_IF_ERR(CommandWrite(0x2b, {0, 0, 1, 0xdf})); // column = [0, 480)
-    RETURN_IF_ERR(CommandWrite(0x2c, {}));
+  // Buffer CASET, RASET and RAMWR for the rect, leaving D/C on data. Replays the recorded
+  // commands with the columns and rows patched in.
+  Status BufferWindow(const DirtyRect &rect) {
+    const auto cols = Be16Pair(rect.x0, rect.x1 - 1);
+    const auto rows = Be16Pair(rect.y0, rect.y1 - 1);
+    const std::span<const uint8_t> patches[] = {cols, rows};
+    return spi_->BufferReplay(window_, nullptr, patches);
+  }
+
+  Status BufferWindowCommands(std::span<const uint8_t> cols, std::span<const uint8_t> rows) {
+    const uint8_t caset = 0x2a, raset = 0x2b, ramwr = 0x2c;
+    RETURN_IF_ERR(BufferCommand());
+    RETURN_IF_ERR(spi_->BufferTransaction({&caset, 1}, {}));
     RETURN_IF_ERR(BufferData());
-    while (sent < kTotalBytes) {
-      int to_send = kTotalBytes - sent;
-      if (to_send > 30720) to_send = 30720;
-      RETURN_IF_ERR(spi_->Transaction(data.data() + sent, to_send, nullptr, 0));
-      sent += to_send;
+    RETURN_IF_ERR(spi_->BufferTransaction(cols, {}));
+    RETURN_IF_ERR(BufferCommand());
+    RETURN_IF_ERR(spi_->BufferTransaction({&raset, 1}, {}));
+    RETURN_IF_ERR(BufferData());
+    RETURN_IF_ERR(spi_->BufferTransaction(rows, {}));
+    RETURN_IF_ERR(BufferCommand());
+    RETURN_IF_ERR(spi_->BufferTransaction({&ramwr, 1}, {}));
+    return BufferData();
+  }
+
+  // Record the window commands with placeholders in the slots, values no command here encodes.
+  Status RecordWindow() {
+    const uint8_t cols[] = {0xa5, 0x5a, 0xc3, 0x3c};
+    const uint8_t rows[] = {0x96, 0x69, 0x0f, 0xf0};
+    Status st = BufferWindowCommands(cols, rows);
+    if (!st.ok()) {
+      spi_->BufferClear();
+      return st;
+    }
+    spi_->BufferRecord(&window_);
+    if (window_.FindSlot(cols) != 0 || window_.FindSlot(rows) != 1) {
+      window_ = {};
+      return Status::Err("Window placeholders not found");
     }
     return Status::Ok();
   }
 
-private:
   MpsseSpi *spi_;
   MpsseGpio *gpio_;
+  DirtyFramebuffer fb_{320, 480, /*cell_bytes=*/2, kWindowOverhead};
+  std::vector<uint8_t> frame_;
+  std::vector<uint8_t> stream_bufs_[2];
+  FtdiDevice::Ticket stream_tickets_[2] = {0, 0};
+  int stream_index_ = 0;
+  MpsseRecording init_;
+  MpsseRecording window_;
 };
 
-// AI-generated code.
+// Scale `src` to fit the portrait panel once rotated, landscape sources are turned
+// counterclockwise. `scaled` holds the pixels the returned image points to.
+Rgb888Image FitToPanel(const cv::Mat &src, cv::Mat *scaled, Rotation *rotation) {
+  *rotation = src.cols > src.rows ? Rotation::k270 : Rotation::k0;
+  const bool swap = *rotation == Rotation::k270;
+  const int w = swap ? 480 : 320;
+  const int h = swap ? 320 : 480;
+  const double scale = std::min(static_cast<double>(w) / src.cols, static_cast<double>(h) / src.rows);
+  cv::resize(src, *scaled, cv::Size(src.cols * scale, src.rows * scale), 0, 0, cv::INTER_AREA);
+  return {scaled->data, scaled->cols, scaled->rows, scaled->step, /*bgr=*/true};
+}
+
 std::vector<uint8_t> LoadPicture(std::string path) {
   cv::Mat src = cv::imread(path);
   DIE_IF(src.empty(), "cannot open image");
+  cv::Mat scaled;
+  Rotation rotation;
+  Rgb888Image image = FitToPanel(src, &scaled, &rotation);
+  std::vector<uint8_t> frame(320 * 480 * 2);
+  DIE_IF_ERR(mpsse_protocol::ConvertToRgb565(image, rotation, 320, 480, frame));
+  return frame;
+}
 
-  if (src.cols > src.rows) {
-    cv::rotate(src, src, cv::ROTATE_90_COUNTERCLOCKWISE);
+// Play a video file, or a camera given by its index, as fast as the SPI clock allows.
+void PlayVideo(St7796sController *lcd, const std::string &source) {
+  cv::VideoCapture capture;
+  if (!source.empty() && std::all_of(source.begin(), source.end(), [](unsigned char c) { return std::isdigit(c); })) {
+    capture.open(std::stoi(source));
+  } else {
+    capture.open(source);
   }
-
-  // Calculate aspect ratio and scaling
-  double scale = std::min((double)320 / src.cols, (double)480 / src.rows);
-  int new_w = static_cast<int>(src.cols * scale);
-  int new_h = static_cast<int>(src.rows * scale);
-
-  // Resize the image to fit the scale
-  cv::Mat resized;
-  cv::resize(src, resized, cv::Size(new_w, new_h), 0, 0, 3);
-
-  // Create a black canvas (480x320) and center the resized image
-  cv::Mat canvas = cv::Mat::zeros(cv::Size(320, 480), CV_8UC3);
-
-  int x_offset = (320 - new_w) / 2;
-  int y_offset = (480 - new_h) / 2;
-
-  // Copy resized image into the center of the black canvas
-  resized.copyTo(canvas(cv::Rect(x_offset, y_offset, new_w, new_h)));
-
-  // 2. Create a vector (array) to store the 16-bit RGB565 values
-  std::vector<uint8_t> rgb565_array;
-  rgb565_array.reserve(320 * 480 * 2);
-
-  // 3. Process pixels
-  for (int r = 0; r < 480; ++r) {
-    for (int c = 0; c < 320; ++c) {
-      // Get the BGR pixel
-      cv::Vec3b pixel = canvas.at<cv::Vec3b>(r, c);
-      uint8_t b = pixel[0];
-      uint8_t g = pixel[1];
-      uint8_t r_val = pixel[2];
-
-      // 4. Convert to RGB565
-      uint16_t rgb565 = ((r_val & 0xF8) << 8) | ((g & 0xFC) << 3) | ((b & 0xF8) >> 3);
-
-      rgb565_array.push_back(rgb565 >> 8);
-      rgb565_array.push_back(rgb565);
+  DIE_IF(!capture.isOpened(), "cannot open %s", source.c_str());
+
+  cv::Mat src, scaled;
+  Rotation rotation;
+  int frames = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (capture.read(src)) {
+    DIE_IF_ERR(lcd->StreamFrame(FitToPanel(src, &scaled, &rotation), rotation));
+    if (++frames % 100 == 0) {
+      auto now = std::chrono::steady_clock::now();
+      std::printf("%.1f fps\n", 100 / std::chrono::duration<double>(now - start).count());
+      start = now;
     }
   }
-
-  return rgb565_array;
 }
 
 int main(int argc, char *argv[]) {
   std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_A);
   DIE_IF(dev == nullptr, "Cannot open dev");
-  // Id read command gives wrong data at 15MHz
-  // The next available is 10MHz
-  // Max: 10 * 1e6 / (320*480*2*8) = 4fps
-  std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(dev.get(), 0, 0, 10);
+  // Start slow, then calibrate. On the tested module the ID read fails at 15MHz, 10MHz is the
+  // next divisor: 10 * 1e6 / (320*480*2*8) = 4fps.
+  std::unique_ptr<MpsseSpi> spi = MpsseSpi::Create(dev.get(), 0, 0, 1);
   DIE_IF(spi == nullptr, "Cannot open SPI");
   MpsseGpio gpio = spi->Gpio();
 
@@ -238,9 +336,13 @@ int main(int argc, char *argv[]) {
     uint16_t id;
     DIE_IF_ERR(lcd.ReadId(&id));
     std::printf("LCD ID: %#x\n", id);
+    DIE_IF_ERR(lcd.CalibrateClock(id));
+    std::printf("SPI clock: %.02f MHz\n", spi->clk_mhz());
   }
 
-  if (argc >= 2) {
+  if (argc >= 3 && std::string(argv[1]) == "--video") {
+    PlayVideo(&lcd, argv[2]);
+  } else if (argc >= 2) {
     auto pic_data = LoadPicture(argv[1]);
     lcd.FillPic(pic_data);
     while (true) {
@@ -5,6 +5,7 @@
 #include <memory>
 #include <thread>
 #include <string>
+#include <vector>
 
 #include <arpa/inet.h>
 #include <ftdi.h>
@@ -72,20 +73,30 @@ int main(int argc, char *argv[]) {
     for (int i = 0; i < 30; i++)
       led->SendFrame({frame.get(), 1024});
   } else if (mode == "flow") {
-    auto frame = std::make_unique<uint32_t[]>(144);
-    std::memset(frame.get(), 0, 144 * 4);
-    int prev = 0;
-    int count = 1;
-    while (true) {
+    // One dot running around, 20 steps per second.
+    led->Animate(144, 20, [](uint64_t frame, std::vector<uint32_t> *rgb) {
+      int pos = frame % 144;
       int r, g, b;
-      HsvToRgb(static_cast<double>(count) / 144.0, 1, 1, r, g, b);
-      frame[prev] = 0;
-      frame[count] = ((r&0xff) << 16) | ((g&0xff) << 8) | (b&0xff);
-      led->SendFrame({frame.get(), 144});
-      prev = count;
-      count = (count+1) % 144;
-      std::this_thread::sleep_for(std::chrono::milliseconds(50));
-    }
+      HsvToRgb(static_cast<double>(pos) / 144.0, 1, 1, r, g, b);
+      (*rgb)[pos] = ((r&0xff) << 16) | ((g&0xff) << 8) | (b&0xff);
+      return true;
+    });
+  } else if (mode == "rainbow") {
+    // 10 seconds of a moving rainbow, then report how steady the frame rate was.
+    double fps = argc >= 3 ? std::stod(argv[2]) : 60;
+    MpsseWs2812b::AnimationStats stats;
+    auto st = led->Animate(144, fps, [fps](uint64_t frame, std::vector<uint32_t> *rgb) {
+      for (int i = 0; i < 144; i++) {
+        int r, g, b;
+        double h = (i + frame) % 144 / 144.0;
+        HsvToRgb(h, 1, 0.2, r, g, b);
+        (*rgb)[i] = ((r&0xff) << 16) | ((g&0xff) << 8) | (b&0xff);
+      }
+      return frame < fps * 10;
+    }, &stats);
+    DIE_IF(!st.ok(), "Animate() failed: %s", st.human().c_str());
+    std::printf("Sent %lu frames, dropped %lu, %.2f FPS\n", static_cast<unsigned long>(stats.frames_sent),
+                static_cast<unsigned long>(stats.frames_dropped), stats.achieved_fps);
   } else {
     std::fprintf(stderr, "Unknown mode %s\n", mode.c_str());
   }
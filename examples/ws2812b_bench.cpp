@@ -0,0 +1,80 @@
+// Benchmark of the WS2812B symbol encoder. No hardware needed.
+// Compares the table driven MpsseWs2812b::Encode() with the bit by bit ExpandByte() it replaced,
+// including the per-frame allocation the old SendFrame() did.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::MpsseWs2812b;
+
+namespace {
+
+// What SendFrame() used to do before encoding into its persistent buffer.
+std::unique_ptr<uint8_t[]> EncodeOld(const std::vector<uint32_t> &rgb) {
+  auto raw = std::make_unique<uint8_t[]>(rgb.size() * 9);
+  for (size_t i = 0; i < rgb.size(); i++) {
+    MpsseWs2812b::ExpandByte((rgb[i] >> 16) & 0xff, raw.get() + i * 9 + 3);
+    MpsseWs2812b::ExpandByte((rgb[i] >> 8) & 0xff, raw.get() + i * 9);
+    MpsseWs2812b::ExpandByte((rgb[i]) & 0xff, raw.get() + i * 9 + 6);
+  }
+  return raw;
+}
+
+template <typename F>
+double LedsPerSecond(size_t leds, int frames, F encode_frame) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < frames; i++) encode_frame();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return leds * frames / elapsed;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t leds = 1024;
+  if (argc >= 2) leds = std::stoul(argv[1]);
+  int frames = 2000;
+  if (argc >= 3) frames = std::stoi(argv[2]);
+
+  std::mt19937 gen(1);
+  std::vector<uint32_t> rgb(leds);
+  for (auto &c : rgb) c = gen() & 0xffffff;
+
+  // Both must produce the same symbols.
+  std::vector<uint8_t> encoded(leds * 9);
+  MpsseWs2812b::Encode(rgb, encoded.data());
+  auto reference = EncodeOld(rgb);
+  DIE_IF(std::memcmp(encoded.data(), reference.get(), leds * 9) != 0, "Encoders disagree");
+
+  // Keep the results observable so the loops aren't optimized out.
+  volatile uint8_t sink = 0;
+  double old_rate = LedsPerSecond(leds, frames, [&]() {
+    auto raw = EncodeOld(rgb);
+    sink = sink + raw[leds * 9 - 1];
+  });
+  double new_rate = LedsPerSecond(leds, frames, [&]() {
+    MpsseWs2812b::Encode(rgb, encoded.data());
+    sink = sink + encoded[leds * 9 - 1];
+  });
+
+  std::printf("%zu LEDs x %d frames\n", leds, frames);
+  std::printf("ExpandByte + alloc: %8.2f MLED/s\n", old_rate / 1e6);
+  std::printf("Encode (table)    : %8.2f MLED/s (%.1fx)\n", new_rate / 1e6, new_rate / old_rate);
+  return 0;
+}
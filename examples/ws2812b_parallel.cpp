@@ -0,0 +1,60 @@
+// Drive 8 WS2812B strips at once, one per ADBUS pin.
+// Every strip runs a dot around, each one a step ahead of the previous strip.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ftdi.h>
+
+#include "mpsse_protocol.h"
+
+#define DIE_IF(cond, fmt, ...)                                                                          \
+  do {                                                                                                  \
+    if (cond) {                                                                                         \
+      fprintf(stderr, fmt "\n", ##__VA_ARGS__);                                                         \
+      exit(1);                                                                                          \
+    }                                                                                                   \
+  } while (0)
+
+using mpsse_protocol::FtdiDevice;
+using mpsse_protocol::ParallelWs2812b;
+using mpsse_protocol::Status;
+
+int main(int argc, char *argv[]) {
+  constexpr int kStrips = 8;
+  int leds = 144;
+  if (argc >= 2) leds = std::stoi(argv[1]);
+
+  std::unique_ptr<FtdiDevice> dev = FtdiDevice::OpenVendorProduct(0x0403, 0x6010, INTERFACE_A);
+  DIE_IF(dev == nullptr, "Cannot open dev");
+  std::unique_ptr<ParallelWs2812b> strips = ParallelWs2812b::Create(dev.get());
+  DIE_IF(strips == nullptr, "Cannot open strips");
+
+  std::vector<std::vector<uint32_t>> frames(kStrips, std::vector<uint32_t>(leds, 0));
+  std::vector<std::span<const uint32_t>> channels(frames.begin(), frames.end());
+  const uint32_t colors[] = {0x200000, 0x002000, 0x000020, 0x202000,
+                             0x002020, 0x200020, 0x202020, 0x100800};
+
+  auto start = std::chrono::steady_clock::now();
+  for (int step = 0;; step++) {
+    for (int s = 0; s < kStrips; s++) {
+      frames[s][(step + s + leds - 1) % leds] = 0;
+      frames[s][(step + s) % leds] = colors[s];
+    }
+    Status st = strips->SendFrames(channels);
+    DIE_IF(!st.ok(), "SendFrames() failed: %s", st.human().c_str());
+
+    if (step % 100 == 99) {
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      std::printf("%.1f FPS, %.0f LED/s\n", 100 / elapsed, 100 * kStrips * leds / elapsed);
+      start = std::chrono::steady_clock::now();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef __MPSSE_DISPLAY_H__
+#define __MPSSE_DISPLAY_H__
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+namespace mpsse_protocol {
+
+// ========================== //
+//  Dirty rectangle tracking  //
+// ========================== //
+
+// Cells [x0, x1) x [y0, y1).
+struct DirtyRect {
+  int x0, y0, x1, y1;
+
+  int width() const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+  int64_t area() const { return static_cast<int64_t>(width()) * height(); }
+};
+
+// Keeps a copy of what the display shows, and sends only the windows that changed in a new frame.
+//
+// A frame is width x height cells of cell_bytes each, row major. A cell is a pixel on RGB565
+// panels (2 bytes), or one column byte of a page on SSD1306 style displays (1 byte, a row is a
+// page).
+//
+// Changed cells are grouped into rectangles, and two rectangles are merged whenever sending the
+// merged one is cheaper: setting up a window costs `window_overhead` cells worth of bus time
+// (address commands, CS toggles, USB round trips), so a few unchanged cells in between are cheaper
+// to resend than an extra window.
+class DirtyFramebuffer {
+public:
+  // Send one window. `data` is the rect's cells, row by row, and is only valid during the call.
+  using SendFn = std::function<Status(const DirtyRect &rect, std::span<const uint8_t> data)>;
+
+  DirtyFramebuffer(int width, int height, int cell_bytes, int window_overhead);
+
+  // Send the parts of `frame` that differ from the last frame sent. The first update, and the one
+  // after Invalidate(), sends everything. The frame is only remembered if all sends succeed.
+  Status Update(std::span<const uint8_t> frame, const SendFn &send);
+  // Forget what the display shows, e.g. after it was reset.
+  void Invalidate() { valid_ = false; }
+
+  // The windows Update() would send for `frame`.
+  const std::vector<DirtyRect> &Diff(std::span<const uint8_t> frame);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int cell_bytes() const { return cell_bytes_; }
+  size_t frame_bytes() const { return shown_.size(); }
+
+private:
+  // Mergeable if the union costs no more than both rects sent separately.
+  bool WorthMerging(const DirtyRect &a, const DirtyRect &b) const;
+  static DirtyRect Union(const DirtyRect &a, const DirtyRect &b);
+
+  const int width_;
+  const int height_;
+  const int cell_bytes_;
+  const int window_overhead_;
+  bool valid_ = false;
+  // What the display shows.
+  std::vector<uint8_t> shown_;
+  std::vector<DirtyRect> rects_;
+  // Scratch space for windows narrower than the frame.
+  std::vector<uint8_t> window_data_;
+};
+
+// ======================== //
+//  RGB565 frame conversion  //
+// ======================== //
+
+// Clockwise.
+enum class Rotation { k0, k90, k180, k270 };
+
+// A 24-bit image, e.g. a cv::Mat of CV_8UC3 (which is BGR).
+struct Rgb888Image {
+  const uint8_t *data;
+  int width;
+  int height;
+  // Bytes from one row to the next.
+  size_t stride;
+  bool bgr;
+};
+
+// Convert `pixels` 24-bit pixels to RGB565, high byte first as RGB565 panels take it over SPI.
+// Uses SSSE3 (picked at runtime) or NEON, 16 pixels at a time.
+void Rgb888ToRgb565(const uint8_t *src, size_t pixels, bool bgr, uint8_t *out);
+
+// Convert `src` into a width x height RGB565 frame in one pass: rotated, then centered, with the
+// border filled with `background`. A source larger than the frame after rotation is cropped around
+// its center, scale it beforehand to keep all of it. The frame can be the SPI transmit buffer
+// itself, nothing else is copied.
+Status ConvertToRgb565(const Rgb888Image &src, Rotation rotation, int width, int height,
+                       std::span<uint8_t> out, uint16_t background = 0);
+
+} // namespace mpsse_protocol
+
+#endif // __MPSSE_DISPLAY_H__
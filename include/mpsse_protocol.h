@@ -1,23 +1,43 @@
 #ifndef __MPSSE_PROTOCOL_H__
 #define __MPSSE_PROTOCOL_H__
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <format>
 #include <ftdi.h>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <initializer_list>
+#include <vector>
 
 namespace mpsse_protocol {
 
+// Trivially copyable and allocation free: an error code, a format string and a few integer
+// arguments. The message is only formatted when asked for.
 class Status {
 public:
+  static constexpr int kMaxArgs = 3;
+
   static Status Ok() { return {}; }
-  static Status Err(std::string msg) { return {-1, msg}; }
-  static Status Errno(int errno, std::string msg) { return {errno, msg}; }
+  // `fmt` must outlive the Status, e.g. a string literal. std::format syntax, the arguments must
+  // be integers.
+  template <typename... Args>
+  static Status Err(const char *fmt, Args... args) { return Make(-1, fmt, args...); }
+  template <typename... Args>
+  static Status Errno(int err, const char *fmt, Args... args) { return Make(err, fmt, args...); }
 
   // If the status is OK.
   bool ok() const { return err_ == 0; }
@@ -28,72 +48,596 @@ public:
   //              -1 : Other errors
   int err() const { return err_; }
 
-  // Return the attached message.
-  const std::string &msg() const { return msg_; }
+  // Return the attached message, formatted now.
+  std::string msg() const {
+    if (fmt_ == nullptr) return "";
+    int64_t a0 = args_[0], a1 = args_[1], a2 = args_[2];
+    std::string ret;
+    try {
+      ret = std::vformat(fmt_, std::make_format_args(a0, a1, a2));
+    } catch (const std::format_error &) {
+      ret = fmt_;
+    }
+    if (chained_ > 0) ret += std::format(" -> {} more chained error(s)", chained_);
+    return ret;
+  }
 
   // Return a human readable message.
   std::string human() const {
     if (err_ == 0) return "OK";
-    if (err_ == -1) return "Error: " + msg_;
-    return std::format("Errno {} {}. {}", err_, strerror(err_), msg_);
+    if (err_ == -1) return "Error: " + msg();
+    return std::format("Errno {} {}. {}", err_, strerror(err_), msg());
   }
 
-  // Quick and dirty way to chain multiple Status together
+  // Quick and dirty way to chain multiple Status together. The first error is kept, later ones
+  // are only counted.
   Status &operator|=(const Status &rhs) {
     if (err_ == 0) {
-      err_ = rhs.err_;
-      msg_ = rhs.msg_;
+      *this = rhs;
     } else if (!rhs.ok()) {
-      msg_ += " -> chained error " + rhs.human();
+      chained_ += 1 + rhs.chained_;
     }
     return *this;
   }
 
 private:
-  Status(int err = 0, std::string msg = "") : err_(err), msg_(msg) {}
-  int err_ = 0;
-  std::string msg_ = "";
+  Status() = default;
+  template <typename... Args>
+  static Status Make(int err, const char *fmt, Args... args) {
+    static_assert(sizeof...(Args) <= kMaxArgs, "Too many Status arguments");
+    static_assert((std::is_integral_v<Args> && ...), "Status arguments must be integers");
+    Status st;
+    st.err_ = err;
+    st.fmt_ = fmt;
+    int i = 0;
+    ((st.args_[i++] = static_cast<int64_t>(args)), ...);
+    return st;
+  }
+
+  int32_t err_ = 0;
+  uint32_t chained_ = 0;
+  const char *fmt_ = nullptr;
+  int64_t args_[kMaxArgs] = {};
+};
+static_assert(std::is_trivially_copyable_v<Status>);
+
+// A growable sequence of MPSSE commands, plus where their responses should go.
+//
+// The storage grows without limit and keeps its capacity across Clear(), so a stream that is
+// reused doesn't allocate once it has warmed up. A caller-provided arena can be used instead of
+// the internal storage, e.g. to share one allocation between several streams in a hot loop.
+class MpsseCommandStream {
+public:
+  // `len` bytes of response produced by the commands right before `offset`.
+  struct Response {
+    size_t offset;
+    uint32_t len;
+    void *dest;  // nullptr to discard.
+  };
+
+  MpsseCommandStream() : data_(&own_data_) {}
+  // The arena must outlive the stream. Its content is cleared.
+  explicit MpsseCommandStream(std::vector<uint8_t> *arena) : data_(arena) { data_->clear(); }
+
+  // No copy nor move, data_ may point to own_data_.
+  MpsseCommandStream(const MpsseCommandStream &) = delete;
+  MpsseCommandStream &operator=(const MpsseCommandStream &) = delete;
+
+  // Switch to another storage, nullptr for the internal one. Content is cleared.
+  void SetArena(std::vector<uint8_t> *arena) {
+    data_ = arena ? arena : &own_data_;
+    Clear();
+  }
+
+  void Clear() {
+    data_->clear();
+    responses_.clear();
+    pin_updates_.clear();
+    response_len_ = 0;
+  }
+  // Drop the bytes after `size`, with the responses and pin updates they had.
+  void Truncate(size_t size);
+  bool empty() const { return data_->empty(); }
+  size_t size() const { return data_->size(); }
+  const uint8_t *data() const { return data_->data(); }
+
+  void Append(uint8_t byte) { data_->push_back(byte); }
+  void Append(std::span<const uint8_t> bytes) { data_->insert(data_->end(), bytes.begin(), bytes.end()); }
+  void Append(std::initializer_list<uint8_t> bytes) {
+    data_->insert(data_->end(), bytes.begin(), bytes.end());
+  }
+  // Append `n` bytes to be filled in by the caller. Valid until the next change to the stream.
+  uint8_t *Grow(size_t n) {
+    const size_t size = data_->size();
+    data_->resize(size + n);
+    return data_->data() + size;
+  }
+
+  // Exchange the bytes with `storage`. Expected responses are dropped.
+  void SwapStorage(std::vector<uint8_t> *storage) {
+    data_->swap(*storage);
+    data_->clear();
+    responses_.clear();
+    pin_updates_.clear();
+    response_len_ = 0;
+  }
+
+  // The commands appended so far produce `len` more bytes of response, store them at `dest`.
+  // This also marks a command boundary where the stream can be split.
+  void ExpectResponse(void *dest, uint32_t len) {
+    if (len == 0) return;
+    responses_.push_back({data_->size(), len, dest});
+    response_len_ += len;
+  }
+  std::span<const Response> responses() const { return responses_; }
+  uint64_t response_len() const { return response_len_; }
+
+  // A SET_BITS_LOW (ADBUS) or SET_BITS_HIGH (ACBUS) at `offset` that only changes the pins in
+  // `mask`. The other pins keep the state the device has when it buffers the stream, see
+  // FtdiDevice::BufferStream(). Submit() sends the placeholder as is, other pins low and input.
+  struct PinUpdate {
+    size_t offset;
+    bool high;
+    uint8_t state;
+    uint8_t dir;
+    uint8_t mask;
+  };
+  void AppendPinUpdate(bool high, uint8_t state, uint8_t dir, uint8_t mask) {
+    pin_updates_.push_back({data_->size(), high, state, dir, mask});
+    Append({static_cast<uint8_t>(high ? SET_BITS_HIGH : SET_BITS_LOW),
+            static_cast<uint8_t>(state & mask), static_cast<uint8_t>(dir & mask)});
+  }
+  std::span<const PinUpdate> pin_updates() const { return pin_updates_; }
+
+private:
+  std::vector<uint8_t> *data_;
+  std::vector<uint8_t> own_data_;
+  std::vector<Response> responses_;
+  std::vector<PinUpdate> pin_updates_;
+  uint64_t response_len_ = 0;
+};
+
+// A command stream recorded once and replayed as is, see FtdiDevice::BufferRecord().
+//
+// The bytes are never re-encoded: replaying is a copy, or a direct write, plus patching the
+// slots marked as parameters. Responses are read back to back into one rx buffer, in command
+// order. Checks compare response bytes with what they should be, e.g. I2C ACK bits, so a replay
+// can fail like the calls it was recorded from. Save() and Load() keep it across runs.
+class MpsseRecording {
+public:
+  // `len` bytes of response from the commands before `offset`, at `rx_offset` in the rx buffer.
+  struct Response {
+    size_t offset;
+    uint32_t len;
+    uint32_t rx_offset;
+  };
+  // `len` bytes at `offset` replaced at every replay.
+  struct Slot {
+    size_t offset;
+    uint32_t len;
+  };
+  // Replay fails unless (rx[rx_offset] & mask) == value.
+  struct Check {
+    uint32_t rx_offset;
+    uint8_t mask;
+    uint8_t value;
+  };
+
+  bool empty() const { return data_.empty(); }
+  size_t size() const { return data_.size(); }
+  const uint8_t *data() const { return data_.data(); }
+  std::span<const Response> responses() const { return responses_; }
+  uint32_t response_len() const { return response_len_; }
+  std::span<const Slot> slots() const { return slots_; }
+  std::span<const Check> checks() const { return checks_; }
+
+  // Where the response buffered for `dest` lands in the rx buffer, -1 if none. Only valid on
+  // the recording it was buffered for, not after Load().
+  int64_t RxOffset(const void *dest) const;
+  // Mark `len` bytes at `offset` as a slot. Returns its index, -1 if out of range.
+  int AddSlot(size_t offset, uint32_t len);
+  // Mark the first copy of `placeholder` at or after `from`, -1 if there's none. Record with
+  // placeholder values that can't be mistaken for commands.
+  int FindSlot(std::span<const uint8_t> placeholder, size_t from = 0);
+  void AddCheck(uint32_t rx_offset, uint8_t mask, uint8_t value) {
+    checks_.push_back({rx_offset, mask, value});
+  }
+
+  // A binary file, only meant to be read back by the same build.
+  Status Save(const char *path) const;
+  Status Load(const char *path);
+
+private:
+  friend class FtdiDevice;
+
+  std::vector<uint8_t> data_;
+  std::vector<Response> responses_;
+  std::vector<Slot> slots_;
+  std::vector<Check> checks_;
+  uint32_t response_len_ = 0;
+  // Where each response went while recording, for RxOffset().
+  std::vector<const void *> dests_;
+  // Pin state after the commands, the device tracks it on replay.
+  uint8_t low_state_ = 0;
+  uint8_t low_dir_ = 0;
+  uint8_t high_state_ = 0;
+  uint8_t high_dir_ = 0;
+};
+
+// ================================ //
+//  Compile-time command sequences  //
+// ================================ //
+//
+// Fixed MPSSE command sequences built at compile time, so the hot paths only copy them into the
+// buffer and patch in lengths and data at offsets known at compile time:
+//
+//   constexpr auto kWriteByte = mpsse_cmd::Bits(MPSSE_IDLE_LOW_WRITE, 8) + mpsse_cmd::Pins(0, 1);
+//   uint8_t *out = dev->BufferSeq(kWriteByte);
+//   out[2] = data;
+//
+// Pins() commands own the lower 4 pins of ADBUS only, like FtdiDevice::MpsseBufferLowerPins():
+// the upper 4 are patched in from the tracked state when the sequence is buffered.
+namespace mpsse_cmd {
+
+template <size_t N, size_t P = 0>
+struct Seq {
+  std::array<uint8_t, N> bytes{};
+  // Offsets of the Pins() commands.
+  std::array<uint16_t, P> pin_offsets{};
+  // Bytes of response the sequence produces.
+  uint32_t response_len = 0;
+  // Lower 4 pins after the last Pins() command, if P > 0.
+  uint8_t last_state = 0;
+  uint8_t last_dir = 0;
+
+  static constexpr size_t size() { return N; }
+};
+
+template <size_t N1, size_t P1, size_t N2, size_t P2>
+constexpr Seq<N1 + N2, P1 + P2> operator+(const Seq<N1, P1> &a, const Seq<N2, P2> &b) {
+  Seq<N1 + N2, P1 + P2> ret;
+  for (size_t i = 0; i < N1; i++) ret.bytes[i] = a.bytes[i];
+  for (size_t i = 0; i < N2; i++) ret.bytes[N1 + i] = b.bytes[i];
+  for (size_t i = 0; i < P1; i++) ret.pin_offsets[i] = a.pin_offsets[i];
+  for (size_t i = 0; i < P2; i++) ret.pin_offsets[P1 + i] = b.pin_offsets[i] + N1;
+  ret.response_len = a.response_len + b.response_len;
+  ret.last_state = P2 > 0 ? b.last_state : a.last_state;
+  ret.last_dir = P2 > 0 ? b.last_dir : a.last_dir;
+  return ret;
+}
+
+// `seq` K times in a row.
+template <size_t K, size_t N, size_t P>
+constexpr Seq<N * K, P * K> Repeat(const Seq<N, P> &seq) {
+  if constexpr (K == 1) {
+    return seq;
+  } else {
+    return seq + Repeat<K - 1>(seq);
+  }
+}
+
+constexpr Seq<1> Op(uint8_t op) { return {{op}}; }
+constexpr Seq<1> SendImmediate() { return Op(SEND_IMMEDIATE); }
+
+// SET_BITS_LOW for ADBUS0-3.
+constexpr Seq<3, 1> Pins(uint8_t state, uint8_t dir) {
+  return {{SET_BITS_LOW, static_cast<uint8_t>(state & 0xf), static_cast<uint8_t>(dir & 0xf)},
+          {0}, 0, static_cast<uint8_t>(state & 0xf), static_cast<uint8_t>(dir & 0xf)};
+}
+// SET_BITS_HIGH for all of ACBUS.
+constexpr Seq<3> HighPins(uint8_t state, uint8_t dir) { return {{SET_BITS_HIGH, state, dir}}; }
+
+// Clock 1-8 bits out of `data`. Data at offset 2.
+constexpr Seq<3> Bits(uint8_t op, int bits, uint8_t data = 0) {
+  return {{static_cast<uint8_t>(op | MPSSE_BITMODE), static_cast<uint8_t>(bits - 1), data}};
+}
+// Clock 1-8 bits in, as one byte of response.
+constexpr Seq<2> ReadBits(uint8_t op, int bits) {
+  return {{static_cast<uint8_t>(op | MPSSE_BITMODE), static_cast<uint8_t>(bits - 1)}, {}, 1};
+}
+// Header of a 1-65536 byte command, the length is at offset 1. Read commands count `len` bytes
+// of response, write data must follow the header.
+constexpr Seq<3> Bytes(uint8_t op, uint32_t len) {
+  return {{op, static_cast<uint8_t>((len - 1) & 0xff), static_cast<uint8_t>(((len - 1) >> 8) & 0xff)},
+          {}, (op & MPSSE_DO_READ) ? len : 0};
+}
+
+// Overwrite the length field of a Bytes() header at runtime.
+inline void PatchLength(uint8_t *length_field, uint32_t len) {
+  length_field[0] = (len - 1) & 0xff;
+  length_field[1] = ((len - 1) >> 8) & 0xff;
+}
+
+// Length of the MPSSE command at the start of `cmd`, with its payload. It can be more than
+// cmd.size() if the command is cut off. Unknown opcodes, e.g. the bad commands of
+// FtdiDevice::MpsseSync(), count as one byte.
+constexpr size_t CommandLength(std::span<const uint8_t> cmd) {
+  const uint8_t op = cmd[0];
+  if (op < 0x80) {
+    const bool write = op & MPSSE_DO_WRITE;
+    if (op & MPSSE_WRITE_TMS) return 3;  // op, bit count, TMS bits.
+    if (op & MPSSE_BITMODE) return write ? 3 : 2;
+    if (!write) return 3;
+    return cmd.size() < 3 ? 3 : 3 + (cmd[1] | (cmd[2] << 8)) + 1;
+  }
+  switch (op) {
+  case SET_BITS_LOW:
+  case SET_BITS_HIGH:
+  case TCK_DIVISOR:
+  case CLK_BYTES:
+  case CLK_BYTES_OR_HIGH:
+  case CLK_BYTES_OR_LOW:
+  case DRIVE_OPEN_COLLECTOR:
+    return 3;
+  case CLK_BITS:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+} // namespace mpsse_cmd
+
+// USB-level settings of a device. See ftdi_test.cpp for how they affect the timings.
+struct FtdiTuning {
+  // How long the chip holds a partially filled packet before sending it, 1-255 ms.
+  // Has no effect on responses ending with SEND_IMMEDIATE.
+  uint8_t latency_ms;
+  // Bytes per USB read and write transfer.
+  uint32_t read_chunk_size;
+  uint32_t write_chunk_size;
+
+  // What libftdi uses after open.
+  static constexpr FtdiTuning Default() { return {16, 4096, 4096}; }
+  // Many small request/response round trips, e.g. I2C register access.
+  static constexpr FtdiTuning LowLatency() { return {1, 4096, 4096}; }
+  // Large writes and reads, e.g. displays, LEDs and flash. Fewer transfers for the same data.
+  static constexpr FtdiTuning BulkStreaming() { return {16, 65536, 65536}; }
+
+  bool operator==(const FtdiTuning &) const = default;
+};
+
+// What a device did since open or the last FtdiDevice::ResetCounters().
+struct FtdiCounters {
+  // USB transfers issued, synchronous and asynchronous. Async writes count one per chunk.
+  uint64_t usb_writes = 0;
+  uint64_t usb_reads = 0;
+  uint64_t tx_bytes = 0;
+  uint64_t rx_bytes = 0;
+  // BufferFlush() calls that sent something, and protocol-level transactions (an SPI CS
+  // assertion, an I2C start-stop, a LED frame). flushes / transactions < 1 means batching works.
+  uint64_t flushes = 0;
+  uint64_t transactions = 0;
+  // Reads and WaitTransmitterEmpty() calls that gave up.
+  uint64_t timeouts = 0;
+  // Extra reads MpsseSync() needed because stale bytes were in front of the echo.
+  uint64_t sync_retries = 0;
+  // Time spent sleeping in Read() and WaitTransmitterEmpty().
+  std::chrono::nanoseconds read_blocked{0};
+  std::chrono::nanoseconds tx_empty_blocked{0};
+};
+
+// One entry of the trace, see FtdiDevice::EnableTrace(). Kept small so tracing a busy loop is
+// cheap.
+struct FtdiTraceEvent {
+  enum Kind : uint8_t {
+    kWrite,        // ftdi_write_data(), len bytes.
+    kRead,         // Read(), len bytes.
+    kReadTimeout,  // Read() that timed out, len bytes were expected.
+    kFlush,        // BufferFlush(), len bytes of commands.
+    kCommand,      // One MPSSE command of a flush, `opcode` and len bytes including its payload.
+    kSync,         // MpsseSync().
+    kTxEmptyWait,  // WaitTransmitterEmpty().
+    kAsyncWrite,   // Submit to completion of an async transfer.
+    kAsyncRead,
+  };
+  // Since EnableTrace().
+  uint64_t start_ns;
+  uint32_t dur_ns;
+  uint32_t len;
+  Kind kind;
+  uint8_t opcode;
+};
+
+// An asynchronous transfer of an FtdiTransport, only the transport knows what it is.
+struct FtdiTransfer;
+
+// Where an FtdiDevice sends its bytes: libftdi by default, or e.g. the simulator in mpsse_sim.h.
+// Calls come from one thread at a time.
+class FtdiTransport {
+public:
+  virtual ~FtdiTransport() = default;
+
+  // All `len` bytes or an error.
+  virtual Status Write(const uint8_t *buf, size_t len) = 0;
+  // Exactly `len` bytes, or an ETIMEDOUT error once `timeout` expires. Bytes received before the
+  // timeout are dropped.
+  virtual Status Read(uint8_t *buf, size_t len, std::chrono::duration<double> timeout) = 0;
+
+  // Transfers complete in submission order. Submit returns nullptr if it fails. Finish blocks
+  // until the transfer is done, frees it and returns the bytes moved or a negative error.
+  virtual FtdiTransfer *SubmitWrite(const uint8_t *buf, size_t len) = 0;
+  virtual FtdiTransfer *SubmitRead(uint8_t *buf, size_t len) = 0;
+  virtual int Finish(FtdiTransfer *transfer) = 0;
+
+  virtual Status PollModemStatus(uint16_t *status) = 0;
+  virtual Status SetBitmode(uint8_t mask, uint8_t mode) = 0;
+  virtual Status SetBaudrate(int baud) = 0;
+  // Drop what's in the chip's TX and RX buffers.
+  virtual Status Purge() = 0;
+  virtual Status ApplyTuning(const FtdiTuning &tuning) = 0;
+  virtual uint32_t WriteChunkSize() = 0;
 };
 
 class FtdiDevice {
 public:
+  // tuning: Applied after open. If not given, the protocol class's Create() applies its own.
   static std::unique_ptr<FtdiDevice> OpenVendorProduct(uint16_t id_vendor, uint16_t id_product,
-                                                       enum ftdi_interface intf = INTERFACE_ANY);
+                                                       enum ftdi_interface intf = INTERFACE_ANY,
+                                                       std::optional<FtdiTuning> tuning = {});
   // This is the device number. Not to be confused by the port number which may also shown
   // as "x-y"
   static std::unique_ptr<FtdiDevice> OpenBusDevice(int bus, int device,
-                                                   enum ftdi_interface intf = INTERFACE_ANY);
+                                                   enum ftdi_interface intf = INTERFACE_ANY,
+                                                   std::optional<FtdiTuning> tuning = {});
+  // A device on another transport, e.g. MpsseSim.
+  static std::unique_ptr<FtdiDevice> OpenTransport(std::unique_ptr<FtdiTransport> transport,
+                                                   std::optional<FtdiTuning> tuning = {});
   static void FreeContext(struct ftdi_context *context);
 
   // The context will be freed on destruction.
-  FtdiDevice() : FtdiDevice(nullptr) {}
-  explicit FtdiDevice(struct ftdi_context *context) : context_(context, &FreeContext) {}
-  virtual ~FtdiDevice() = default;
+  FtdiDevice() : FtdiDevice(static_cast<struct ftdi_context *>(nullptr)) {}
+  explicit FtdiDevice(struct ftdi_context *context);
+  // Freed with `free_context` instead of FreeContext(), e.g. if its libusb context is shared.
+  FtdiDevice(struct ftdi_context *context, void (*free_context)(struct ftdi_context *));
+  explicit FtdiDevice(std::unique_ptr<FtdiTransport> transport);
+  // Waits for pending asynchronous transfers.
+  virtual ~FtdiDevice();
+  // nullptr if the device isn't on libftdi.
   struct ftdi_context *context() { return context_.get(); }
+  FtdiTransport *transport() { return transport_.get(); }
+
+  // ftdi_set_bitmode() and ftdi_set_baudrate() through the transport.
+  Status SetBitmode(uint8_t mask, uint8_t mode) { return transport_->SetBitmode(mask, mode); }
+  Status SetBaudrate(int baud) { return transport_->SetBaudrate(baud); }
+
+  // Waits for pending transfers, then sets the latency timer and chunk sizes.
+  Status ApplyTuning(const FtdiTuning &tuning);
+  // Apply `tuning` unless ApplyTuning() was already called, so the user's choice wins.
+  Status ApplyDefaultTuning(const FtdiTuning &tuning) {
+    return tuning_ ? Status::Ok() : ApplyTuning(tuning);
+  }
+  // The last tuning applied, empty if the libftdi defaults are in use.
+  const std::optional<FtdiTuning> &tuning() const { return tuning_; }
 
   //
   // Helper functions used by different interface classes.
   //
 
   // First stash bytes into a buffer, then use BufferFlush() to flush all bytes to the
-  // device. If there are not enough space in the buffer, it will return an error, and the
-  // buffer is unchanged. Use the Write() function to avoid extra copy.
-  static constexpr int kBufferSize = 4096;  // FT2232's internal buffer is 4K.
-  void BufferClear() { buffer_used_ = 0; }
+  // device. The buffer grows as needed. Use the Write() function to avoid extra copy.
+  static constexpr int kChipBufferSize = 4096;  // FT2232's internal TX and RX buffers are 4K each.
+  void BufferClear() { buffer_.Clear(); }
+  // Room left before the buffer exceeds what the chip can take in one transfer.
+  int BufferAvailable() const { return std::max<int>(0, kChipBufferSize - buffer_.size()); }
   Status BufferByte(uint8_t data);
   Status BufferBytes(std::span<const uint8_t> data);
   Status BufferBytes(std::initializer_list<uint8_t> data);
-  // Buffer content is unchanged if Flush errors.
-  Status BufferFlush();
+  // The commands buffered so far produce `len` more bytes of response. BufferFlush() reads them
+  // back into `dest`, which can be nullptr to discard them.
+  void BufferExpect(void *dest, uint32_t len) { buffer_.ExpectResponse(dest, len); }
+  // Use caller-provided storage for the buffer, nullptr to switch back to the internal one.
+  // The buffer is cleared.
+  void BufferSetArena(std::vector<uint8_t> *arena) { buffer_.SetArena(arena); }
+  // Write out the buffer and read back the expected responses.
+  // The buffer is cleared either way, a failed flush may have sent part of it.
+  Status BufferFlush(std::chrono::duration<double> extra_timeout = {});
+
+  // Append a compile-time sequence, see mpsse_cmd. No checks and no Status, for the hot paths.
+  // Returns the copy in the buffer to patch payloads into, valid until the next Buffer*() call.
+  // Expected responses still need BufferExpect().
+  template <size_t N, size_t P>
+  uint8_t *BufferSeq(const mpsse_cmd::Seq<N, P> &seq) {
+    uint8_t *out = buffer_.Grow(N);
+    std::memcpy(out, seq.bytes.data(), N);
+    if constexpr (P > 0) {
+      const uint8_t upper_state = low_pin_state_ & 0xf0;
+      const uint8_t upper_dir = low_pin_dir_ & 0xf0;
+      for (uint16_t offset : seq.pin_offsets) {
+        out[offset + 1] |= upper_state;
+        out[offset + 2] |= upper_dir;
+      }
+      low_pin_state_ = upper_state | seq.last_state;
+      low_pin_dir_ = upper_dir | seq.last_dir;
+    }
+    return out;
+  }
+
+  // Append `stream` with its expected responses to the buffer. Its pin updates are resolved
+  // against the tracked pin state, as if MpsseUpdateLowerPins() or MpsseUpdateHigherPins() were
+  // called at that point.
+  Status BufferStream(const MpsseCommandStream &stream);
+  // Move what was buffered into `recording` instead of executing it, the expected responses
+  // included. Only calls that buffer are captured, one that flushes executes as usual.
+  // The replay assumes the pin state and settings the recording started from.
+  void BufferRecord(MpsseRecording *recording);
+  // Append `recording` to the buffer, with `patches` in its slots in order (fewer keep the
+  // recorded bytes) and its responses read into `rx`, response_len() bytes or nullptr to discard.
+  // Checks are only verified by Replay().
+  Status BufferReplay(const MpsseRecording &recording, void *rx = nullptr,
+                      std::span<const std::span<const uint8_t>> patches = {});
+  // Execute `recording` and verify its checks. Without patches nor responses, it's written
+  // straight from the recording.
+  // failed: If not null, the index of the first check that failed, -1 if none.
+  Status Replay(const MpsseRecording &recording, void *rx = nullptr,
+                std::span<const std::span<const uint8_t>> patches = {}, int *failed = nullptr);
+
+  // Drop what was buffered after the first `size` bytes.
+  void BufferTruncate(size_t size) { buffer_.Truncate(size); }
+  size_t BufferSize() const { return buffer_.size(); }
+
+  // Execute the commands in `stream` and read back the responses it expects.
+  // The chip stops executing commands when its 4K RX buffer is full and cannot take more
+  // commands when the TX buffer is full, so a stream expecting more than that is split at command
+  // boundaries, each piece is written, and its responses are read back before the next one.
+  // A SEND_IMMEDIATE is added at each split, the stream itself should end with one if it expects
+  // any response.
+  //
+  // extra_timeout: Added to the read timeout, for commands that take longer than their size
+  //                suggests.
+  Status Submit(const MpsseCommandStream &stream, std::chrono::duration<double> extra_timeout = {});
 
   // Bypass the buffer and write directly to the device.
-  // Return an error if the buffer is not empty.
+  // Anything in the buffer is flushed first.
   Status Write(const void *buf, int32_t len);
 
-  // Wrapper around ftdi_read_data()
+  // Read exactly len bytes. Sleeps on libusb events until they arrive or the timeout expires.
   Status Read(void *buf, int32_t len,
               std::chrono::duration<double> timeout = std::chrono::milliseconds(1));
 
+  //
+  // Asynchronous I/O, built on ftdi_write_data_submit() and ftdi_read_data_submit().
+  //
+  // Every submission returns a ticket, Wait(ticket) blocks until that transfer and all transfers
+  // submitted before it are done. Transfers are split at the write chunk size so they stay in
+  // order with each other and with synchronous writes. Only one read can be in flight, a
+  // synchronous Read() or another ReadAsync() waits for the pending one first.
+  // At most kMaxPendingTransfers are in flight, submitting more waits for the oldest one.
+  //
+  // The buffer passed to WriteAsync() or ReadAsync() must stay valid until the transfer is waited.
+  using Ticket = uint64_t;
+  static constexpr int kMaxPendingTransfers = 32;
+  // The buffer storage is handed to the transfer, so the next commands can be buffered while this
+  // one drains. Expected responses are not supported.
+  Status BufferFlushAsync(Ticket *ticket = nullptr);
+  Status WriteAsync(const void *buf, int32_t len, Ticket *ticket = nullptr);
+  Status ReadAsync(void *buf, int32_t len, Ticket *ticket = nullptr);
+  Status Wait(Ticket ticket);
+  Status WaitAll() { return Wait(next_ticket_ - 1); }
+  // The ticket of the last submitted transfer, 0 if nothing was submitted.
+  Ticket LastTicket() const { return next_ticket_ - 1; }
+
+  // Bytes moved over USB since open, counted when a transfer completes. Safe to read from any
+  // thread.
+  uint64_t tx_bytes() const { return tx_bytes_.load(std::memory_order_relaxed); }
+  uint64_t rx_bytes() const { return rx_bytes_.load(std::memory_order_relaxed); }
+
+  // Counters are relaxed atomics, safe to read from any thread while the device is in use.
+  FtdiCounters Counters() const;
+  void ResetCounters();
+  // Protocol classes call this once per transaction, see FtdiCounters::transactions.
+  void CountTransaction() { transactions_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Record the last `max_events` transfers into a ring buffer, 0 turns tracing off. With
+  // `opcodes`, each flush is also broken down into its MPSSE commands. Not thread safe, enable
+  // and export from the thread using the device.
+  void EnableTrace(size_t max_events, bool opcodes = true);
+  // Oldest first.
+  std::vector<FtdiTraceEvent> TraceEvents() const;
+  // Write the trace as Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev open.
+  // Transfers and commands are on separate tracks.
+  Status ExportChromeTrace(const char *path) const;
+
   // Wait for "Transmitter empty" bit set. Return 0 if ok, -1 if error, -2 if timeout.
   Status WaitTransmitterEmpty(uint32_t timeout_ms = 1000);
 
@@ -101,6 +645,13 @@ public:
   // Note the implementation isn't identical to AN_135
   Status MpsseSync();
   Status MpsseSetClockFreq(float khz, bool three_phase, bool adaptive);
+  // Only append the commands to the buffer.
+  Status MpsseBufferClockFreq(float khz, bool three_phase, bool adaptive, bool verbose = false);
+  // Estimated time to clock `bits` bits at the frequency set by MpsseSetClockFreq().
+  std::chrono::duration<double> MpsseClockTime(uint64_t bits) const {
+    return std::chrono::duration<double, std::milli>(bits / mpsse_khz_);
+  }
+  float MpsseClockKhz() const { return mpsse_khz_; }
 
   // Helper functions for controlling the lower 8 pins.
   // Users SHOULD NOT use functions here and SHOULD use MpsseGpio class instead!
@@ -125,14 +676,103 @@ public:
   Status MpsseBufferLowerPins(uint8_t state, uint8_t dir) {
     return MpsseUpdateLowerPins(state, dir, 0xf, /*flush=*/false);
   }
+  // Same for the higher 8 pins, bit[x]: ACBUSx.
+  Status MpsseUpdateHigherPins(uint8_t state, uint8_t dir, uint8_t mask, bool flush);
+
+  // Hold the MPSSE with WAIT_ON_HIGH / WAIT_ON_LOW until GPIOL1 (ADBUS5) is high or low, and
+  // return as soon as it is: the response is queued behind the wait, no polling over USB.
+  // Anything buffered is sent first.
+  // The chip can't abort the wait, so on timeout the MPSSE is reset and resynced, and the clock
+  // and pins are restored.
+  Status MpsseWaitOnGpiol1(bool high, std::chrono::duration<double> timeout);
+  // Bring back a stuck MPSSE: reset the bit mode, purge the buffers, sync, then restore the clock
+  // set by MpsseBufferClockFreq() and the pin state.
+  Status MpsseRecover();
 
 private:
+  // Apply `tuning` to a freshly opened device, nullptr if that fails.
+  static std::unique_ptr<FtdiDevice> WithTuning(std::unique_ptr<FtdiDevice> dev,
+                                                const std::optional<FtdiTuning> &tuning);
+  // ftdi_write_data() wrapper.
+  Status WriteRaw(const uint8_t *buf, size_t len);
+  // Take the pin state a replayed recording leaves.
+  void TrackPins(const MpsseRecording &recording);
+
+  struct PendingTransfer {
+    Ticket ticket;
+    FtdiTransfer *handle;
+    int32_t len;
+    bool read;
+    // For the trace, unset if tracing is off.
+    std::chrono::steady_clock::time_point submitted;
+    // Owned data of BufferFlushAsync(), attached to its last chunk.
+    std::vector<uint8_t> storage;
+  };
+  // Submit one write per chunk. Storage, if any, is attached to the last one.
+  Status SubmitWrite(const uint8_t *buf, size_t len, std::vector<uint8_t> storage, Ticket *ticket);
+  Status WaitOldest();
+
+  std::deque<PendingTransfer> pending_;
+  // Storage given back by finished BufferFlushAsync() transfers, reused to avoid allocations.
+  std::vector<std::vector<uint8_t>> spare_storage_;
+  Ticket next_ticket_ = 1;
+  Ticket last_read_ticket_ = 0;
+
   std::unique_ptr<struct ftdi_context, decltype(&FreeContext)> context_;
-  uint8_t buffer_[kBufferSize];
-  uint32_t buffer_used_ = 0;
+  // Destroyed before context_, which it may use.
+  std::unique_ptr<FtdiTransport> transport_;
+  MpsseCommandStream buffer_;
+  // Scratch space for reading back the responses of a Submit().
+  std::vector<uint8_t> rx_staging_;
+  // Responses of a Replay() when the caller doesn't want them, for the checks.
+  std::vector<uint8_t> replay_rx_;
+
+  std::optional<FtdiTuning> tuning_;
 
   uint8_t low_pin_state_=0;
   uint8_t low_pin_dir_=0;
+  uint8_t high_pin_state_=0;
+  uint8_t high_pin_dir_=0;
+  // Actual clock frequency, updated by MpsseSetClockFreq().
+  float mpsse_khz_ = 6000;
+  // The last clock asked for, for MpsseRecover(). 0 if never set.
+  float clock_khz_ = 0;
+  bool clock_three_phase_ = false;
+  bool clock_adaptive_ = false;
+
+  // Start time for the trace, only read if tracing is on.
+  std::chrono::steady_clock::time_point TraceNow() const {
+    return trace_.empty() ? std::chrono::steady_clock::time_point{} : std::chrono::steady_clock::now();
+  }
+  // Record an event from `start` to now. No-op if tracing is off or `start` predates it.
+  void Trace(FtdiTraceEvent::Kind kind, std::chrono::steady_clock::time_point start, uint32_t len);
+  // Add a kCommand event for each MPSSE command in `data`, spread over the time from `start` to
+  // now by their offsets.
+  void TraceCommands(std::span<const uint8_t> data, std::chrono::steady_clock::time_point start);
+  // Take the next ring buffer slot.
+  FtdiTraceEvent *TraceSlot();
+
+  // tx_bytes_ and rx_bytes_ are never reset, FtdiChip computes its rates from them.
+  std::atomic<uint64_t> tx_bytes_{0};
+  std::atomic<uint64_t> rx_bytes_{0};
+  // Baselines of ResetCounters().
+  std::atomic<uint64_t> tx_bytes_base_{0};
+  std::atomic<uint64_t> rx_bytes_base_{0};
+  std::atomic<uint64_t> usb_writes_{0};
+  std::atomic<uint64_t> usb_reads_{0};
+  std::atomic<uint64_t> flushes_{0};
+  std::atomic<uint64_t> transactions_{0};
+  std::atomic<uint64_t> timeouts_{0};
+  std::atomic<uint64_t> sync_retries_{0};
+  std::atomic<int64_t> read_blocked_ns_{0};
+  std::atomic<int64_t> tx_empty_blocked_ns_{0};
+
+  // Ring buffer of the trace, empty if tracing is off.
+  std::vector<FtdiTraceEvent> trace_;
+  size_t trace_next_ = 0;
+  bool trace_wrapped_ = false;
+  bool trace_opcodes_ = false;
+  std::chrono::steady_clock::time_point trace_epoch_;
 };
 
 class MpsseGpio {
@@ -148,11 +788,256 @@ public:
     return dev_->MpsseUpdateLowerPins(state, dir, available_low_pins_, /*flush=*/false);
   }
 
+  // Wait until ADBUS5 is high or low, see FtdiDevice::MpsseWaitOnGpiol1(). The pin must be one
+  // of the available ones and an input, e.g. a DRDY or an interrupt line.
+  Status WaitOnPin5(bool high, std::chrono::duration<double> timeout) {
+    if (!(available_low_pins_ & (1 << 5))) return Status::Err("ADBUS5 isn't available");
+    return dev_->MpsseWaitOnGpiol1(high, timeout);
+  }
+
 private:
   FtdiDevice *dev_;
   uint8_t available_low_pins_;
 };
 
+// ==================== //
+//  Shared device queue //
+// ==================== //
+//
+// Lets several threads use one FtdiDevice. Once the queue is created only its I/O thread touches
+// the device, every other thread submits requests.
+//
+// A request is a function that appends fully formed commands to the device buffer, e.g. through
+// the Buffer*() functions of a protocol object, or a prebuilt MpsseCommandStream. Submitting is
+// a lock-free push. The I/O thread takes every request queued since its last round, runs them
+// back to back into the buffer, flushes them as one USB transfer and hands each request its
+// result. Responses land where each request said, see FtdiDevice::BufferExpect().
+// Pin state is tracked by the device, so pin updates are resolved in the order the requests run.
+//
+// Requests of one thread run in the order they were submitted. A request that fails to buffer
+// is dropped from the batch alone. A failed flush fails the whole batch.
+class FtdiDeviceQueue {
+public:
+  // Runs on the I/O thread, only append to the buffer. Flushing works but ends the batch early.
+  using BuildFn = std::function<Status(FtdiDevice *dev)>;
+  // A batch stops taking requests once it buffers this much.
+  static constexpr size_t kMaxBatchBytes = 65536;
+
+  // `dev` must outlive the queue.
+  explicit FtdiDeviceQueue(FtdiDevice *dev);
+  // Runs what was already submitted, then stops the I/O thread.
+  // No thread may submit during or after destruction.
+  virtual ~FtdiDeviceQueue();
+
+  // Thread safe. Block until `build` and the flush of its batch are done.
+  // extra_timeout: Added to the flush, see FtdiDevice::BufferFlush().
+  Status Run(const BuildFn &build, std::chrono::duration<double> extra_timeout = {});
+  // Thread safe. `stream` must stay unchanged until it returns.
+  Status Execute(const MpsseCommandStream &stream, std::chrono::duration<double> extra_timeout = {}) {
+    return Run([&stream](FtdiDevice *dev) { return dev->BufferStream(stream); }, extra_timeout);
+  }
+  // Thread safe GPIO. Only the pins in `mask` change.
+  Status UpdateLowerPins(uint8_t state, uint8_t dir, uint8_t mask) {
+    return Run([=](FtdiDevice *dev) {
+      return dev->MpsseUpdateLowerPins(state, dir, mask, /*flush=*/false);
+    });
+  }
+  Status UpdateHigherPins(uint8_t state, uint8_t dir, uint8_t mask) {
+    return Run([=](FtdiDevice *dev) {
+      return dev->MpsseUpdateHigherPins(state, dir, mask, /*flush=*/false);
+    });
+  }
+
+  // Statistics, for tuning. Read them from any thread.
+  uint64_t requests() const { return requests_.load(std::memory_order_relaxed); }
+  uint64_t batches() const { return batches_.load(std::memory_order_relaxed); }
+
+private:
+  // Lives on the submitting thread's stack until `done`.
+  struct Request {
+    std::atomic<Request *> next{nullptr};
+    const BuildFn *build = nullptr;
+    std::chrono::duration<double> extra_timeout{};
+    Status result = Status::Ok();
+    std::atomic<bool> done{false};
+  };
+
+  // Intrusive MPSC queue, D. Vyukov's design: producers swap themselves in as the head, the
+  // consumer walks from the tail. Empty when the tail is the stub with no successor.
+  void Push(Request *req);
+  // nullptr if empty, or if a producer is in the middle of a push, `busy` tells which.
+  Request *Pop(bool *busy);
+
+  void Loop();
+  // Run one batch, return how many requests it had.
+  size_t RunBatch(std::vector<Request *> *batch);
+
+  FtdiDevice *const dev_;
+  Request stub_;
+  std::atomic<Request *> head_{&stub_};
+  Request *tail_ = &stub_;
+  // Bumped on every push and on stop, the I/O thread sleeps on it.
+  std::atomic<uint32_t> submitted_{0};
+  // Bumped after every batch, the submitters sleep on it. Lives in the queue rather than in the
+  // request, which may be gone right after `done` is set.
+  std::atomic<uint32_t> completed_{0};
+  std::atomic<bool> stopping_{false};
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> batches_{0};
+  std::thread thread_;
+};
+
+// =================== //
+//  Multi-channel chip //
+// =================== //
+//
+// Every MPSSE channel of one chip, opened together: A and B of an FT2232H or FT4232H (C and D of
+// the FT4232H have no MPSSE), A of an FT232H. Each channel is its own FtdiDevice with its own
+// libusb context, so the channels can be driven from independent threads without sharing
+// anything but the USB link.
+class FtdiChip {
+public:
+  static constexpr int kMaxChannels = 2;
+
+  // Opens the first chip matching the ids, the other channels are opened at the same bus
+  // address so they belong to the same chip.
+  static std::unique_ptr<FtdiChip> OpenVendorProduct(uint16_t id_vendor, uint16_t id_product,
+                                                     std::optional<FtdiTuning> tuning = {});
+  static std::unique_ptr<FtdiChip> OpenBusDevice(int bus, int device,
+                                                 std::optional<FtdiTuning> tuning = {});
+  // Queues are stopped before the channels close.
+  virtual ~FtdiChip() = default;
+
+  int channels() const { return channels_; }
+  // Channel 0 is INTERFACE_A.
+  FtdiDevice *channel(int i) { return devices_[i].get(); }
+  // An I/O thread for the channel, created on the first call. Create the protocol objects of
+  // the channel first, from then on only use it through the queue.
+  FtdiDeviceQueue *Queue(int i);
+
+  struct ChannelStats {
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    double tx_bytes_per_s;
+    double rx_bytes_per_s;
+  };
+  // Bytes moved since the last ResetStats(), or since open. Safe to call while the channels are
+  // in use on other threads, but not at the same time as ResetStats().
+  ChannelStats Stats(int i) const;
+  void ResetStats();
+
+private:
+  FtdiChip() = default;
+  // MPSSE channels of the opened chip type.
+  static int MpsseChannels(struct ftdi_context *ctx);
+  static std::unique_ptr<FtdiChip> OpenRemaining(std::unique_ptr<FtdiDevice> first,
+                                                 const std::optional<FtdiTuning> &tuning);
+
+  int channels_ = 0;
+  std::unique_ptr<FtdiDevice> devices_[kMaxChannels];
+  // Declared after devices_, so destroyed first.
+  std::unique_ptr<FtdiDeviceQueue> queues_[kMaxChannels];
+  // Counters at the last ResetStats().
+  uint64_t tx_base_[kMaxChannels] = {};
+  uint64_t rx_base_[kMaxChannels] = {};
+  std::chrono::steady_clock::time_point stats_start_ = std::chrono::steady_clock::now();
+};
+
+// =============== //
+//  Device manager //
+// =============== //
+//
+// For racks of dongles: one libusb context for every device, one bus scan instead of one per
+// open, devices opened in parallel, and hotplug so a replugged dongle comes back without a
+// restart.
+//
+// The devices it opens share its libusb context and its event handling, unlike the ones of
+// FtdiDevice::OpenVendorProduct(). Close them before the manager.
+
+// A device is known by its port, which stays the same when it's replugged, unlike its address.
+struct FtdiDeviceInfo {
+  uint16_t id_vendor;
+  uint16_t id_product;
+  int bus;
+  int address;
+  // "<bus>-<port>.<port>...", as in /sys/bus/usb/devices.
+  std::string port_path;
+};
+
+class FtdiDeviceManager {
+public:
+  // Runs on the manager's dispatch thread, not inside libusb, so it may open devices and create
+  // protocol objects. The device that left is gone, only clean up.
+  using HotplugFn = std::function<void(const FtdiDeviceInfo &info)>;
+
+  // nullptr if libusb can't be initialized.
+  static std::unique_ptr<FtdiDeviceManager> Create();
+  // Stops watching, then closes the released devices.
+  virtual ~FtdiDeviceManager();
+
+  // One scan of the bus for the devices with these ids, nothing is opened.
+  Status Enumerate(uint16_t id_vendor, uint16_t id_product, std::vector<FtdiDeviceInfo> *found);
+  // Open `info`, which must come from Enumerate() or a hotplug arrival. A device given to
+  // Release() is handed back as is, without touching the USB.
+  // tuning: If not given, the last one opened or released with on this port and interface, so a
+  //         replugged device gets it back.
+  std::unique_ptr<FtdiDevice> Open(const FtdiDeviceInfo &info,
+                                   enum ftdi_interface intf = INTERFACE_A,
+                                   std::optional<FtdiTuning> tuning = {});
+  // Open every device at the same time, one thread each. nullptr for the ones that failed.
+  std::vector<std::unique_ptr<FtdiDevice>> OpenAll(std::span<const FtdiDeviceInfo> infos,
+                                                   enum ftdi_interface intf = INTERFACE_A,
+                                                   std::optional<FtdiTuning> tuning = {});
+  // Keep `dev`, opened on `info` and `intf`, open for the next Open() of them. Dropped if the
+  // device leaves. Destroy its protocol objects first.
+  void Release(const FtdiDeviceInfo &info, enum ftdi_interface intf,
+               std::unique_ptr<FtdiDevice> dev);
+
+  // Report the devices with these ids arriving and leaving. Devices that are already there and
+  // were returned by Enumerate() aren't reported again, so enumerate and open first, then watch.
+  // Only one watch per manager.
+  Status Watch(uint16_t id_vendor, uint16_t id_product, HotplugFn on_arrived, HotplugFn on_left);
+
+private:
+  using Key = std::pair<std::string, int>;
+  struct Known {
+    libusb_device *usb;  // Referenced.
+    FtdiDeviceInfo info;
+  };
+  struct Event {
+    bool arrived;
+    FtdiDeviceInfo info;
+  };
+
+  explicit FtdiDeviceManager(libusb_context *ctx) : ctx_(ctx) {}
+  // Deleter of the devices on the shared context: they must not libusb_exit() it.
+  static void FreeSharedContext(struct ftdi_context *context);
+  static bool Describe(libusb_device *usb, FtdiDeviceInfo *info);
+  static int LIBUSB_CALL HotplugCallback(libusb_context *ctx, libusb_device *usb,
+                                         libusb_hotplug_event event, void *user_data);
+  // Hold a reference to `usb` as the device on `info.port_path`. False if it already was.
+  bool Remember(libusb_device *usb, const FtdiDeviceInfo &info);
+  void EventLoop();
+  void DispatchLoop();
+
+  libusb_context *const ctx_;
+  std::mutex mutex_;
+  // By port path.
+  std::map<std::string, Known> devices_;
+  std::map<Key, std::unique_ptr<FtdiDevice>> released_;
+  std::map<Key, FtdiTuning> tunings_;
+
+  HotplugFn on_arrived_;
+  HotplugFn on_left_;
+  libusb_hotplug_callback_handle hotplug_ = 0;
+  bool watching_ = false;
+  std::deque<Event> events_;
+  std::condition_variable events_cv_;
+  std::atomic<bool> stopping_{false};
+  std::thread event_thread_;
+  std::thread dispatch_thread_;
+};
+
 // =================================== //
 // MPSSE data TX clock edge limitation //
 // =================================== //
@@ -184,6 +1069,7 @@ private:
 // ==================== //
 //
 // It should be obvious that it's invalid to interleave the use of the same FtdiDevice.
+// Go through an FtdiDeviceQueue to share one between threads.
 //
 // Pins for I2C
 // SCL -> ADBUS0
@@ -240,9 +1126,9 @@ public:
   // Precond: SDA & SCL hold low.
   // Postcond: SDA & SCL hold low.
   // Clock in n bytes, send an ACK for first n-1 bytes, and send a NACK for last byte.
-  // Limited to 320 bytes to avoid overflow the buffer.
-  // If you really need to read that many data, call the function multiple times.
-  Status ReadBytes(uint16_t len, void* buf);
+  // Any length. Long reads are pipelined in chunks: the next chunk is queued on the chip while
+  // the previous one is read back, so SCL keeps running at its rate.
+  Status ReadBytes(size_t len, void* buf);
 
   // Precond: SDA & SCL hold high.
   // Postcond: SDA & SCL hold high.
@@ -253,9 +1139,98 @@ public:
   // If a len is zero, the corresponding data can be nullptr.
   Status Transaction(uint8_t addr7, const uint8_t* tx_data, int tx_len, void* rx_buf, int rx_len);
 
+  // Precond: SDA & SCL hold high.
+  // Postcond: SDA & SCL hold high.
+  // Same sequence as Transaction(), but everything is queued into one USB write (only split if
+  // the response overflows the chip's RX buffer) and all the ACK bits are read back in bulk.
+  // Since nothing is checked in between, all bytes are clocked out even if the device NACKs early.
+  //
+  // nack_index: If not null, set to the index of the first NACKed byte or -1 if all are ACKed.
+  //             Bytes are numbered in bus order: the first address byte is 0, tx_data[i] is i+1,
+  //             then the read address if there's a Restart. Like Transaction(), a NACK on the
+  //             last tx byte is not an error, but it's still reported here.
+  Status BatchTransaction(uint8_t addr7, const uint8_t *tx_data, int tx_len, void *rx_buf, int rx_len,
+                          int *nack_index = nullptr);
+  // Same with the tx bytes gathered from cmd then data, e.g. a control byte before a payload,
+  // without copying them together first.
+  Status BatchTransaction(uint8_t addr7, std::span<const uint8_t> cmd, std::span<const uint8_t> data,
+                          void *rx_buf = nullptr, int rx_len = 0, int *nack_index = nullptr);
+
+  // Precond: SDA & SCL hold high.
+  // Postcond: SDA & SCL hold high.
+  // Probe every address in [first, last] with Start-IssueWrAddr-Stop. All probes are queued into
+  // one stream like BatchTransaction() and their ACK bits decoded in bulk, so a full scan takes a
+  // handful of USB transfers.
+  //
+  // found: Set to the addresses that ACKed, in order.
+  Status Scan(std::vector<uint8_t> *found, uint8_t first = 0x08, uint8_t last = 0x77);
+
+  // Precond: SDA & SCL hold high.
+  // Postcond: SDA & SCL hold high.
+  // Read `count` bytes from each of `regs`: one BatchTransaction(addr7, &reg, 1, ..., count) per
+  // register, all in one stream. For maps without auto increment or with gaps, a contiguous block
+  // is a single BatchTransaction().
+  //
+  // rx_buf: regs.size() * count bytes, register by register.
+  // An error names the first register that wasn't ACKed, the others are still read.
+  Status ReadRegisters(uint8_t addr7, std::span<const uint8_t> regs, int count, void *rx_buf);
+
+  //
+  // Building blocks for packing several transactions into one USB round trip, like
+  // MpsseSpi::BufferTransaction(). They only append to the device buffer, Flush() executes
+  // everything buffered and checks the ACK bits.
+  //
+  // Same sequence as Transaction(), with cmd then data as the tx bytes. At most 64 KiB read.
+  Status BufferTransaction(uint8_t addr7, std::span<const uint8_t> cmd,
+                           std::span<const uint8_t> data, void *rx_data = nullptr, int rx_len = 0);
+  // failed: If not null, set to the index of the first buffered transaction that got a NACK
+  //         Transaction() would fail on, -1 if none did. All of them are executed regardless.
+  Status Flush(int *failed = nullptr);
+  void BufferClear();
+  // Record the buffered transactions instead of flushing them, with a check for every ACK bit
+  // Flush() would verify. Replay with FtdiDevice::Replay() or Replay() below. The rx buffer
+  // holds the ACK bits among the read data, use MpsseRecording::RxOffset() on the rx_data given
+  // to BufferTransaction() to find it.
+  Status BufferRecord(MpsseRecording *recording);
+  Status Replay(const MpsseRecording &recording, void *rx = nullptr,
+                std::span<const std::span<const uint8_t>> patches = {}) {
+    return dev_->Replay(recording, rx, patches);
+  }
+
 private:
-  explicit MpsseI2c(FtdiDevice* dev) : dev_(dev) {}
+  // ACK bits of the transactions buffered by BufferTransaction(). The device buffer keeps
+  // pointers to the bits, so they live in a deque.
+  struct BufferedAcks {
+    size_t first;
+    size_t count;
+    // The last tx byte, which is allowed to be NACKed. Equal to count if there's none.
+    size_t optional;
+  };
+
+  MpsseI2c(FtdiDevice *dev, float scl_khz);
+
+  // Unlike the functions above, these only append commands to the device buffer.
+  // SET_BITS_LOW commands are repeated to hold the lines for about half a SCL period, because
+  // there're no separate USB writes to establish the time gap.
+  Status BufferHoldPins(uint8_t state);
+  Status BufferStart();
+  Status BufferRestart();
+  Status BufferStop();
+  // The ACK bit is read back into *ack_bit by the next BufferFlush(), low is ACK.
+  Status BufferWriteByte(uint8_t data, uint8_t *ack_bit);
+  Status BufferReadBytes(size_t len, void *buf);
+  // Call `queue` to fill the device buffer, then flush it. The buffer is left clean if either
+  // fails. A template so the lambdas aren't wrapped into an allocating std::function.
+  template <typename QueueFn>
+  Status FlushQueued(const QueueFn &queue);
+
   FtdiDevice* const dev_;
+  // How many times a SET_BITS_LOW is repeated by BufferHoldPins().
+  const int hold_repeat_;
+  // Reused for the ACK bits of BatchTransaction(), Scan() and ReadRegisters().
+  std::vector<uint8_t> ack_buf_;
+  std::deque<uint8_t> buffered_ack_bits_;
+  std::vector<BufferedAcks> buffered_acks_;
 };
 
 // ===================== //
@@ -276,16 +1251,84 @@ public:
 
   // Change color of multiple LEDs. One number for one LED, in that order.
   // Every number represent the RGB value of that LED. Top 8 bits are ignored. Blue in LSB.
+  // The write commands, the encoded data and the reset go out as one USB write.
   Status SendFrame(std::span<const uint32_t> rgb);
-private:
-  explicit MpsseWs2812b(FtdiDevice* dev) : dev_(dev) {}
 
+  struct AnimationStats {
+    uint64_t frames_sent = 0;
+    // Frame slots where no new frame was ready in time, the LEDs kept the previous one.
+    uint64_t frames_dropped = 0;
+    double achieved_fps = 0;
+  };
+  // Fill `rgb` (already sized to the LED count) with frame number `frame`. Return false to stop.
+  using RenderFn = std::function<bool(uint64_t frame, std::vector<uint32_t> *rgb)>;
+  // Run an animation at `fps` until `render` returns false. A producer thread renders and
+  // encodes the next frame while the current one is on the wire, the calling thread submits each
+  // frame at its slot and waits for the previous transfer to complete before reusing its buffer.
+  // `render` runs on the producer thread. `stats`, if given, is filled in when Animate() returns.
+  Status Animate(size_t leds, double fps, const RenderFn &render, AnimationStats *stats = nullptr);
+
+  // Encode LEDs to their bit symbols, 9 bytes per LED, in GRB order. Table driven.
+  static void Encode(std::span<const uint32_t> rgb, uint8_t *out);
   // Expand one byte to 3 bytes. 0 map to 0b100, 1 map to 0b110. buf is assumed to have size 3.
+  // Bit by bit reference for Encode().
   static void ExpandByte(uint8_t byte, uint8_t buf[]);
-  // Send raw data, all bits must be either "100" or "110". In GRB order. Last bit must be zero.
-  Status SendRaw(std::span<const uint8_t> raw);
+
+private:
+  explicit MpsseWs2812b(FtdiDevice* dev) : dev_(dev) {}
+
+  // LEDs per MPSSE write command, the most whose symbols fit in its 64 KiB length field.
+  static constexpr size_t kLedsPerCommand = 65536 / 9;
+
+  // Write commands, symbols and the reset for a frame.
+  static void BuildFrame(std::span<const uint32_t> rgb, std::vector<uint8_t> *out);
 
   FtdiDevice* const dev_;
+  // Commands and symbols of the last frame, reused across frames.
+  std::vector<uint8_t> frame_;
+};
+
+// ============================== //
+//  Parallel WS2812B (bit-bang)  //
+// ============================== //
+//
+// Up to 8 strips at once, one per ADBUSx pin, with the interface in asynchronous bit-bang mode.
+// Every byte written drives all 8 pins for one sample, 3 samples per bit like MpsseWs2812b:
+// all strips high, strips sending a "1" stay high, all low. So the per-strip frames are transposed
+// into bit planes. Each interface of an FT2232H can drive its own 8 strips.
+//
+// The bit-bang sample rate must come out at 2.5 MHz. It is derived from the baud rate by a factor
+// that differs between chip generations, and libftdi scales the baud rate in bit-bang mode too.
+// So check the timing on a logic analyzer once and adjust `baud` if needed.
+class ParallelWs2812b {
+public:
+  static constexpr int kMaxChannels = 8;
+  static constexpr int kDefaultBaud = 2'500'000 / 16;
+
+  // channel_mask: The ADBUS pins with a strip attached, the others stay inputs.
+  static std::unique_ptr<ParallelWs2812b> Create(FtdiDevice *dev, uint8_t channel_mask = 0xff,
+                                                 int baud = kDefaultBaud);
+  virtual ~ParallelWs2812b();
+
+  // channels[i] is the frame for ADBUSi, same format as MpsseWs2812b::SendFrame(). Strips can
+  // have different lengths. Returns once the frame is queued, so the next frame can be prepared
+  // while this one is sent. At most two frames are in flight.
+  Status SendFrames(std::span<const std::span<const uint32_t>> channels);
+
+  // Transpose 8 bytes, one per channel, into 8 bit planes. planes[0] holds the MSBs, bit i of a
+  // plane is channel i.
+  static void TransposeBytes(const uint8_t bytes[8], uint8_t planes[8]);
+
+private:
+  explicit ParallelWs2812b(FtdiDevice *dev, uint8_t channel_mask)
+      : dev_(dev), channel_mask_(channel_mask) {}
+
+  FtdiDevice *const dev_;
+  const uint8_t channel_mask_;
+  // Two sample buffers, one being sent while the other is filled.
+  std::vector<uint8_t> samples_[2];
+  FtdiDevice::Ticket tickets_[2] = {0, 0};
+  int next_buffer_ = 0;
 };
 
 // ===================== //
@@ -310,7 +1353,8 @@ private:
 // ADBUS0: CLK. Connect to CLK pin on peripherals.
 // ADBUS1: MOSI. Connect to MOSI or SDI (serial data in) pin on peripherals.
 // ADBUS2: MISO. Connect to MISO or SDO (serial data out) pin on peripherals.
-// ADBUS3: Chip select. TODO: support multiple CS pins.
+// ADBUS3: Chip select. Use MpsseSpiBus for more devices with their own CS pins.
+class MpsseSpiBus;
 class MpsseSpi {
 public:
   // CPOL: clock polarity: 0-clock idle low, 1-clock idle high
@@ -329,18 +1373,251 @@ public:
   //
   // tx_len: bytes to transmit, can be zero.
   // rx_len: bytes to receive, can be zero.
+  //
+  // If everything fits in the chip's buffer, CS, tx data, read command and SEND_IMMEDIATE go out
+  // as one USB write. Otherwise tx_data is written directly from the caller's memory in between
+  // a small header and trailer write, so large payloads are never copied.
+  // Built on the streaming API below, so any length works.
   Status Transaction(const void* tx_data, int tx_len, void* rx_data, int rx_len);
+  // Same with the tx bytes gathered from cmd then data, e.g. a command and address before a
+  // payload, without copying them together first.
+  Status Transaction(std::span<const uint8_t> cmd, std::span<const uint8_t> data,
+                     void *rx_data = nullptr, size_t rx_len = 0);
+
+  // Write-only Transaction() that returns without waiting for the data to drain, so the next one
+  // can be prepared and submitted meanwhile. tx_data must stay valid until Wait(ticket).
+  Status TransactionAsync(const void *tx_data, size_t tx_len, FtdiDevice::Ticket *ticket = nullptr);
+
+  // Streaming transaction: CS stays low from StreamBegin() to StreamEnd(), with any number of
+  // writes and reads of any length in between. The MPSSE length field is 16 bits, so longer spans
+  // become several data commands back to back, without touching CS.
+  // Small writes are copied into the device buffer, large ones are written from the caller's memory.
+  // Read data arrives by StreamEnd() at the latest, rx_data must stay valid until then.
+  Status StreamBegin();
+  Status StreamWrite(const void *tx_data, size_t len);
+  Status StreamRead(void *rx_data, size_t len);
+  // Pull CS high and flush. Ends the stream even if a previous call failed.
+  Status StreamEnd();
+  Status Wait(FtdiDevice::Ticket ticket) { return dev_->Wait(ticket); }
+
+  //
+  // Building blocks for packing several transactions into one USB round trip.
+  // They only append to the device buffer, Flush() executes everything buffered.
+  //
+  // One transaction writing cmd then data, then reading rx_len bytes into rx_data.
+  // At most 64 KiB each way.
+  Status BufferTransaction(std::span<const uint8_t> cmd, std::span<const uint8_t> data,
+                           void *rx_data = nullptr, int rx_len = 0);
+  // Keep CS high for at least `delay` by clocking without data. Deselected devices ignore it.
+  Status BufferDelay(std::chrono::duration<double> delay);
+  // Read a status register with `cmd` until (status & mask) == value.
+  // The MPSSE can't branch on what it reads, so each round trip queues several reads `interval`
+  // apart, starting with one and doubling up to kMaxPollSamples, so short waits take a single
+  // round trip and long ones few. For a ready signal on a pin, see MpsseGpio::WaitOnPin5().
+  // last: The last status read, can be nullptr.
+  static constexpr int kMaxPollSamples = 16;
+  Status PollUntil(std::span<const uint8_t> cmd, uint8_t mask, uint8_t value,
+                   std::chrono::duration<double> timeout, std::chrono::duration<double> interval,
+                   uint8_t *last = nullptr);
+
+  // extra_timeout: Should cover the buffered delays.
+  Status Flush(std::chrono::duration<double> extra_timeout = {}) {
+    return dev_->BufferFlush(extra_timeout);
+  }
+  void BufferClear() { dev_->BufferClear(); }
 
   // Return the GPIO controller for the remaining 4 pins of the lower pin bank.
-  MpsseGpio Gpio() { return {dev_, 0xf0}; }
+  // On a bus, excludes the pins other devices use as CS.
+  MpsseGpio Gpio();
+
+  // Record what was buffered, see FtdiDevice::BufferRecord(). On a bus, record right after
+  // MpsseSpiBus::Invalidate() so the clock and mode settings are part of it.
+  void BufferRecord(MpsseRecording *recording) { dev_->BufferRecord(recording); }
+  Status BufferReplay(const MpsseRecording &recording, void *rx = nullptr,
+                      std::span<const std::span<const uint8_t>> patches = {});
+  Status Replay(const MpsseRecording &recording, void *rx = nullptr,
+                std::span<const std::span<const uint8_t>> patches = {});
+
+  //
+  // Clock calibration.
+  //
+  // Set right away if the device owns the interface, with the next transaction on a bus.
+  Status SetClock(float clk_mhz);
+  float clk_mhz() const { return clk_khz_ / 1000; }
+
+  // Find the fastest clock at which `cmd` reliably reads back `expected`, within the bits set in
+  // `mask` (all if empty), and keep it. A known answer like a JEDEC or panel ID, read at a safe
+  // rate first if it isn't known. The divisor rates from max_mhz down to min_mhz are tried in
+  // order, kCalibrationReads reads in one flush each. Only the rate changes: MISO is always
+  // sampled on the edge the clock edge limitation above allows.
+  // If none passes, the clock is put back and an error returned.
+  static constexpr int kCalibrationReads = 16;
+  Status Calibrate(std::span<const uint8_t> cmd, std::span<const uint8_t> expected,
+                   std::span<const uint8_t> mask = {}, float max_mhz = 30, float min_mhz = 0.5);
+  // Same, remembered in a text file under `key`, a name without spaces for the board and
+  // peripheral. A remembered setting within the range is checked with one round of reads before
+  // it's used, the calibration only runs again if that fails.
+  Status CalibrateCached(const char *path, const std::string &key, std::span<const uint8_t> cmd,
+                         std::span<const uint8_t> expected, std::span<const uint8_t> mask = {},
+                         float max_mhz = 30, float min_mhz = 0.5);
 
 private:
-  explicit MpsseSpi(FtdiDevice* dev, int cpol, int cpha) :
-    dev_(dev), cpol_(cpol), cpha_(cpha) {}
+  friend class MpsseSpiBus;
+  explicit MpsseSpi(FtdiDevice* dev, int cpol, int cpha, float clk_khz, int cs_pin = 3,
+                    MpsseSpiBus *bus = nullptr) :
+    dev_(dev), bus_(bus), cpol_(cpol), cpha_(cpha), clk_khz_(clk_khz), cs_pin_(cs_pin) {}
+
+  // Pieces of Transaction(), they only append commands to the device buffer.
+  Status BufferCs(bool active);
+  Status BufferWriteHeader(int tx_len);
+  // phase_fixup: Read the extra bit needed by cpha == 1, only when not continuing a read.
+  Status BufferReadCommand(int rx_len, void *rx_data, bool phase_fixup = true);
+  // Buffer size needed by a transaction besides the tx data.
+  int CommandOverhead(int tx_len, int rx_len) const;
+  // StreamWrite(), with the large payloads submitted asynchronously if `async`.
+  Status StreamWriteImpl(const uint8_t *tx_data, size_t len, bool async);
+  // One round of calibration reads at the current clock, ok if all of them match.
+  Status CheckClock(std::span<const uint8_t> cmd, std::span<const uint8_t> expected,
+                    std::span<const uint8_t> mask);
+
+  // Longest span of one MPSSE data command.
+  static constexpr size_t kMaxCommandLen = 65536;
 
   FtdiDevice* const dev_;
+  // The bus this device shares, or nullptr if it owns the interface.
+  MpsseSpiBus *const bus_;
   const int cpol_;
   const int cpha_;
+  float clk_khz_;
+  // 3-7: ADBUSx, 8-15: ACBUS(x-8).
+  const int cs_pin_;
+  bool streaming_ = false;
+  // The last stream operation was a read, the next read continues without a phase fixup.
+  bool stream_reading_ = false;
+};
+
+// ================ //
+//  Shared SPI bus  //
+// ================ //
+//
+// Several devices on the CLK/MOSI/MISO of one interface, each with its own CS pin, mode and clock.
+// CS pins: 3-7 for ADBUS3-7, 8-15 for ACBUS0-7.
+//
+// Before a device's transaction the bus only emits the settings that differ from the device used
+// last: TCK_DIVISOR and 3-phase clocking for the clock, the clock idle level for CPOL.
+// Transactions share the device buffer, so BufferTransaction() on several handles followed by one
+// Flush() reaches all those devices in a single USB write.
+class MpsseSpiBus {
+public:
+  static std::unique_ptr<MpsseSpiBus> Create(FtdiDevice *dev);
+  virtual ~MpsseSpiBus();
+
+  // Same parameters as MpsseSpi::Create(). nullptr if the pin is invalid or taken.
+  // The handle must not outlive the bus.
+  std::unique_ptr<MpsseSpi> AddDevice(int cs_pin, int cpol, int cpha, float clk_mhz = 1);
+
+  Status Flush(std::chrono::duration<double> extra_timeout = {}) {
+    return dev_->BufferFlush(extra_timeout);
+  }
+
+  // Re-emit every setting before the next transaction, e.g. after a failed flush dropped them.
+  void Invalidate() { clk_khz_ = 0; cpol_ = -1; }
+
+  // GPIO controller for the ADBUS4-7 pins not used as CS.
+  MpsseGpio Gpio() { return {dev_, static_cast<uint8_t>(0xf0 & ~cs_pins_)}; }
+
+private:
+  friend class MpsseSpi;
+  explicit MpsseSpiBus(FtdiDevice *dev) : dev_(dev) {}
+
+  // Buffer the settings of `spi` that differ from the current ones. Every CS is high here.
+  Status BufferSelect(const MpsseSpi &spi);
+  void ReleasePin(int cs_pin) { cs_pins_ &= ~(1 << cs_pin); }
+
+  FtdiDevice *const dev_;
+  // Bit x set if pin x is a CS.
+  uint16_t cs_pins_ = 0;
+  // Settings last emitted.
+  float clk_khz_ = 0;
+  bool three_phase_ = false;
+  int cpol_ = -1;
+};
+
+// ======================= //
+//  SPI NOR Flash (W25Qxx) //
+// ======================= //
+//
+// Winbond W25Q style flash: 256-byte pages, 4 KiB sectors, 3-byte addresses. SPI mode 0 or 3.
+//
+// The MPSSE can't branch on what it reads, so the BUSY bit can't be waited on inside a command
+// stream. Instead Program() sends a 4 KiB sector worth of pages per USB round trip, each page as
+// [read status][write enable][page program][idle for tPP]. A busy flash ignores everything but
+// the status read, so if a page's status sample shows BUSY, that page wasn't taken and is sent
+// again with the next batch, and the idle time is raised.
+// WaitReady() likewise queues several status samples a poll interval apart per round trip, see
+// MpsseSpi::PollUntil().
+//
+// Dual and quad output reads need more than one data input, the MPSSE only has one (ADBUS2).
+class MpsseSpiFlash {
+public:
+  static constexpr uint32_t kPageSize = 256;
+  static constexpr uint32_t kSectorSize = 4096;
+  static constexpr uint32_t kBlockSize = 65536;
+
+  struct JedecId {
+    uint8_t manufacturer;
+    uint8_t memory_type;
+    uint32_t size_bytes;
+  };
+
+  explicit MpsseSpiFlash(MpsseSpi *spi) : spi_(spi) {}
+
+  Status ReadJedecId(JedecId *id);
+  Status ReadStatus1(uint8_t *status);
+  // Poll until the BUSY bit clears.
+  Status WaitReady(std::chrono::duration<double> timeout,
+                   std::chrono::duration<double> interval = std::chrono::microseconds(100));
+
+  // Read (0x03) is good up to 50 MHz, beyond the FT2232H's 30 MHz. Fast Read (0x0B) adds a dummy
+  // byte, for parts or clock setups that need it. Any length, as one continuous read.
+  Status Read(uint32_t addr, void *buf, uint32_t len);
+  Status FastRead(uint32_t addr, void *buf, uint32_t len);
+
+  // Erase and wait for completion.
+  Status EraseSector(uint32_t addr);  // 4 KiB
+  Status EraseBlock(uint32_t addr);   // 64 KiB
+  Status EraseChip();
+
+  // Program erased flash. Any alignment and length, and waits for the last page to finish.
+  Status Program(uint32_t addr, const void *data, uint32_t len);
+
+  // Idle time after each page in Program(), raised while pages come back busy.
+  // Typical tPP of W25Q parts is 0.4-0.7 ms, max 3 ms.
+  void SetPageProgramTime(std::chrono::microseconds t) { page_program_time_ = t; }
+  std::chrono::microseconds page_program_time() const { return page_program_time_; }
+
+private:
+  struct PageWrite {
+    uint32_t addr;
+    const uint8_t *data;
+    uint32_t len;
+  };
+
+  // After a batch of Program(): read back the pages sampled busy, keep those that didn't take.
+  Status DropProgrammed(std::vector<PageWrite> *pages);
+  Status BufferWriteEnable();
+  Status BufferStatusRead(uint8_t *status);
+  Status ReadCommand(uint8_t cmd, bool dummy, uint32_t addr, void *buf, uint32_t len);
+  Status Erase(uint8_t cmd, std::span<const uint8_t> addr, std::chrono::duration<double> timeout,
+               std::chrono::duration<double> interval);
+
+  MpsseSpi *const spi_;
+  std::chrono::microseconds page_program_time_{700};
+  // Scratch space of Program(), kept to avoid allocations.
+  std::vector<PageWrite> batch_;
+  std::vector<PageWrite> retry_;
+  std::vector<uint8_t> status_;
+  std::vector<uint8_t> verify_;
 };
 
 } // namespace mpsse_protocol
@@ -0,0 +1,386 @@
+#ifndef __MPSSE_SENSOR_H__
+#define __MPSSE_SENSOR_H__
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+namespace mpsse_protocol {
+
+// ================ //
+//  Register cache  //
+// ================ //
+
+// One register access of a RegisterBus::Transfer(). `data` is len bytes in bus order.
+struct RegisterIo {
+  uint8_t reg;
+  uint8_t len;
+  uint8_t *data;
+};
+
+// How a peripheral's registers are addressed on the bus.
+class RegisterBus {
+public:
+  virtual ~RegisterBus() = default;
+  // Do all the writes, then all the reads, in as few USB round trips as the bus allows.
+  Status Transfer(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads);
+
+  // Transfer() in two steps, so accesses to several peripherals can share a flush. Queue() only
+  // buffers. Flush() executes everything queued on the buses of the same group() and fails if
+  // any access did. Clear() drops what's queued on the group.
+  virtual Status Queue(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) = 0;
+  virtual Status Flush() = 0;
+  virtual void Clear() = 0;
+  // Buses with the same group share a flush, i.e. the same protocol object.
+  virtual const void *group() const = 0;
+};
+
+// Start-IssueWrAddr-reg-data-Stop writes and Start-IssueWrAddr-reg-Restart-IssueRdAddr-data-Stop
+// reads, all buffered into one flush.
+class I2cRegisterBus : public RegisterBus {
+public:
+  I2cRegisterBus(MpsseI2c *i2c, uint8_t addr7) : i2c_(i2c), addr7_(addr7) {}
+  Status Queue(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) override;
+  Status Flush() override { return i2c_->Flush(); }
+  void Clear() override { i2c_->BufferClear(); }
+  const void *group() const override { return i2c_; }
+
+private:
+  MpsseI2c *const i2c_;
+  const uint8_t addr7_;
+};
+
+// One CS cycle per access, sending the register address ORed with write_flag or read_flag, then
+// the data. All buffered into one flush. The defaults suit most sensors, e.g. MAX31856.
+class SpiRegisterBus : public RegisterBus {
+public:
+  explicit SpiRegisterBus(MpsseSpi *spi, uint8_t write_flag = 0x80, uint8_t read_flag = 0x00)
+      : spi_(spi), write_flag_(write_flag), read_flag_(read_flag) {}
+  Status Queue(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) override;
+  Status Flush() override { return spi_->Flush(); }
+  void Clear() override { spi_->BufferClear(); }
+  const void *group() const override { return spi_; }
+
+private:
+  MpsseSpi *const spi_;
+  const uint8_t write_flag_;
+  const uint8_t read_flag_;
+};
+
+// Keeps a copy of a peripheral's registers, so configuration that didn't change isn't written
+// again and registers that only change when written are read once:
+//
+//   using R = RegisterCache::Register;
+//   RegisterCache regs(std::make_unique<I2cRegisterBus>(i2c.get(), 0x18),
+//                      {{0x05, 2, R::kVolatile}, {0x06, 2, R::kConstant}, {0x08, 1, R::kCached}});
+//   regs.Write(0x08, &resolution);  // Dropped if the register already has that value.
+//   regs.Read(0x06, &id);           // From the bus the first time only.
+//
+// Registers wider than a byte are raw bytes in bus order. A block read with auto increment, like
+// MAX31856's 0x0a-0x0f, can be one wide register.
+//
+// In write-back mode, writes to cached registers are only marked dirty. Flush() writes them all in
+// one bus transaction, and so does anything that has to go to the bus anyway: a read that misses
+// or a write to a volatile register take the dirty registers along, written first.
+//
+// Not thread safe, like the protocol classes.
+class RegisterCache {
+public:
+  struct Register {
+    enum Policy : uint8_t {
+      // Data and status, changes on its own. Always read, every write goes out.
+      kVolatile,
+      // Configuration, only changes when written. Read once, writes of the value it already holds
+      // are dropped.
+      kCached,
+      // IDs and calibration. Read once, can't be written.
+      kConstant,
+    };
+    uint8_t reg;
+    uint8_t width;
+    Policy policy;
+  };
+
+  enum WriteMode { kWriteThrough, kWriteBack };
+
+  struct Stats {
+    // Bus transactions, each one a RegisterBus::Transfer().
+    uint64_t transfers = 0;
+    uint64_t reads = 0;
+    // Reads served from the cache.
+    uint64_t read_hits = 0;
+    uint64_t writes = 0;
+    // Writes dropped because the register already held the value, or that were folded into a
+    // later write of the same dirty register.
+    uint64_t writes_elided = 0;
+  };
+
+  RegisterCache(std::unique_ptr<RegisterBus> bus, std::span<const Register> map,
+                WriteMode mode = kWriteThrough);
+  RegisterCache(std::unique_ptr<RegisterBus> bus, std::initializer_list<Register> map,
+                WriteMode mode = kWriteThrough)
+      : RegisterCache(std::move(bus), std::span(map.begin(), map.size()), mode) {}
+
+  // data: The register's width bytes. Registers not in the map are an error.
+  Status Read(uint8_t reg, void *data);
+  // Several registers in one bus transaction, the ones cached are not read. data holds them back
+  // to back.
+  Status Read(std::span<const uint8_t> regs, void *data);
+  Status Write(uint8_t reg, const void *data);
+  // Write the dirty registers.
+  Status Flush();
+  // Forget all values, e.g. after the peripheral was reset. Dirty registers are dropped.
+  void Invalidate();
+  // Forget one register's value, so the next Read() goes to the bus.
+  void Invalidate(uint8_t reg);
+
+  // Width of `reg`, 0 if it's not in the map.
+  int width(uint8_t reg) const;
+  const Stats &stats() const { return stats_; }
+  void ResetStats() { stats_ = {}; }
+
+private:
+  struct Entry {
+    Register info;
+    // Offset of the value in values_.
+    uint32_t offset;
+    bool known;
+    bool dirty;
+  };
+
+  Entry *Find(uint8_t reg);
+  // The dirty registers and `reads` in one transfer. The values read are cached if the register
+  // isn't volatile.
+  Status Transfer(std::span<const RegisterIo> extra_writes, std::span<const RegisterIo> reads);
+
+  const std::unique_ptr<RegisterBus> bus_;
+  const WriteMode mode_;
+  std::vector<Entry> entries_;
+  // Index into entries_ + 1, 0 if the register isn't mapped.
+  std::array<uint16_t, 256> index_{};
+  std::vector<uint8_t> values_;
+  Stats stats_;
+  // Reused between calls.
+  std::vector<RegisterIo> writes_;
+  std::vector<RegisterIo> reads_;
+  std::vector<uint8_t> scratch_;
+};
+
+// ============= //
+//  Sample ring  //
+// ============= //
+
+// Lock-free ring with one producer and any number of consumers, each consumer sees every element.
+// The producer never waits: it overwrites the oldest element, and a consumer that fell more than
+// the capacity behind skips ahead and counts what it lost.
+//
+// Each slot has a sequence number, odd while the producer writes it (a seqlock). A consumer copies
+// the slot and keeps the copy only if the sequence didn't change meanwhile.
+template <typename T>
+class SampleRing {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  class Reader {
+  public:
+    // Take the next element, false if there's none yet.
+    bool Pop(T *out);
+    // Pop up to out.size() elements, return how many.
+    size_t Drain(std::span<T> out);
+    // Elements overwritten before this reader got to them.
+    uint64_t dropped() const { return dropped_; }
+
+  private:
+    friend class SampleRing;
+    Reader(const SampleRing *ring, uint64_t next) : ring_(ring), next_(next) {}
+
+    const SampleRing *ring_;
+    uint64_t next_;
+    uint64_t dropped_ = 0;
+  };
+
+  // Rounded up to a power of 2.
+  explicit SampleRing(size_t capacity) : slots_(std::bit_ceil(std::max<size_t>(capacity, 2))) {}
+
+  // Producer thread only.
+  void Push(const T &value);
+  // Any thread. Starts with the next element pushed.
+  Reader NewReader() const { return Reader(this, head_.load(std::memory_order_acquire)); }
+
+  size_t capacity() const { return slots_.size(); }
+  // Elements pushed so far.
+  uint64_t pushed() const { return head_.load(std::memory_order_acquire); }
+
+private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> seq{0};
+    T value;
+  };
+
+  std::vector<Slot> slots_;
+  alignas(64) std::atomic<uint64_t> head_{0};
+};
+
+template <typename T>
+void SampleRing<T>::Push(const T &value) {
+  const uint64_t pos = head_.load(std::memory_order_relaxed);
+  Slot &slot = slots_[pos & (slots_.size() - 1)];
+  // Element `pos` is complete once seq is 2 * pos + 2.
+  slot.seq.store(2 * pos + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(&slot.value, &value, sizeof(T));
+  slot.seq.store(2 * pos + 2, std::memory_order_release);
+  head_.store(pos + 1, std::memory_order_release);
+}
+
+template <typename T>
+bool SampleRing<T>::Reader::Pop(T *out) {
+  const auto &slots = ring_->slots_;
+  while (true) {
+    const uint64_t head = ring_->head_.load(std::memory_order_acquire);
+    if (next_ >= head) return false;
+    if (head - next_ > slots.size()) {
+      // Overwritten already, start from the oldest one left.
+      dropped_ += head - next_ - slots.size();
+      next_ = head - slots.size();
+    }
+    const auto &slot = slots[next_ & (slots.size() - 1)];
+    const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq == 2 * next_ + 2) {
+      std::memcpy(out, &slot.value, sizeof(T));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) == seq) {
+        next_++;
+        return true;
+      }
+    }
+    // The producer lapped us on this slot, look at the head again.
+  }
+}
+
+template <typename T>
+size_t SampleRing<T>::Reader::Drain(std::span<T> out) {
+  size_t n = 0;
+  while (n < out.size() && Pop(&out[n])) n++;
+  return n;
+}
+
+// ===================== //
+//  Sampling scheduler   //
+// ===================== //
+
+// One reading of a sensor.
+struct Sample {
+  static constexpr size_t kMaxBytes = 16;
+  // When the USB transfer that read it completed.
+  std::chrono::steady_clock::time_point time;
+  // As returned by SamplingScheduler::AddSensor().
+  uint32_t sensor;
+  uint32_t len;
+  // The registers read, back to back in bus order.
+  std::array<uint8_t, kMaxBytes> data;
+};
+
+// Polls sensors at fixed rates on an acquisition thread and pushes the samples into a SampleRing:
+//
+//   SamplingScheduler sched(1024);
+//   I2cRegisterBus mcp9808(i2c.get(), 0x18), other(i2c.get(), 0x19);
+//   sched.AddSensor(&mcp9808, {{0x05, 2}}, std::chrono::seconds(1));
+//   sched.AddSensor(&other, {{0x05, 2}}, std::chrono::seconds(1));
+//   sched.Start();
+//   auto reader = sched.ring().NewReader();  // On each exporter thread.
+//
+// Sensors are due at multiples of their period from Start(), so the timing doesn't drift with the
+// bus time. A due time that's missed by more than a period is skipped and counted. Reads due at the
+// same tick whose buses share a group() are queued together and executed as one flush, e.g. every
+// sensor on an I2C bus. If a flush fails, its sensors are read again one by one so a single bad
+// sensor only loses its own samples.
+//
+// Configure the sensors before Start(), e.g. through a RegisterCache. While running, the
+// scheduler's thread is the only one that may use the buses.
+class SamplingScheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+  struct Read {
+    uint8_t reg;
+    uint8_t len;
+  };
+  struct SensorStats {
+    uint64_t samples = 0;
+    uint64_t errors = 0;
+    // Due times skipped because the scheduler was late.
+    uint64_t missed = 0;
+  };
+
+  explicit SamplingScheduler(size_t ring_capacity) : ring_(ring_capacity) {}
+  // Stops the thread if running.
+  virtual ~SamplingScheduler();
+
+  // Not while running. The reads take at most Sample::kMaxBytes. Returns the sensor id, or -1 if
+  // the reads are too long. `bus` must outlive the scheduler.
+  int AddSensor(RegisterBus *bus, std::span<const Read> reads, Clock::duration period,
+                Clock::duration phase = {});
+  int AddSensor(RegisterBus *bus, std::initializer_list<Read> reads, Clock::duration period,
+                Clock::duration phase = {}) {
+    return AddSensor(bus, std::span(reads.begin(), reads.size()), period, phase);
+  }
+
+  // Run the acquisition thread, the first reads are due right away (plus each phase).
+  void Start();
+  void Stop();
+  // Without the thread: read the sensors due at `now`, return when the next one is due. Call
+  // Reset() first to set the schedule's origin.
+  Clock::time_point Tick(Clock::time_point now);
+  void Reset(Clock::time_point origin);
+
+  const SampleRing<Sample> &ring() const { return ring_; }
+  // Only consistent while not running.
+  const SensorStats &stats(int sensor) const { return sensors_[sensor].stats; }
+  // Flushes done, fewer than the reads when sensors share them.
+  uint64_t flushes() const { return flushes_; }
+
+private:
+  struct Sensor {
+    RegisterBus *bus;
+    std::vector<Read> reads;
+    Sample sample;
+    Clock::duration period;
+    Clock::duration phase;
+    Clock::time_point due;
+    SensorStats stats;
+  };
+
+  void Loop();
+  // Read the sensors in due_ on the group of due_[begin], all in one flush when possible.
+  void ReadGroup(size_t begin, size_t end);
+  void Publish(Sensor *sensor, Clock::time_point time);
+
+  SampleRing<Sample> ring_;
+  std::vector<Sensor> sensors_;
+  // Scratch, indices of the sensors due at a tick and the reads of one sensor.
+  std::vector<size_t> due_;
+  std::vector<RegisterIo> io_;
+  uint64_t flushes_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+} // namespace mpsse_protocol
+
+#endif // __MPSSE_SENSOR_H__
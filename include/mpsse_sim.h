@@ -0,0 +1,159 @@
+#ifndef __MPSSE_SIM_H__
+#define __MPSSE_SIM_H__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "mpsse_protocol.h"
+
+namespace mpsse_protocol {
+
+// ================= //
+//  MPSSE simulator  //
+// ================= //
+
+// An FT2232H channel modelled in process, to run the protocol classes without hardware:
+//
+//   auto owned = std::make_unique<MpsseSim>();
+//   MpsseSim *sim = owned.get();
+//   auto dev = FtdiDevice::OpenTransport(std::move(owned));
+//   auto i2c = MpsseI2c::Create(dev.get(), 400);
+//   i2c->Transaction(...);
+//   std::printf("%lu round trips\n", sim->stats().round_trips);
+//
+// The MPSSE commands are interpreted with the chip's buffering: 4 KiB TX and RX buffers, the
+// MPSSE stalls when the RX buffer is full, responses go to the host on SEND_IMMEDIATE, per full
+// USB packet or when the latency timer expires. A virtual clock adds up what the same traffic
+// would take on a real chip: USB transfers, clocking at the divisor set, latency timer waits.
+// Nothing sleeps, so runs are deterministic and fast.
+//
+// Not thread safe, like the rest of an FtdiDevice.
+class MpsseSim : public FtdiTransport {
+public:
+  struct Options {
+    // Cost of a USB transfer. High-speed bulk transfers are scheduled per 125 us microframe.
+    std::chrono::nanoseconds usb_transfer_time{125'000};
+    // The USB payload rate, about 40 MB/s in practice.
+    double usb_ns_per_byte = 25;
+    // Sample rate in bit-bang mode. The chip derives it from the baud rate by a factor that
+    // depends on its generation, see ParallelWs2812b.
+    double bitbang_hz = 2.5e6;
+  };
+
+  struct Stats {
+    // USB transfers, split at the chunk sizes like libftdi does. Control transfers are bit mode,
+    // baud rate and modem status requests.
+    uint64_t usb_writes = 0;
+    uint64_t usb_reads = 0;
+    uint64_t control_transfers = 0;
+    // Read() calls and async reads, each one waits for the chip.
+    uint64_t round_trips = 0;
+    uint64_t tx_bytes = 0;
+    uint64_t rx_bytes = 0;
+    uint64_t commands = 0;
+    uint64_t send_immediates = 0;
+    // Reads that only completed because the latency timer expired, i.e. a missing SEND_IMMEDIATE.
+    uint64_t latency_timer_flushes = 0;
+    // Times the MPSSE stopped because the RX buffer was full.
+    uint64_t rx_stalls = 0;
+    uint64_t bad_commands = 0;
+    uint64_t timeouts = 0;
+    // Virtual time of everything above, and the part of it spent clocking on the MPSSE.
+    std::chrono::nanoseconds wire_time{0};
+    std::chrono::nanoseconds clock_time{0};
+  };
+
+  // Called for each data shift with the byte clocked out (0 for read-only commands) and the number
+  // of bits, returns the byte clocked in. Bits are passed as the command has them, LSB or MSB
+  // first. Without one, MISO and SDA read low: reads are all zeros and every I2C byte is ACKed.
+  using ShiftFn = std::function<uint8_t(uint8_t out, int bits)>;
+
+  MpsseSim() : MpsseSim(Options{}) {}
+  explicit MpsseSim(const Options &options) : options_(options) {}
+
+  void SetShift(ShiftFn shift) { shift_ = std::move(shift); }
+  // Levels driven onto the pins configured as inputs, bit[x]: ADBUSx / ACBUSx. A WAIT_ON_HIGH or
+  // WAIT_ON_LOW on ADBUS5 resumes once it's satisfied.
+  void SetInputs(uint8_t low, uint8_t high);
+  // Pin levels as GET_BITS_LOW / GET_BITS_HIGH would read them.
+  uint8_t low_pins() const { return (low_state_ & low_dir_) | (low_input_ & ~low_dir_); }
+  uint8_t high_pins() const { return (high_state_ & high_dir_) | (high_input_ & ~high_dir_); }
+  double clock_hz() const;
+
+  const Stats &stats() const { return stats_; }
+  void ResetStats() { stats_ = {}; }
+
+  Status Write(const uint8_t *buf, size_t len) override;
+  Status Read(uint8_t *buf, size_t len, std::chrono::duration<double> timeout) override;
+  // Writes run right away. Reads are served when finished, so everything written in between can
+  // add to them.
+  FtdiTransfer *SubmitWrite(const uint8_t *buf, size_t len) override;
+  FtdiTransfer *SubmitRead(uint8_t *buf, size_t len) override;
+  int Finish(FtdiTransfer *transfer) override;
+  Status PollModemStatus(uint16_t *status) override;
+  Status SetBitmode(uint8_t mask, uint8_t mode) override;
+  Status SetBaudrate(int baud) override;
+  Status Purge() override;
+  Status ApplyTuning(const FtdiTuning &tuning) override;
+  uint32_t WriteChunkSize() override { return tuning_.write_chunk_size; }
+
+private:
+  // Max payload of a high-speed USB packet from the chip, the other 2 bytes are modem status.
+  static constexpr size_t kPacketPayload = 510;
+
+  struct Transfer {
+    bool read;
+    uint8_t *buf;
+    size_t len;
+    int result;
+  };
+
+  // Execute commands from the TX buffer until it runs dry or the MPSSE stalls.
+  void Run();
+  // Execute the complete command `cmd`. False if the MPSSE has to stall on it.
+  bool Execute(const uint8_t *cmd, size_t len);
+  // Clock what's available of the data command in progress. False if nothing could be done.
+  bool RunData();
+  uint8_t Shift(uint8_t out, int bits);
+  // The MPSSE can't queue `n` more bytes of response and stalls.
+  bool RxFull(size_t n);
+  void Respond(uint8_t byte) { rx_.push_back(byte); }
+  void Clock(uint64_t bits);
+  void Elapse(std::chrono::nanoseconds t) { stats_.wire_time += t; }
+  void UsbTransfer(size_t bytes);
+  size_t TxPending() const { return tx_.size() - tx_head_; }
+  size_t RxPending() const { return rx_.size() - rx_head_; }
+
+  Options options_;
+  ShiftFn shift_;
+  FtdiTuning tuning_ = FtdiTuning::Default();
+  Stats stats_;
+
+  // Bytes written but not executed yet, from tx_head_. Same for the responses not read yet.
+  std::vector<uint8_t> tx_;
+  size_t tx_head_ = 0;
+  std::vector<uint8_t> rx_;
+  size_t rx_head_ = 0;
+  // Responses up to here can go to the host without waiting for the latency timer.
+  size_t rx_sendable_ = 0;
+  bool rx_stalled_ = false;
+  // A byte mode data command in progress: its opcode and the bytes left to clock. The payload
+  // streams through the TX buffer, it can be larger than the buffer.
+  uint8_t data_op_ = 0;
+  size_t data_left_ = 0;
+
+  uint8_t mode_ = BITMODE_RESET;
+  int baud_ = 9600;
+  uint8_t low_state_ = 0, low_dir_ = 0, low_input_ = 0;
+  uint8_t high_state_ = 0, high_dir_ = 0, high_input_ = 0;
+  uint16_t divisor_ = 0;
+  bool div5_ = true;
+  bool three_phase_ = false;
+  bool loopback_ = false;
+};
+
+} // namespace mpsse_protocol
+
+#endif // __MPSSE_SIM_H__
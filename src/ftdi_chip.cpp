@@ -0,0 +1,78 @@
+#include "mpsse_protocol.h"
+
+#include <chrono>
+#include <cstdio>
+#include <ftdi.h>
+#include <libusb.h>
+#include <memory>
+
+namespace mpsse_protocol {
+
+std::unique_ptr<FtdiChip> FtdiChip::OpenVendorProduct(uint16_t id_vendor, uint16_t id_product,
+                                                      std::optional<FtdiTuning> tuning) {
+  auto first = FtdiDevice::OpenVendorProduct(id_vendor, id_product, INTERFACE_A, tuning);
+  if (first == nullptr) return nullptr;
+  return OpenRemaining(std::move(first), tuning);
+}
+
+std::unique_ptr<FtdiChip> FtdiChip::OpenBusDevice(int bus, int device,
+                                                  std::optional<FtdiTuning> tuning) {
+  auto first = FtdiDevice::OpenBusDevice(bus, device, INTERFACE_A, tuning);
+  if (first == nullptr) return nullptr;
+  return OpenRemaining(std::move(first), tuning);
+}
+
+std::unique_ptr<FtdiChip> FtdiChip::OpenRemaining(std::unique_ptr<FtdiDevice> first,
+                                                  const std::optional<FtdiTuning> &tuning) {
+  auto chip = std::unique_ptr<FtdiChip>(new FtdiChip());
+  chip->channels_ = MpsseChannels(first->context());
+  libusb_device *usb = libusb_get_device(first->context()->usb_dev);
+  const int bus = libusb_get_bus_number(usb);
+  const int device = libusb_get_device_address(usb);
+  chip->devices_[0] = std::move(first);
+
+  for (int i = 1; i < chip->channels_; i++) {
+    auto intf = static_cast<enum ftdi_interface>(INTERFACE_A + i);
+    chip->devices_[i] = FtdiDevice::OpenBusDevice(bus, device, intf, tuning);
+    if (chip->devices_[i] == nullptr) {
+      std::fprintf(stderr, "Cannot open channel %c of %03d:%03d\n", 'A' + i, bus, device);
+      return nullptr;
+    }
+  }
+  return chip;
+}
+
+int FtdiChip::MpsseChannels(struct ftdi_context *ctx) {
+  switch (ctx->type) {
+  case TYPE_2232H:
+  case TYPE_4232H:
+    return 2;
+  default:
+    return 1;
+  }
+}
+
+FtdiDeviceQueue *FtdiChip::Queue(int i) {
+  if (queues_[i] == nullptr) queues_[i] = std::make_unique<FtdiDeviceQueue>(devices_[i].get());
+  return queues_[i].get();
+}
+
+FtdiChip::ChannelStats FtdiChip::Stats(int i) const {
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start_).count();
+  ChannelStats st;
+  st.tx_bytes = devices_[i]->tx_bytes() - tx_base_[i];
+  st.rx_bytes = devices_[i]->rx_bytes() - rx_base_[i];
+  st.tx_bytes_per_s = elapsed > 0 ? st.tx_bytes / elapsed : 0;
+  st.rx_bytes_per_s = elapsed > 0 ? st.rx_bytes / elapsed : 0;
+  return st;
+}
+
+void FtdiChip::ResetStats() {
+  for (int i = 0; i < channels_; i++) {
+    tx_base_[i] = devices_[i]->tx_bytes();
+    rx_base_[i] = devices_[i]->rx_bytes();
+  }
+  stats_start_ = std::chrono::steady_clock::now();
+}
+
+} // namespace mpsse_protocol
@@ -1,20 +1,192 @@
 #include "mpsse_protocol.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cerrno>
+#include <cstring>
 #include <format>
 #include <ftdi.h>
 #include <initializer_list>
+#include <libusb.h>
 #include <memory>
 #include <span>
 #include <thread>
 
+#define RETURN_IF_ERR(st)                                                                               \
+  do {                                                                                                  \
+    Status s = (st);                                                                                    \
+    if (!s.ok()) return s;                                                                              \
+  } while (0)
+
 namespace mpsse_protocol {
 
+namespace {
+
+const char *OpcodeName(uint8_t op) {
+  if (op < 0x80) {
+    if (op & MPSSE_WRITE_TMS) return "TMS";
+    static constexpr const char *kData[2][4] = {
+        {"BYTES", "WRITE_BYTES", "READ_BYTES", "RW_BYTES"},
+        {"BITS", "WRITE_BITS", "READ_BITS", "RW_BITS"},
+    };
+    return kData[(op & MPSSE_BITMODE) ? 1 : 0][((op & MPSSE_DO_WRITE) ? 1 : 0) |
+                                                ((op & MPSSE_DO_READ) ? 2 : 0)];
+  }
+  switch (op) {
+  case SET_BITS_LOW: return "SET_BITS_LOW";
+  case GET_BITS_LOW: return "GET_BITS_LOW";
+  case SET_BITS_HIGH: return "SET_BITS_HIGH";
+  case GET_BITS_HIGH: return "GET_BITS_HIGH";
+  case LOOPBACK_START: return "LOOPBACK_START";
+  case LOOPBACK_END: return "LOOPBACK_END";
+  case TCK_DIVISOR: return "TCK_DIVISOR";
+  case SEND_IMMEDIATE: return "SEND_IMMEDIATE";
+  case WAIT_ON_HIGH: return "WAIT_ON_HIGH";
+  case WAIT_ON_LOW: return "WAIT_ON_LOW";
+  case DIS_DIV_5: return "DIS_DIV_5";
+  case EN_DIV_5: return "EN_DIV_5";
+  case EN_3_PHASE: return "EN_3_PHASE";
+  case DIS_3_PHASE: return "DIS_3_PHASE";
+  case CLK_BITS: return "CLK_BITS";
+  case CLK_BYTES: return "CLK_BYTES";
+  case CLK_WAIT_HIGH: return "CLK_WAIT_HIGH";
+  case CLK_WAIT_LOW: return "CLK_WAIT_LOW";
+  case EN_ADAPTIVE: return "EN_ADAPTIVE";
+  case DIS_ADAPTIVE: return "DIS_ADAPTIVE";
+  case CLK_BYTES_OR_HIGH: return "CLK_BYTES_OR_HIGH";
+  case CLK_BYTES_OR_LOW: return "CLK_BYTES_OR_LOW";
+  case DRIVE_OPEN_COLLECTOR: return "DRIVE_OPEN_COLLECTOR";
+  default: return nullptr;
+  }
+}
+
+const char *KindName(FtdiTraceEvent::Kind kind) {
+  switch (kind) {
+  case FtdiTraceEvent::kWrite: return "Write";
+  case FtdiTraceEvent::kRead: return "Read";
+  case FtdiTraceEvent::kReadTimeout: return "Read timeout";
+  case FtdiTraceEvent::kFlush: return "Flush";
+  case FtdiTraceEvent::kCommand: return "Command";
+  case FtdiTraceEvent::kSync: return "Sync";
+  case FtdiTraceEvent::kTxEmptyWait: return "Wait TX empty";
+  case FtdiTraceEvent::kAsyncWrite: return "Async write";
+  case FtdiTraceEvent::kAsyncRead: return "Async read";
+  }
+  return "?";
+}
+
+int64_t Nanoseconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+class LibftdiTransport : public FtdiTransport {
+public:
+  explicit LibftdiTransport(struct ftdi_context *ctx) : ctx_(ctx) {}
+
+  Status Write(const uint8_t *buf, size_t len) override {
+    int ret = ftdi_write_data(ctx_, buf, len);
+    if (ret < 0 || static_cast<size_t>(ret) != len) {
+      return Status::Err("ftdi_write_data() failed: expected {} got {}", len, ret);
+    }
+    return Status::Ok();
+  }
+
+  Status Read(uint8_t *buf, size_t len, std::chrono::duration<double> timeout) override {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    // Sleep in libusb until the read transfer completes, instead of spinning on ftdi_read_data().
+    // libftdi resubmits the transfer from its callback until len bytes arrived.
+    auto *tc = ftdi_read_data_submit(ctx_, buf, len);
+    if (tc == nullptr) return Status::Err("ftdi_read_data_submit() failed");
+    while (!tc->completed) {
+      auto remaining = deadline - std::chrono::steady_clock::now();
+      if (remaining <= std::chrono::steady_clock::duration::zero()) break;
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>(remaining).count();
+      struct timeval tv = {.tv_sec = static_cast<time_t>(us / 1'000'000),
+                           .tv_usec = static_cast<suseconds_t>(us % 1'000'000)};
+      int err = libusb_handle_events_timeout_completed(ctx_->usb_ctx, &tv, &tc->completed);
+      if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+        ftdi_transfer_data_cancel(tc, nullptr);
+        return Status::Err("libusb_handle_events_timeout_completed() failed: {}", err);
+      }
+    }
+    if (!tc->completed) {
+      int got = tc->offset;
+      // Frees tc. The bytes received so far are dropped.
+      ftdi_transfer_data_cancel(tc, nullptr);
+      return Status::Errno(ETIMEDOUT, "ftdi_read_data() timed out: expected {} got {}", len, got);
+    }
+    int ret = ftdi_transfer_data_done(tc);
+    if (ret < 0 || static_cast<size_t>(ret) != len) {
+      return Status::Err("ftdi_read_data() failed: expected {} got {}", len, ret);
+    }
+    return Status::Ok();
+  }
+
+  FtdiTransfer *SubmitWrite(const uint8_t *buf, size_t len) override {
+    auto *tc = ftdi_write_data_submit(ctx_, const_cast<uint8_t *>(buf), len);
+    return reinterpret_cast<FtdiTransfer *>(tc);
+  }
+
+  FtdiTransfer *SubmitRead(uint8_t *buf, size_t len) override {
+    return reinterpret_cast<FtdiTransfer *>(ftdi_read_data_submit(ctx_, buf, len));
+  }
+
+  int Finish(FtdiTransfer *transfer) override {
+    return ftdi_transfer_data_done(reinterpret_cast<struct ftdi_transfer_control *>(transfer));
+  }
+
+  Status PollModemStatus(uint16_t *status) override {
+    int err = ftdi_poll_modem_status(ctx_, status);
+    if (err) return Status::Err("ftdi_poll_modem_status() failed: {}", err);
+    return Status::Ok();
+  }
+
+  Status SetBitmode(uint8_t mask, uint8_t mode) override {
+    int err = ftdi_set_bitmode(ctx_, mask, mode);
+    if (err) return Status::Err("ftdi_set_bitmode() failed: {}", err);
+    return Status::Ok();
+  }
+
+  Status SetBaudrate(int baud) override {
+    int err = ftdi_set_baudrate(ctx_, baud);
+    if (err) return Status::Err("ftdi_set_baudrate() failed: {}", err);
+    return Status::Ok();
+  }
+
+  Status Purge() override {
+    int err = ftdi_tcioflush(ctx_);
+    if (err) return Status::Err("ftdi_tcioflush() failed: {}", err);
+    return Status::Ok();
+  }
+
+  Status ApplyTuning(const FtdiTuning &tuning) override {
+    int err = ftdi_set_latency_timer(ctx_, tuning.latency_ms);
+    if (err) return Status::Err("ftdi_set_latency_timer() failed: {}", err);
+    err = ftdi_read_data_set_chunksize(ctx_, tuning.read_chunk_size);
+    if (err) return Status::Err("ftdi_read_data_set_chunksize() failed: {}", err);
+    err = ftdi_write_data_set_chunksize(ctx_, tuning.write_chunk_size);
+    if (err) return Status::Err("ftdi_write_data_set_chunksize() failed: {}", err);
+    return Status::Ok();
+  }
+
+  uint32_t WriteChunkSize() override {
+    unsigned int chunk = 0;
+    if (ftdi_write_data_get_chunksize(ctx_, &chunk) != 0 || chunk == 0) chunk = 4096;
+    return chunk;
+  }
+
+private:
+  struct ftdi_context *ctx_;
+};
+
+} // namespace
+
 std::unique_ptr<FtdiDevice> FtdiDevice::OpenVendorProduct(uint16_t id_vendor, uint16_t id_product,
-                                                          enum ftdi_interface intf) {
+                                                          enum ftdi_interface intf,
+                                                          std::optional<FtdiTuning> tuning) {
   int err = 0;
   struct ftdi_context *ctx = nullptr;
 
@@ -35,10 +207,11 @@ std::unique_ptr<FtdiDevice> FtdiDevice::OpenVendorProduct(uint16_t id_vendor, ui
     std::fprintf(stderr, "ftdi_usb_open() failed: %d\n", err);
     return nullptr;
   }
-  return std::make_unique<FtdiDevice>(ctx);
+  return WithTuning(std::make_unique<FtdiDevice>(ctx), tuning);
 }
 
-std::unique_ptr<FtdiDevice> FtdiDevice::OpenBusDevice(int bus, int device, enum ftdi_interface intf) {
+std::unique_ptr<FtdiDevice> FtdiDevice::OpenBusDevice(int bus, int device, enum ftdi_interface intf,
+                                                      std::optional<FtdiTuning> tuning) {
   int err = 0;
   struct ftdi_context *ctx = nullptr;
 
@@ -60,7 +233,50 @@ std::unique_ptr<FtdiDevice> FtdiDevice::OpenBusDevice(int bus, int device, enum
     return nullptr;
   }
 
-  return std::make_unique<FtdiDevice>(ctx);
+  return WithTuning(std::make_unique<FtdiDevice>(ctx), tuning);
+}
+
+std::unique_ptr<FtdiDevice> FtdiDevice::OpenTransport(std::unique_ptr<FtdiTransport> transport,
+                                                      std::optional<FtdiTuning> tuning) {
+  return WithTuning(std::make_unique<FtdiDevice>(std::move(transport)), tuning);
+}
+
+std::unique_ptr<FtdiDevice> FtdiDevice::WithTuning(std::unique_ptr<FtdiDevice> dev,
+                                                   const std::optional<FtdiTuning> &tuning) {
+  if (!tuning) return dev;
+  Status st = dev->ApplyTuning(*tuning);
+  if (!st.ok()) {
+    std::fprintf(stderr, "ApplyTuning() failed: %s\n", st.human().c_str());
+    return nullptr;
+  }
+  return dev;
+}
+
+Status FtdiDevice::ApplyTuning(const FtdiTuning &tuning) {
+  if (tuning.latency_ms == 0) return Status::Err("Latency timer must be 1-255 ms");
+  if (tuning.read_chunk_size == 0 || tuning.write_chunk_size == 0) {
+    return Status::Err("Chunk size must be positive");
+  }
+  // Transfers in flight were sized with the old chunk sizes.
+  RETURN_IF_ERR(WaitAll());
+  RETURN_IF_ERR(transport_->ApplyTuning(tuning));
+  tuning_ = tuning;
+  return Status::Ok();
+}
+
+FtdiDevice::FtdiDevice(struct ftdi_context *context) : FtdiDevice(context, &FreeContext) {}
+
+FtdiDevice::FtdiDevice(struct ftdi_context *context, void (*free_context)(struct ftdi_context *))
+    : context_(context, free_context), transport_(std::make_unique<LibftdiTransport>(context)) {}
+
+FtdiDevice::FtdiDevice(std::unique_ptr<FtdiTransport> transport)
+    : context_(nullptr, &FreeContext), transport_(std::move(transport)) {}
+
+FtdiDevice::~FtdiDevice() {
+  Status st = WaitAll();
+  if (!st.ok()) {
+    std::fprintf(stderr, "Pending transfer failed on close: %s\n", st.human().c_str());
+  }
 }
 
 void FtdiDevice::FreeContext(struct ftdi_context *context) {
@@ -70,143 +286,533 @@ void FtdiDevice::FreeContext(struct ftdi_context *context) {
 }
 
 Status FtdiDevice::BufferByte(uint8_t data) {
-  if (buffer_used_ >= kBufferSize) {
-    return Status::Err("Too many data in buffer");
-  }
-  buffer_[buffer_used_++] = data;
+  buffer_.Append(data);
   return Status::Ok();
 }
 
 Status FtdiDevice::BufferBytes(std::span<const uint8_t> data) {
-  if (buffer_used_ + data.size() > kBufferSize) {
-    return Status::Err("Too many bytes to write");
+  buffer_.Append(data);
+  return Status::Ok();
+}
+
+Status FtdiDevice::BufferBytes(std::initializer_list<uint8_t> data) {
+  buffer_.Append(data);
+  return Status::Ok();
+}
+
+Status FtdiDevice::BufferFlush(std::chrono::duration<double> extra_timeout) {
+  if (buffer_.empty()) {
+    return Status::Ok();
   }
-  for (size_t i = 0; i < data.size(); i++) {
-    buffer_[buffer_used_++] = data[i];
+  const auto start = TraceNow();
+  Status st = Submit(buffer_, extra_timeout);
+  if (!st.ok()) {
+    // Part of it may be out already, and the responses point at the callers' storage, which may
+    // be gone by the next flush.
+    buffer_.Clear();
+    return st;
   }
+  flushes_.fetch_add(1, std::memory_order_relaxed);
+  if (!trace_.empty()) {
+    if (trace_opcodes_) TraceCommands(std::span(buffer_.data(), buffer_.size()), start);
+    Trace(FtdiTraceEvent::kFlush, start, buffer_.size());
+  }
+  buffer_.Clear();
   return Status::Ok();
 }
 
-Status FtdiDevice::BufferBytes(std::initializer_list<uint8_t> data) {
-  if (buffer_used_ + data.size() > kBufferSize) {
-    return Status::Err("Too many bytes to write");
+void MpsseCommandStream::Truncate(size_t size) {
+  if (size >= data_->size()) return;
+  data_->resize(size);
+  while (!responses_.empty() && responses_.back().offset > size) {
+    response_len_ -= responses_.back().len;
+    responses_.pop_back();
+  }
+  while (!pin_updates_.empty() && pin_updates_.back().offset >= size) pin_updates_.pop_back();
+}
+
+Status FtdiDevice::BufferStream(const MpsseCommandStream &stream) {
+  const auto responses = stream.responses();
+  const auto pins = stream.pin_updates();
+  size_t copied = 0;
+  auto copy_to = [&](size_t offset) {
+    buffer_.Append(std::span(stream.data() + copied, offset - copied));
+    copied = offset;
+  };
+
+  // Both lists are sorted by offset. A response at the offset of a pin update belongs to the
+  // commands before it.
+  size_t r = 0;
+  for (const auto &pin : pins) {
+    for (; r < responses.size() && responses[r].offset <= pin.offset; r++) {
+      copy_to(responses[r].offset);
+      buffer_.ExpectResponse(responses[r].dest, responses[r].len);
+    }
+    copy_to(pin.offset);
+    if (pin.high) {
+      RETURN_IF_ERR(MpsseUpdateHigherPins(pin.state, pin.dir, pin.mask, /*flush=*/false));
+    } else {
+      RETURN_IF_ERR(MpsseUpdateLowerPins(pin.state, pin.dir, pin.mask, /*flush=*/false));
+    }
+    copied += 3;  // Skip the placeholder.
   }
-  for (uint8_t x : data) {
-    buffer_[buffer_used_++] = x;
+  for (; r < responses.size(); r++) {
+    copy_to(responses[r].offset);
+    buffer_.ExpectResponse(responses[r].dest, responses[r].len);
   }
+  copy_to(stream.size());
   return Status::Ok();
 }
 
-Status FtdiDevice::BufferFlush() {
-  if (buffer_used_ == 0) {
+void FtdiDevice::BufferRecord(MpsseRecording *recording) {
+  MpsseRecording &r = *recording;
+  r.data_.assign(buffer_.data(), buffer_.data() + buffer_.size());
+  r.responses_.clear();
+  r.slots_.clear();
+  r.checks_.clear();
+  r.dests_.clear();
+  uint32_t rx_offset = 0;
+  for (const auto &response : buffer_.responses()) {
+    r.responses_.push_back({response.offset, response.len, rx_offset});
+    r.dests_.push_back(response.dest);
+    rx_offset += response.len;
+  }
+  r.response_len_ = rx_offset;
+  r.low_state_ = low_pin_state_;
+  r.low_dir_ = low_pin_dir_;
+  r.high_state_ = high_pin_state_;
+  r.high_dir_ = high_pin_dir_;
+  buffer_.Clear();
+}
+
+Status FtdiDevice::BufferReplay(const MpsseRecording &recording, void *rx,
+                                std::span<const std::span<const uint8_t>> patches) {
+  const auto slots = recording.slots();
+  if (patches.size() > slots.size()) {
+    return Status::Err("{} patches for {} slots", patches.size(), slots.size());
+  }
+  for (size_t i = 0; i < patches.size(); i++) {
+    if (patches[i].size() != slots[i].len) {
+      return Status::Err("Patch {} is {} bytes, its slot {}", i, patches[i].size(), slots[i].len);
+    }
+  }
+
+  // Copy up to each response, patching the slots in the piece.
+  size_t copied = 0;
+  auto copy_to = [&](size_t offset) {
+    if (offset == copied) return;
+    uint8_t *out = buffer_.Grow(offset - copied);
+    std::memcpy(out, recording.data() + copied, offset - copied);
+    for (size_t i = 0; i < patches.size(); i++) {
+      const size_t begin = std::max(copied, slots[i].offset);
+      const size_t end = std::min(offset, slots[i].offset + slots[i].len);
+      if (begin < end) {
+        std::memcpy(out + (begin - copied), &patches[i][begin - slots[i].offset], end - begin);
+      }
+    }
+    copied = offset;
+  };
+  auto *out = static_cast<uint8_t *>(rx);
+  for (const auto &response : recording.responses()) {
+    copy_to(response.offset);
+    buffer_.ExpectResponse(out ? out + response.rx_offset : nullptr, response.len);
+  }
+  copy_to(recording.size());
+  TrackPins(recording);
+  return Status::Ok();
+}
+
+void FtdiDevice::TrackPins(const MpsseRecording &recording) {
+  low_pin_state_ = recording.low_state_;
+  low_pin_dir_ = recording.low_dir_;
+  high_pin_state_ = recording.high_state_;
+  high_pin_dir_ = recording.high_dir_;
+}
+
+Status FtdiDevice::Replay(const MpsseRecording &recording, void *rx,
+                          std::span<const std::span<const uint8_t>> patches, int *failed) {
+  if (failed) *failed = -1;
+  if (patches.empty() && recording.responses().empty()) {
+    RETURN_IF_ERR(Write(recording.data(), recording.size()));
+    TrackPins(recording);
     return Status::Ok();
   }
-  int ret = ftdi_write_data(context_.get(), buffer_, buffer_used_);
-  if (ret < 0 || static_cast<uint32_t>(ret) != buffer_used_) {
-    return Status::Err(std::format("ftdi_write_data() failed: expected {} got {}", buffer_used_, ret));
+
+  if (rx == nullptr && !recording.checks().empty()) {
+    replay_rx_.resize(recording.response_len());
+    rx = replay_rx_.data();
+  }
+  Status st = BufferReplay(recording, rx, patches);
+  if (st.ok()) st = BufferFlush();
+  if (!st.ok()) {
+    BufferClear();
+    return st;
+  }
+  const auto *in = static_cast<const uint8_t *>(rx);
+  const auto checks = recording.checks();
+  for (size_t i = 0; i < checks.size(); i++) {
+    const uint8_t byte = in[checks[i].rx_offset];
+    if ((byte & checks[i].mask) != checks[i].value) {
+      if (failed) *failed = i;
+      return Status::Err("Replay check #{} failed, read {:#04x}", i, byte);
+    }
+  }
+  return Status::Ok();
+}
+
+int64_t MpsseRecording::RxOffset(const void *dest) const {
+  for (size_t i = 0; i < dests_.size(); i++) {
+    if (dests_[i] == dest) return responses_[i].rx_offset;
+  }
+  return -1;
+}
+
+int MpsseRecording::AddSlot(size_t offset, uint32_t len) {
+  if (len == 0 || offset + len > data_.size()) return -1;
+  slots_.push_back({offset, len});
+  return slots_.size() - 1;
+}
+
+int MpsseRecording::FindSlot(std::span<const uint8_t> placeholder, size_t from) {
+  if (placeholder.empty() || from > data_.size()) return -1;
+  auto it = std::search(data_.begin() + from, data_.end(), placeholder.begin(), placeholder.end());
+  if (it == data_.end()) return -1;
+  return AddSlot(it - data_.begin(), placeholder.size());
+}
+
+namespace {
+
+constexpr char kRecordingMagic[8] = {'M', 'P', 'S', 'S', 'E', 'R', 'E', 'C'};
+constexpr uint32_t kRecordingVersion = 1;
+
+} // namespace
+
+Status MpsseRecording::Save(const char *path) const {
+  FILE *f = std::fopen(path, "wb");
+  if (f == nullptr) return Status::Errno(errno, "Cannot open the recording");
+  auto put = [f](const void *p, size_t n) { return std::fwrite(p, 1, n, f) == n; };
+  const uint64_t counts[] = {data_.size(), responses_.size(), slots_.size(), checks_.size()};
+  const uint8_t pins[] = {low_state_, low_dir_, high_state_, high_dir_};
+  bool ok = put(kRecordingMagic, sizeof(kRecordingMagic)) && put(&kRecordingVersion, 4) &&
+            put(counts, sizeof(counts)) && put(&response_len_, 4) && put(pins, sizeof(pins)) &&
+            put(data_.data(), data_.size());
+  for (const Response &r : responses_) {
+    const uint64_t offset = r.offset;
+    ok = ok && put(&offset, 8) && put(&r.len, 4) && put(&r.rx_offset, 4);
+  }
+  for (const Slot &slot : slots_) {
+    const uint64_t offset = slot.offset;
+    ok = ok && put(&offset, 8) && put(&slot.len, 4);
+  }
+  for (const Check &c : checks_) {
+    ok = ok && put(&c.rx_offset, 4) && put(&c.mask, 1) && put(&c.value, 1);
+  }
+  if (std::fclose(f) != 0) return Status::Errno(errno, "Cannot write the recording");
+  if (!ok) return Status::Err("Cannot write the recording");
+  return Status::Ok();
+}
+
+Status MpsseRecording::Load(const char *path) {
+  FILE *f = std::fopen(path, "rb");
+  if (f == nullptr) return Status::Errno(errno, "Cannot open the recording");
+  auto get = [f](void *p, size_t n) { return std::fread(p, 1, n, f) == n; };
+  char magic[sizeof(kRecordingMagic)];
+  uint32_t version = 0;
+  uint64_t counts[4];
+  uint8_t pins[4];
+  MpsseRecording r;
+  bool ok = get(magic, sizeof(magic)) && std::memcmp(magic, kRecordingMagic, sizeof(magic)) == 0 &&
+            get(&version, 4) && version == kRecordingVersion && get(counts, sizeof(counts)) &&
+            get(&r.response_len_, 4) && get(pins, sizeof(pins));
+  // Anything bigger is not a recording this code made.
+  constexpr uint64_t kMaxCount = 1 << 24;
+  for (uint64_t count : counts) ok = ok && count <= kMaxCount;
+  if (ok) {
+    r.data_.resize(counts[0]);
+    ok = get(r.data_.data(), r.data_.size());
+  }
+  for (uint64_t i = 0; ok && i < counts[1]; i++) {
+    uint64_t offset;
+    Response response;
+    // In stream order, BufferReplay() copies the data from one response to the next.
+    const uint64_t previous = r.responses_.empty() ? 0 : r.responses_.back().offset;
+    ok = get(&offset, 8) && get(&response.len, 4) && get(&response.rx_offset, 4) &&
+         offset >= previous && offset <= r.data_.size() &&
+         response.rx_offset + uint64_t{response.len} <= r.response_len_;
+    response.offset = offset;
+    r.responses_.push_back(response);
+  }
+  for (uint64_t i = 0; ok && i < counts[2]; i++) {
+    uint64_t offset;
+    uint32_t len;
+    ok = get(&offset, 8) && get(&len, 4) && offset <= r.data_.size() &&
+         len <= r.data_.size() - offset;
+    r.slots_.push_back({offset, len});
+  }
+  for (uint64_t i = 0; ok && i < counts[3]; i++) {
+    Check c;
+    ok = get(&c.rx_offset, 4) && get(&c.mask, 1) && get(&c.value, 1) &&
+         c.rx_offset < r.response_len_;
+    r.checks_.push_back(c);
+  }
+  std::fclose(f);
+  if (!ok) return Status::Err("Not a valid recording");
+  r.low_state_ = pins[0];
+  r.low_dir_ = pins[1];
+  r.high_state_ = pins[2];
+  r.high_dir_ = pins[3];
+  *this = std::move(r);
+  return Status::Ok();
+}
+
+Status FtdiDevice::Submit(const MpsseCommandStream &stream, std::chrono::duration<double> extra_timeout) {
+  const auto responses = stream.responses();
+  const size_t n = responses.size();
+  size_t written = 0;
+  size_t next = 0; // First response not read yet.
+
+  while (written < stream.size()) {
+    // Take as many responses as the RX buffer can hold. The one that overflows it can still be
+    // taken if the commands from there to the end of this piece fit in the TX buffer: the MPSSE
+    // stalls on it, but the piece can be fully written, then we start reading to unblock it.
+    size_t last = next;
+    uint64_t piece_rx = 0;
+    while (last < n) {
+      const uint32_t len = responses[last].len;
+      if (piece_rx + len > kChipBufferSize) {
+        size_t cmd_begin = (last == next) ? written : responses[last - 1].offset;
+        size_t cmd_end = (last + 1 < n) ? responses[last].offset : stream.size();
+        if (last == next || cmd_end - cmd_begin <= kChipBufferSize) {
+          piece_rx += len;
+          last++;
+        }
+        break;
+      }
+      piece_rx += len;
+      last++;
+    }
+    const size_t end = (last < n) ? responses[last - 1].offset : stream.size();
+
+    RETURN_IF_ERR(WriteRaw(stream.data() + written, end - written));
+    if (piece_rx == 0) {
+      written = end;
+      continue;
+    }
+    if (last < n) {
+      const uint8_t send_immediate = SEND_IMMEDIATE;
+      RETURN_IF_ERR(WriteRaw(&send_immediate, 1));
+    }
+
+    // Read back this piece.
+    auto timeout = std::chrono::milliseconds(10) + extra_timeout +
+                   2 * MpsseClockTime(8 * (end - written + piece_rx));
+    if (last - next == 1 && responses[next].dest) {
+      RETURN_IF_ERR(Read(responses[next].dest, responses[next].len, timeout));
+    } else {
+      rx_staging_.resize(piece_rx);
+      RETURN_IF_ERR(Read(rx_staging_.data(), piece_rx, timeout));
+      const uint8_t *ptr = rx_staging_.data();
+      for (size_t i = next; i < last; i++) {
+        if (responses[i].dest) std::memcpy(responses[i].dest, ptr, responses[i].len);
+        ptr += responses[i].len;
+      }
+    }
+    written = end;
+    next = last;
   }
-  buffer_used_ = 0;
   return Status::Ok();
 }
 
 Status FtdiDevice::Write(const void *buf, int32_t len) {
   if (len < 0) return Status::Err("Invalid length");
-  if (buffer_used_ > 0) return Status::Err("Attempt to write but buffer is not empty.");
+  RETURN_IF_ERR(BufferFlush());
+  return WriteRaw(static_cast<const uint8_t *>(buf), len);
+}
 
-  int ret = ftdi_write_data(context_.get(), static_cast<const uint8_t *>(buf), len);
-  if (ret != len) {
-    return Status::Err(std::format("ftdi_write_data() failed: expected {} got {}", len, ret));
-  }
+Status FtdiDevice::WriteRaw(const uint8_t *buf, size_t len) {
+  if (len == 0) return Status::Ok();
+  const auto start = TraceNow();
+  usb_writes_.fetch_add(1, std::memory_order_relaxed);
+  RETURN_IF_ERR(transport_->Write(buf, len));
+  tx_bytes_.fetch_add(len, std::memory_order_relaxed);
+  Trace(FtdiTraceEvent::kWrite, start, len);
   return Status::Ok();
 }
 
 Status FtdiDevice::Read(void *buf, int32_t len, std::chrono::duration<double> timeout) {
-  auto begin = std::chrono::high_resolution_clock::now();
-  auto deadline = begin + timeout;
-  auto *ptr = static_cast<unsigned char *>(buf);
-  do {
-    int read = ftdi_read_data(context_.get(), static_cast<unsigned char *>(ptr), len);
-    if (read == 0) continue;
-    if (read < 0) {
-      return Status::Err(std::format("ftdi_read_bytes() failed: {}", read));
-    }
-    len -= read;
-    if (read < 0) {
-      return Status::Err(std::format("ftdi_read_bytes() got too many bytes: {}", len));
-    }
-    if (len == 0) {
-      return Status::Ok();
-    }
-    ptr += read;
-  } while (std::chrono::high_resolution_clock::now() < deadline);
-  return Status::Err("ftdi_read_bytes() timed out");
+  RETURN_IF_ERR(Wait(last_read_ticket_));
+  if (len == 0) return Status::Ok();
+  const auto start = std::chrono::steady_clock::now();
+  usb_reads_.fetch_add(1, std::memory_order_relaxed);
+  Status st = transport_->Read(static_cast<uint8_t *>(buf), len, timeout);
+  read_blocked_ns_.fetch_add(Nanoseconds(std::chrono::steady_clock::now() - start),
+                             std::memory_order_relaxed);
+  if (st.err() == ETIMEDOUT) {
+    timeouts_.fetch_add(1, std::memory_order_relaxed);
+    Trace(FtdiTraceEvent::kReadTimeout, start, len);
+  }
+  RETURN_IF_ERR(st);
+  rx_bytes_.fetch_add(len, std::memory_order_relaxed);
+  Trace(FtdiTraceEvent::kRead, start, len);
+  return Status::Ok();
+}
+
+Status FtdiDevice::BufferFlushAsync(Ticket *ticket) {
+  if (!buffer_.responses().empty()) return Status::Err("BufferFlushAsync() doesn't read responses");
+  if (buffer_.empty()) {
+    if (ticket) *ticket = LastTicket();
+    return Status::Ok();
+  }
+  std::vector<uint8_t> storage;
+  if (!spare_storage_.empty()) {
+    storage = std::move(spare_storage_.back());
+    spare_storage_.pop_back();
+  }
+  buffer_.SwapStorage(&storage);
+  const uint8_t *data = storage.data();
+  const size_t len = storage.size();
+  return SubmitWrite(data, len, std::move(storage), ticket);
+}
+
+Status FtdiDevice::WriteAsync(const void *buf, int32_t len, Ticket *ticket) {
+  if (len < 0) return Status::Err("Invalid length");
+  // Keep the order with what's buffered.
+  RETURN_IF_ERR(BufferFlushAsync());
+  return SubmitWrite(static_cast<const uint8_t *>(buf), len, {}, ticket);
+}
+
+Status FtdiDevice::SubmitWrite(const uint8_t *buf, size_t len, std::vector<uint8_t> storage,
+                               Ticket *ticket) {
+  // libftdi submits the next chunk of a transfer from its callback. If a transfer had several
+  // chunks, the ones submitted after it could cut in. So every chunk is its own transfer.
+  const uint32_t chunk = transport_->WriteChunkSize();
+
+  size_t offset = 0;
+  while (offset < len) {
+    if (pending_.size() >= kMaxPendingTransfers) RETURN_IF_ERR(WaitOldest());
+    int32_t size = std::min<size_t>(chunk, len - offset);
+    FtdiTransfer *handle = transport_->SubmitWrite(buf + offset, size);
+    if (handle == nullptr) break;
+    offset += size;
+    pending_.push_back({next_ticket_++, handle, size, /*read=*/false, TraceNow(), {}});
+  }
+  // Chunks already submitted may still use the storage.
+  if (offset > 0 && !storage.empty()) {
+    pending_.back().storage = std::move(storage);
+  }
+  if (offset < len) return Status::Err("SubmitWrite() failed");
+  if (ticket) *ticket = LastTicket();
+  return Status::Ok();
+}
+
+Status FtdiDevice::ReadAsync(void *buf, int32_t len, Ticket *ticket) {
+  if (len < 0) return Status::Err("Invalid length");
+  // The data is shuffled through libftdi's read buffer, which can't serve two reads at once.
+  RETURN_IF_ERR(Wait(last_read_ticket_));
+  if (pending_.size() >= kMaxPendingTransfers) RETURN_IF_ERR(WaitOldest());
+  FtdiTransfer *handle = transport_->SubmitRead(static_cast<uint8_t *>(buf), len);
+  if (handle == nullptr) return Status::Err("SubmitRead() failed");
+  last_read_ticket_ = next_ticket_++;
+  pending_.push_back({last_read_ticket_, handle, len, /*read=*/true, TraceNow(), {}});
+  if (ticket) *ticket = last_read_ticket_;
+  return Status::Ok();
+}
+
+Status FtdiDevice::Wait(Ticket ticket) {
+  Status ret = Status::Ok();
+  while (!pending_.empty() && pending_.front().ticket <= ticket) {
+    ret |= WaitOldest();
+  }
+  return ret;
+}
+
+Status FtdiDevice::WaitOldest() {
+  PendingTransfer transfer = std::move(pending_.front());
+  pending_.pop_front();
+  int ret = transport_->Finish(transfer.handle);
+  if (!transfer.storage.empty()) {
+    transfer.storage.clear();
+    spare_storage_.push_back(std::move(transfer.storage));
+  }
+  if (ret != transfer.len) {
+    return Status::Err("Transfer #{} failed: expected {} got {}", transfer.ticket, transfer.len, ret);
+  }
+  (transfer.read ? rx_bytes_ : tx_bytes_).fetch_add(ret, std::memory_order_relaxed);
+  (transfer.read ? usb_reads_ : usb_writes_).fetch_add(1, std::memory_order_relaxed);
+  Trace(transfer.read ? FtdiTraceEvent::kAsyncRead : FtdiTraceEvent::kAsyncWrite, transfer.submitted,
+        ret);
+  return Status::Ok();
 }
 
 Status FtdiDevice::WaitTransmitterEmpty(uint32_t timeout_ms) {
   // Transmitter empty is bit 6 of the higher byte.
   constexpr uint16_t TEMT_MASK = 0x4000;
-  int err;
   uint16_t status;
+  const auto start = std::chrono::steady_clock::now();
 
-  if (timeout_ms == 0) {
-    err = ftdi_poll_modem_status(context_.get(), &status);
-    if (err) return Status::Err(std::format("ftdi_pool_modem_status() failed: {}", err));
-    if (status & TEMT_MASK) {
-      return Status::Ok();
+  // Poll once right away, then every millisecond.
+  Status st = Status::Err("Transmission didn't finish in time.");
+  bool timed_out = true;
+  for (uint32_t i = 0; i <= timeout_ms; i++) {
+    if (i > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    Status polled = transport_->PollModemStatus(&status);
+    if (!polled.ok()) {
+      st = polled;
+      timed_out = false;
+      break;
     }
-  }
-
-  for (uint32_t i = 0; i < timeout_ms; i++) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    err = ftdi_poll_modem_status(context_.get(), &status);
-    if (err) return Status::Err(std::format("ftdi_pool_modem_status() failed: {}", err));
     if (status & TEMT_MASK) {
-      return Status::Ok();
+      st = Status::Ok();
+      timed_out = false;
+      break;
     }
   }
 
-  return Status::Err("Transmission didn't finish in time.");
+  tx_empty_blocked_ns_.fetch_add(Nanoseconds(std::chrono::steady_clock::now() - start),
+                                 std::memory_order_relaxed);
+  if (timed_out) timeouts_.fetch_add(1, std::memory_order_relaxed);
+  Trace(FtdiTraceEvent::kTxEmptyWait, start, 0);
+  return st;
 }
 
 Status FtdiDevice::MpsseSync() {
-  constexpr int kBufSize = 256;
   uint8_t out_data[] = {0xab, 0xaa}; // two bad commands
-  uint8_t buf[kBufSize];
+  uint8_t buf[4];
   uint32_t in_data = 0;
-  int ret;
+  const auto start = TraceNow();
 
   // Write two commands, expect echo back.
-  ret = ftdi_write_data(context_.get(), out_data, 2);
-  if (ret != 2) return Status::Err(std::format("ftdi_write_data() failed: {}", ret));
-
-  // Spin for at least 100us, if data not ready, spin up to 10ms.
-  auto begin = std::chrono::high_resolution_clock::now();
-  auto GetElapsedUs = [&begin]() -> uint64_t {
-    return std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - begin)
-        .count();
-  };
+  RETURN_IF_ERR(Write(out_data, 2));
+
+  // Anything left over in the read queue comes first, so slide a window over the bytes until the
+  // echo shows up. Each Read() sleeps until its bytes arrive.
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(10);
+  int want = 4;
   while (true) {
-    uint64_t elapsed = GetElapsedUs();
-    if (elapsed > 10'000) break;
-    if (elapsed > 100 && in_data == 0xfaabfaaa) break;
-
-    ret = ftdi_read_data(context_.get(), buf, kBufSize);
-    if (ret < 0) return Status::Err(std::format("ftdi_read_data() failed: {}", ret));
-    if (ret > 0) {
-      // Technically we don't need to shift all bytes and only needs buf[ret-4:].
-      for (int i = 0; i < ret; i++) {
-        // Sliding window looking for the last 4 bytes returned.
-        in_data = (in_data << 8) | buf[i];
-      }
+    auto remaining = deadline - std::chrono::steady_clock::now();
+    if (remaining <= std::chrono::steady_clock::duration::zero()) break;
+    if (want == 1) sync_retries_.fetch_add(1, std::memory_order_relaxed);
+    if (!Read(buf, want, remaining).ok()) break;
+    for (int i = 0; i < want; i++) {
+      in_data = (in_data << 8) | buf[i];
     }
+    if (in_data == 0xfaabfaaa) {
+      Trace(FtdiTraceEvent::kSync, start, 0);
+      return Status::Ok();
+    }
+    want = 1;
   }
-  if (in_data != 0xfaabfaaa) {
-    return Status::Err("MPSSE synchronization failed");
-  }
-  return Status::Ok();
+  return Status::Err("MPSSE synchronization failed");
 }
 
 Status FtdiDevice::MpsseSetClockFreq(float khz, bool three_phase, bool adaptive) {
+  BufferClear();
+  Status ret = MpsseBufferClockFreq(khz, three_phase, adaptive, /*verbose=*/true);
+  ret |= BufferFlush();
+  return ret;
+}
+
+Status FtdiDevice::MpsseBufferClockFreq(float khz, bool three_phase, bool adaptive, bool verbose) {
   if (khz <= 0) return Status::Err("Invalid khz input");
 
   float divisor = 60000.0 / (three_phase ? khz * 1.5 : khz) / 2 - 1;
@@ -216,11 +822,16 @@ Status FtdiDevice::MpsseSetClockFreq(float khz, bool three_phase, bool adaptive)
   float actual_khz = 60000.0 / ((div + 1) * 2);
   if (three_phase) actual_khz = actual_khz / 3 * 2;
   float error = std::fabs(actual_khz - khz) / khz;
-  std::printf("MPSSE requested %.02fkHz, div %d, actual %.02fkHz, error %.02f%%\n", khz, div, actual_khz,
-              error * 100);
+  mpsse_khz_ = actual_khz;
+  clock_khz_ = khz;
+  clock_three_phase_ = three_phase;
+  clock_adaptive_ = adaptive;
+  if (verbose) {
+    std::printf("MPSSE requested %.02fkHz, div %d, actual %.02fkHz, error %.02f%%\n", khz, div,
+                actual_khz, error * 100);
+  }
 
   Status ret = Status::Ok();
-  BufferClear();
   ret |= BufferByte(three_phase ? EN_3_PHASE : DIS_3_PHASE);
   ret |= BufferByte(adaptive ? EN_ADAPTIVE : DIS_ADAPTIVE);
   ret |= BufferByte(DIS_DIV_5); // disable div by 5 (60MHz)
@@ -229,7 +840,6 @@ Status FtdiDevice::MpsseSetClockFreq(float khz, bool three_phase, bool adaptive)
                                static_cast<uint8_t>(div & 0xff),         // div low
                                static_cast<uint8_t>((div >> 8) & 0xff)}; // div high
   ret |= BufferBytes(cmd_tck_divisor);
-  ret |= BufferFlush();
   return ret;
 }
 
@@ -243,4 +853,158 @@ Status FtdiDevice::MpsseUpdateLowerPins(uint8_t state, uint8_t dir, uint8_t mask
   return Status::Ok();
 }
 
+Status FtdiDevice::MpsseUpdateHigherPins(uint8_t state, uint8_t dir, uint8_t mask, bool flush) {
+  const uint8_t inv_mask = ~mask;
+  high_pin_state_ = (high_pin_state_ & inv_mask) | (state & mask);
+  high_pin_dir_   = (high_pin_dir_   & inv_mask) | (dir   & mask);
+  auto st = BufferBytes({SET_BITS_HIGH, high_pin_state_, high_pin_dir_});
+  if (!st.ok()) return st;
+  if (flush) return BufferFlush();
+  return Status::Ok();
+}
+
+Status FtdiDevice::MpsseWaitOnGpiol1(bool high, std::chrono::duration<double> timeout) {
+  RETURN_IF_ERR(BufferBytes({
+    static_cast<uint8_t>(high ? WAIT_ON_HIGH : WAIT_ON_LOW),
+    GET_BITS_LOW,  // Only answered once the wait is over.
+    SEND_IMMEDIATE,
+  }));
+  BufferExpect(nullptr, 1);
+  Status st = BufferFlush(timeout);
+  if (st.ok()) return st;
+  BufferClear();
+  Status recovered = MpsseRecover();
+  if (!recovered.ok()) st |= recovered;
+  return st;
+}
+
+Status FtdiDevice::MpsseRecover() {
+  RETURN_IF_ERR(transport_->SetBitmode(0xff, BITMODE_RESET));
+  RETURN_IF_ERR(transport_->Purge());
+  RETURN_IF_ERR(transport_->SetBitmode(0xff, BITMODE_MPSSE));
+  RETURN_IF_ERR(MpsseSync());
+
+  BufferClear();
+  if (clock_khz_ > 0) {
+    RETURN_IF_ERR(MpsseBufferClockFreq(clock_khz_, clock_three_phase_, clock_adaptive_));
+  }
+  RETURN_IF_ERR(BufferBytes({SET_BITS_LOW, low_pin_state_, low_pin_dir_}));
+  RETURN_IF_ERR(BufferBytes({SET_BITS_HIGH, high_pin_state_, high_pin_dir_}));
+  return BufferFlush();
+}
+
+FtdiCounters FtdiDevice::Counters() const {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  FtdiCounters c;
+  c.usb_writes = usb_writes_.load(relaxed);
+  c.usb_reads = usb_reads_.load(relaxed);
+  c.tx_bytes = tx_bytes_.load(relaxed) - tx_bytes_base_.load(relaxed);
+  c.rx_bytes = rx_bytes_.load(relaxed) - rx_bytes_base_.load(relaxed);
+  c.flushes = flushes_.load(relaxed);
+  c.transactions = transactions_.load(relaxed);
+  c.timeouts = timeouts_.load(relaxed);
+  c.sync_retries = sync_retries_.load(relaxed);
+  c.read_blocked = std::chrono::nanoseconds(read_blocked_ns_.load(relaxed));
+  c.tx_empty_blocked = std::chrono::nanoseconds(tx_empty_blocked_ns_.load(relaxed));
+  return c;
+}
+
+void FtdiDevice::ResetCounters() {
+  constexpr auto relaxed = std::memory_order_relaxed;
+  tx_bytes_base_.store(tx_bytes_.load(relaxed), relaxed);
+  rx_bytes_base_.store(rx_bytes_.load(relaxed), relaxed);
+  for (auto *counter : {&usb_writes_, &usb_reads_, &flushes_, &transactions_, &timeouts_,
+                        &sync_retries_}) {
+    counter->store(0, relaxed);
+  }
+  read_blocked_ns_.store(0, relaxed);
+  tx_empty_blocked_ns_.store(0, relaxed);
+}
+
+void FtdiDevice::EnableTrace(size_t max_events, bool opcodes) {
+  trace_.assign(max_events, {});
+  trace_.shrink_to_fit();
+  trace_next_ = 0;
+  trace_wrapped_ = false;
+  trace_opcodes_ = opcodes;
+  trace_epoch_ = std::chrono::steady_clock::now();
+}
+
+FtdiTraceEvent *FtdiDevice::TraceSlot() {
+  FtdiTraceEvent *ev = &trace_[trace_next_];
+  if (++trace_next_ == trace_.size()) {
+    trace_next_ = 0;
+    trace_wrapped_ = true;
+  }
+  return ev;
+}
+
+void FtdiDevice::Trace(FtdiTraceEvent::Kind kind, std::chrono::steady_clock::time_point start,
+                       uint32_t len) {
+  if (trace_.empty() || start < trace_epoch_) return;
+  const int64_t dur = Nanoseconds(std::chrono::steady_clock::now() - start);
+  FtdiTraceEvent *ev = TraceSlot();
+  ev->start_ns = Nanoseconds(start - trace_epoch_);
+  ev->dur_ns = std::min<int64_t>(dur, UINT32_MAX);
+  ev->len = len;
+  ev->kind = kind;
+  ev->opcode = 0;
+}
+
+void FtdiDevice::TraceCommands(std::span<const uint8_t> data,
+                               std::chrono::steady_clock::time_point start) {
+  if (trace_.empty() || start < trace_epoch_ || data.empty()) return;
+  // The chip doesn't say when it ran each command, assume it went at a steady byte rate.
+  const int64_t begin_ns = Nanoseconds(start - trace_epoch_);
+  const double ns_per_byte =
+      static_cast<double>(Nanoseconds(std::chrono::steady_clock::now() - start)) / data.size();
+  size_t offset = 0;
+  while (offset < data.size()) {
+    const size_t len = std::min(mpsse_cmd::CommandLength(data.subspan(offset)), data.size() - offset);
+    FtdiTraceEvent *ev = TraceSlot();
+    ev->start_ns = begin_ns + static_cast<int64_t>(offset * ns_per_byte);
+    ev->dur_ns = std::min<double>(len * ns_per_byte, UINT32_MAX);
+    ev->len = len;
+    ev->kind = FtdiTraceEvent::kCommand;
+    ev->opcode = data[offset];
+    offset += len;
+  }
+}
+
+std::vector<FtdiTraceEvent> FtdiDevice::TraceEvents() const {
+  std::vector<FtdiTraceEvent> ret;
+  if (trace_wrapped_) ret.assign(trace_.begin() + trace_next_, trace_.end());
+  ret.insert(ret.end(), trace_.begin(), trace_.begin() + trace_next_);
+  return ret;
+}
+
+Status FtdiDevice::ExportChromeTrace(const char *path) const {
+  FILE *f = std::fopen(path, "w");
+  if (f == nullptr) return Status::Errno(errno, "Cannot open the trace file");
+  std::fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  std::fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, "
+                  "\"args\": {\"name\": \"USB\"}},\n");
+  std::fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, "
+                  "\"args\": {\"name\": \"MPSSE commands\"}}");
+  for (const FtdiTraceEvent &ev : TraceEvents()) {
+    const bool command = ev.kind == FtdiTraceEvent::kCommand;
+    const char *name = command ? OpcodeName(ev.opcode) : KindName(ev.kind);
+    char unknown[8];
+    if (name == nullptr) {
+      std::snprintf(unknown, sizeof(unknown), "0x%02x", ev.opcode);
+      name = unknown;
+    }
+    // Chrome trace timestamps are in microseconds.
+    std::fprintf(f,
+                 ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                 "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"len\": %u",
+                 name, command ? 2 : 1, ev.start_ns / 1000.0, ev.dur_ns / 1000.0, ev.len);
+    if (command) std::fprintf(f, ", \"opcode\": \"0x%02x\"", ev.opcode);
+    std::fprintf(f, "}}");
+  }
+  std::fprintf(f, "\n]}\n");
+  if (std::fclose(f) != 0) return Status::Errno(errno, "Cannot write the trace file");
+  return Status::Ok();
+}
+
 } // namespace mpsse_protocol
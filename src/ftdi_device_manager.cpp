@@ -0,0 +1,275 @@
+#include "mpsse_protocol.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ftdi.h>
+#include <libusb.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mpsse_protocol {
+
+std::unique_ptr<FtdiDeviceManager> FtdiDeviceManager::Create() {
+  libusb_context *ctx = nullptr;
+  int err = libusb_init(&ctx);
+  if (err) {
+    std::fprintf(stderr, "libusb_init() failed: %d\n", err);
+    return nullptr;
+  }
+  return std::unique_ptr<FtdiDeviceManager>(new FtdiDeviceManager(ctx));
+}
+
+FtdiDeviceManager::~FtdiDeviceManager() {
+  if (watching_) {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+    events_cv_.notify_all();
+    // Also wakes up the event thread.
+    libusb_hotplug_deregister_callback(ctx_, hotplug_);
+    event_thread_.join();
+    dispatch_thread_.join();
+  }
+  released_.clear();
+  for (auto &[path, known] : devices_) libusb_unref_device(known.usb);
+  libusb_exit(ctx_);
+}
+
+void FtdiDeviceManager::FreeSharedContext(struct ftdi_context *context) {
+  if (context == nullptr) return;
+  // ftdi_free() closes the device, then exits the libusb context unless it's unset.
+  context->usb_ctx = nullptr;
+  ftdi_free(context);
+}
+
+bool FtdiDeviceManager::Describe(libusb_device *usb, FtdiDeviceInfo *info) {
+  // Cached by libusb, no I/O.
+  struct libusb_device_descriptor desc;
+  if (libusb_get_device_descriptor(usb, &desc) != LIBUSB_SUCCESS) return false;
+  uint8_t ports[7];
+  const int depth = libusb_get_port_numbers(usb, ports, sizeof(ports));
+  if (depth < 0) return false;
+
+  info->id_vendor = desc.idVendor;
+  info->id_product = desc.idProduct;
+  info->bus = libusb_get_bus_number(usb);
+  info->address = libusb_get_device_address(usb);
+  info->port_path = std::to_string(info->bus) + "-";
+  for (int i = 0; i < depth; i++) {
+    if (i > 0) info->port_path += '.';
+    info->port_path += std::to_string(ports[i]);
+  }
+  return true;
+}
+
+bool FtdiDeviceManager::Remember(libusb_device *usb, const FtdiDeviceInfo &info) {
+  auto [it, inserted] = devices_.try_emplace(info.port_path, Known{usb, info});
+  if (!inserted) {
+    if (it->second.usb == usb) return false;
+    // Replugged, the old one is gone.
+    libusb_unref_device(it->second.usb);
+    it->second = {usb, info};
+  }
+  libusb_ref_device(usb);
+  return true;
+}
+
+Status FtdiDeviceManager::Enumerate(uint16_t id_vendor, uint16_t id_product,
+                                    std::vector<FtdiDeviceInfo> *found) {
+  found->clear();
+  libusb_device **list = nullptr;
+  const ssize_t n = libusb_get_device_list(ctx_, &list);
+  if (n < 0) return Status::Err("libusb_get_device_list() failed: {}", n);
+
+  {
+    std::lock_guard lock(mutex_);
+    for (ssize_t i = 0; i < n; i++) {
+      FtdiDeviceInfo info;
+      if (!Describe(list[i], &info)) continue;
+      if (info.id_vendor != id_vendor || info.id_product != id_product) continue;
+      Remember(list[i], info);
+      found->push_back(std::move(info));
+    }
+  }
+  libusb_free_device_list(list, /*unref_devices=*/1);
+  return Status::Ok();
+}
+
+std::unique_ptr<FtdiDevice> FtdiDeviceManager::Open(const FtdiDeviceInfo &info,
+                                                    enum ftdi_interface intf,
+                                                    std::optional<FtdiTuning> tuning) {
+  const Key key(info.port_path, intf);
+  std::unique_ptr<FtdiDevice> dev;
+  libusb_device *usb = nullptr;
+  {
+    std::lock_guard lock(mutex_);
+    if (auto it = released_.find(key); it != released_.end()) {
+      dev = std::move(it->second);
+      released_.erase(it);
+    } else if (auto it = devices_.find(info.port_path); it != devices_.end()) {
+      usb = libusb_ref_device(it->second.usb);
+    } else {
+      std::fprintf(stderr, "%s is not enumerated\n", info.port_path.c_str());
+      return nullptr;
+    }
+    if (tuning) {
+      tunings_[key] = *tuning;
+    } else if (auto it = tunings_.find(key); it != tunings_.end()) {
+      tuning = it->second;
+    }
+  }
+
+  if (dev == nullptr) {
+    struct ftdi_context *ctx = ftdi_new();
+    if (ctx == nullptr) {
+      libusb_unref_device(usb);
+      std::fprintf(stderr, "ftdi_new() failed\n");
+      return nullptr;
+    }
+    // ftdi_new() made a libusb context of its own, the device lives on the shared one.
+    libusb_exit(ctx->usb_ctx);
+    ctx->usb_ctx = ctx_;
+    int err = ftdi_set_interface(ctx, intf);
+    // Opens the device found by the scan, where ftdi_usb_open() would scan the bus again.
+    if (err == 0) err = ftdi_usb_open_dev(ctx, usb);
+    libusb_unref_device(usb);
+    if (err) {
+      FreeSharedContext(ctx);
+      std::fprintf(stderr, "Cannot open %s: %d\n", info.port_path.c_str(), err);
+      return nullptr;
+    }
+    dev = std::make_unique<FtdiDevice>(ctx, &FreeSharedContext);
+  }
+
+  if (tuning && dev->tuning() != tuning) {
+    Status st = dev->ApplyTuning(*tuning);
+    if (!st.ok()) {
+      std::fprintf(stderr, "ApplyTuning() failed: %s\n", st.human().c_str());
+      return nullptr;
+    }
+  }
+  return dev;
+}
+
+std::vector<std::unique_ptr<FtdiDevice>> FtdiDeviceManager::OpenAll(
+    std::span<const FtdiDeviceInfo> infos, enum ftdi_interface intf,
+    std::optional<FtdiTuning> tuning) {
+  // Most of an open is control transfers waiting on the device, so the opens overlap well.
+  std::vector<std::unique_ptr<FtdiDevice>> devs(infos.size());
+  std::vector<std::thread> threads;
+  threads.reserve(infos.size());
+  for (size_t i = 0; i < infos.size(); i++) {
+    threads.emplace_back([&, i]() { devs[i] = Open(infos[i], intf, tuning); });
+  }
+  for (std::thread &thread : threads) thread.join();
+  return devs;
+}
+
+void FtdiDeviceManager::Release(const FtdiDeviceInfo &info, enum ftdi_interface intf,
+                                std::unique_ptr<FtdiDevice> dev) {
+  if (dev == nullptr) return;
+  // Not worth keeping if its last transfers failed.
+  if (!dev->WaitAll().ok()) return;
+  dev->BufferClear();
+  // Closed outside the lock.
+  std::unique_ptr<FtdiDevice> replaced;
+  std::lock_guard lock(mutex_);
+  // It left already.
+  if (!devices_.contains(info.port_path)) {
+    replaced = std::move(dev);
+    return;
+  }
+  const Key key(info.port_path, intf);
+  if (dev->tuning()) tunings_[key] = *dev->tuning();
+  replaced = std::exchange(released_[key], std::move(dev));
+}
+
+Status FtdiDeviceManager::Watch(uint16_t id_vendor, uint16_t id_product, HotplugFn on_arrived,
+                                HotplugFn on_left) {
+  if (watching_) return Status::Err("Already watching");
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) return Status::Err("No hotplug support");
+
+  on_arrived_ = std::move(on_arrived);
+  on_left_ = std::move(on_left);
+  // The devices already there are reported from in here, before it returns.
+  int err = libusb_hotplug_register_callback(
+      ctx_, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_ENUMERATE, id_vendor, id_product, LIBUSB_HOTPLUG_MATCH_ANY, &HotplugCallback,
+      this, &hotplug_);
+  if (err != LIBUSB_SUCCESS) {
+    return Status::Err("libusb_hotplug_register_callback() failed: {}", err);
+  }
+
+  watching_ = true;
+  event_thread_ = std::thread([this]() { EventLoop(); });
+  dispatch_thread_ = std::thread([this]() { DispatchLoop(); });
+  return Status::Ok();
+}
+
+int LIBUSB_CALL FtdiDeviceManager::HotplugCallback(libusb_context *ctx, libusb_device *usb,
+                                                   libusb_hotplug_event event, void *user_data) {
+  // Inside libusb's event handling: only bookkeeping, the opens and closes are left to the
+  // dispatch thread.
+  auto *self = static_cast<FtdiDeviceManager *>(user_data);
+  Event ev{event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, {}};
+  std::lock_guard lock(self->mutex_);
+  if (ev.arrived) {
+    if (!Describe(usb, &ev.info) || !self->Remember(usb, ev.info)) return 0;
+  } else {
+    auto it = std::find_if(self->devices_.begin(), self->devices_.end(),
+                           [usb](const auto &entry) { return entry.second.usb == usb; });
+    if (it == self->devices_.end()) return 0;
+    ev.info = it->second.info;
+    libusb_unref_device(usb);
+    self->devices_.erase(it);
+  }
+  self->events_.push_back(std::move(ev));
+  self->events_cv_.notify_one();
+  return 0;
+}
+
+void FtdiDeviceManager::EventLoop() {
+  // Runs the hotplug callbacks. Transfers of the devices may complete in here too, libusb hands
+  // them to the thread waiting on them.
+  while (!stopping_.load(std::memory_order_acquire)) {
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 100'000};
+    int err = libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+    if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+      std::fprintf(stderr, "libusb_handle_events_timeout_completed() failed: %d\n", err);
+      return;
+    }
+  }
+}
+
+void FtdiDeviceManager::DispatchLoop() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    events_cv_.wait(lock, [this]() { return stopping_ || !events_.empty(); });
+    if (stopping_) return;
+    Event ev = std::move(events_.front());
+    events_.pop_front();
+    std::vector<std::unique_ptr<FtdiDevice>> gone;
+    if (!ev.arrived) {
+      for (auto it = released_.begin(); it != released_.end();) {
+        if (it->first.first != ev.info.port_path) {
+          ++it;
+          continue;
+        }
+        gone.push_back(std::move(it->second));
+        it = released_.erase(it);
+      }
+    }
+    lock.unlock();
+    gone.clear();
+    const HotplugFn &fn = ev.arrived ? on_arrived_ : on_left_;
+    if (fn) fn(ev.info);
+    lock.lock();
+  }
+}
+
+} // namespace mpsse_protocol
@@ -0,0 +1,123 @@
+#include "mpsse_protocol.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace mpsse_protocol {
+
+FtdiDeviceQueue::FtdiDeviceQueue(FtdiDevice *dev) : dev_(dev) {
+  thread_ = std::thread([this]() { Loop(); });
+}
+
+FtdiDeviceQueue::~FtdiDeviceQueue() {
+  stopping_.store(true, std::memory_order_release);
+  submitted_.fetch_add(1, std::memory_order_release);
+  submitted_.notify_one();
+  thread_.join();
+}
+
+Status FtdiDeviceQueue::Run(const BuildFn &build, std::chrono::duration<double> extra_timeout) {
+  Request req;
+  req.build = &build;
+  req.extra_timeout = extra_timeout;
+
+  uint32_t seen = completed_.load(std::memory_order_acquire);
+  Push(&req);
+  submitted_.fetch_add(1, std::memory_order_release);
+  submitted_.notify_one();
+  while (!req.done.load(std::memory_order_acquire)) {
+    completed_.wait(seen, std::memory_order_acquire);
+    seen = completed_.load(std::memory_order_acquire);
+  }
+  return req.result;
+}
+
+void FtdiDeviceQueue::Push(Request *req) {
+  req->next.store(nullptr, std::memory_order_relaxed);
+  Request *prev = head_.exchange(req, std::memory_order_acq_rel);
+  // Between the exchange and this store the queue is cut in two, Pop() reports it as busy.
+  prev->next.store(req, std::memory_order_release);
+}
+
+FtdiDeviceQueue::Request *FtdiDeviceQueue::Pop(bool *busy) {
+  *busy = false;
+  Request *tail = tail_;
+  Request *next = tail->next.load(std::memory_order_acquire);
+  if (tail == &stub_) {
+    if (next == nullptr) {
+      *busy = head_.load(std::memory_order_acquire) != &stub_;
+      return nullptr;
+    }
+    tail_ = next;
+    tail = next;
+    next = next->next.load(std::memory_order_acquire);
+  }
+  if (next != nullptr) {
+    tail_ = next;
+    return tail;
+  }
+  if (tail != head_.load(std::memory_order_acquire)) {
+    *busy = true;
+    return nullptr;
+  }
+  // `tail` is the last request. Put the stub behind it so it can be taken out.
+  Push(&stub_);
+  next = tail->next.load(std::memory_order_acquire);
+  if (next != nullptr) {
+    tail_ = next;
+    return tail;
+  }
+  *busy = true;
+  return nullptr;
+}
+
+void FtdiDeviceQueue::Loop() {
+  std::vector<Request *> batch;
+  while (true) {
+    // Load before looking at the queue, so a push after the look changes it and wakes us up.
+    uint32_t seen = submitted_.load(std::memory_order_acquire);
+    if (RunBatch(&batch) > 0) continue;
+    if (stopping_.load(std::memory_order_acquire)) return;
+    submitted_.wait(seen, std::memory_order_acquire);
+  }
+}
+
+size_t FtdiDeviceQueue::RunBatch(std::vector<Request *> *batch) {
+  batch->clear();
+  std::chrono::duration<double> extra_timeout{};
+  while (dev_->BufferSize() < kMaxBatchBytes) {
+    bool busy = false;
+    Request *req = Pop(&busy);
+    if (req == nullptr) {
+      if (!busy) break;
+      std::this_thread::yield();
+      continue;
+    }
+    const size_t before = dev_->BufferSize();
+    req->result = (*req->build)(dev_);
+    if (req->result.ok()) {
+      extra_timeout += req->extra_timeout;
+    } else {
+      dev_->BufferTruncate(before);
+    }
+    batch->push_back(req);
+  }
+  if (batch->empty()) return 0;
+
+  Status st = dev_->BufferFlush(extra_timeout);
+  if (!st.ok()) dev_->BufferClear();
+  for (Request *req : *batch) {
+    if (req->result.ok()) req->result = st;
+    // The submitter may return right after this, don't touch `req` again.
+    req->done.store(true, std::memory_order_release);
+  }
+  requests_.fetch_add(batch->size(), std::memory_order_relaxed);
+  batches_.fetch_add(1, std::memory_order_relaxed);
+  completed_.fetch_add(1, std::memory_order_release);
+  completed_.notify_all();
+  return batch->size();
+}
+
+} // namespace mpsse_protocol
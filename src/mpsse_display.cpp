@@ -0,0 +1,273 @@
+#include "mpsse_display.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define RETURN_IF_ERR(st)                                                                               \
+  do {                                                                                                  \
+    Status s = (st);                                                                                    \
+    if (!s.ok()) return s;                                                                              \
+  } while (0)
+
+namespace mpsse_protocol {
+
+namespace {
+
+// RGB565, high byte first.
+inline void Pixel565(uint8_t r, uint8_t g, uint8_t b, uint8_t *out) {
+  out[0] = (r & 0xf8) | (g >> 5);
+  out[1] = ((g << 3) & 0xe0) | (b >> 3);
+}
+
+// `step` bytes from one source pixel to the next, negative to walk backwards or up a column.
+void ConvertStrided(const uint8_t *src, ptrdiff_t step, size_t pixels, bool bgr, uint8_t *out) {
+  const int r = bgr ? 2 : 0;
+  const int b = bgr ? 0 : 2;
+  for (size_t i = 0; i < pixels; i++, src += step, out += 2) Pixel565(src[r], src[1], src[b], out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// pshufb masks that gather one channel of 16 pixels, for each of the 3 registers they span.
+constexpr std::array<uint8_t, 16> ChannelMask(int channel, int part) {
+  std::array<uint8_t, 16> mask{};
+  for (int j = 0; j < 16; j++) {
+    const int index = 3 * j + channel - 16 * part;
+    mask[j] = (index >= 0 && index < 16) ? index : 0x80;
+  }
+  return mask;
+}
+constexpr std::array<std::array<uint8_t, 16>, 3> kChannelMasks[] = {
+  {ChannelMask(0, 0), ChannelMask(0, 1), ChannelMask(0, 2)},
+  {ChannelMask(1, 0), ChannelMask(1, 1), ChannelMask(1, 2)},
+  {ChannelMask(2, 0), ChannelMask(2, 1), ChannelMask(2, 2)},
+};
+
+__attribute__((target("ssse3"))) inline __m128i Gather(__m128i a0, __m128i a1, __m128i a2,
+                                                       const std::array<uint8_t, 16> *masks) {
+  auto mask = [](const std::array<uint8_t, 16> &m) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(m.data()));
+  };
+  return _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, mask(masks[0])), _mm_shuffle_epi8(a1, mask(masks[1]))),
+                      _mm_shuffle_epi8(a2, mask(masks[2])));
+}
+
+__attribute__((target("ssse3"))) size_t ConvertSsse3(const uint8_t *src, size_t pixels, bool bgr,
+                                                     uint8_t *out) {
+  const auto *r_masks = kChannelMasks[bgr ? 2 : 0].data();
+  const auto *g_masks = kChannelMasks[1].data();
+  const auto *b_masks = kChannelMasks[bgr ? 0 : 2].data();
+  // SSE has no 8-bit shifts, shift 16-bit lanes and mask off what crossed over.
+  const __m128i top5 = _mm_set1_epi8(static_cast<char>(0xf8));
+  const __m128i top3 = _mm_set1_epi8(static_cast<char>(0xe0));
+  const __m128i low3 = _mm_set1_epi8(0x07);
+  const __m128i low5 = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16, src += 48, out += 32) {
+    const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+    const __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+    const __m128i r = Gather(a0, a1, a2, r_masks);
+    const __m128i g = Gather(a0, a1, a2, g_masks);
+    const __m128i b = Gather(a0, a1, a2, b_masks);
+    const __m128i hi = _mm_or_si128(_mm_and_si128(r, top5), _mm_and_si128(_mm_srli_epi16(g, 5), low3));
+    const __m128i lo = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), top3),
+                                    _mm_and_si128(_mm_srli_epi16(b, 3), low5));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+// Pixels converted, the rest is left to the scalar loop.
+size_t ConvertVector(const uint8_t *src, size_t pixels, bool bgr, uint8_t *out) {
+  static const bool ssse3 = __builtin_cpu_supports("ssse3");
+  return ssse3 ? ConvertSsse3(src, pixels, bgr, out) : 0;
+}
+#elif defined(__ARM_NEON)
+size_t ConvertVector(const uint8_t *src, size_t pixels, bool bgr, uint8_t *out) {
+  size_t i = 0;
+  for (; i + 16 <= pixels; i += 16, src += 48, out += 32) {
+    const uint8x16x3_t rgb = vld3q_u8(src);
+    const uint8x16_t r = rgb.val[bgr ? 2 : 0];
+    const uint8x16_t g = rgb.val[1];
+    const uint8x16_t b = rgb.val[bgr ? 0 : 2];
+    // Shift right and insert: keeps the top bits of the first operand.
+    uint8x16x2_t rgb565;
+    rgb565.val[0] = vsriq_n_u8(r, g, 5);
+    rgb565.val[1] = vsriq_n_u8(vshlq_n_u8(g, 3), b, 3);
+    vst2q_u8(out, rgb565);
+  }
+  return i;
+}
+#else
+size_t ConvertVector(const uint8_t *, size_t, bool, uint8_t *) { return 0; }
+#endif
+
+} // namespace
+
+DirtyFramebuffer::DirtyFramebuffer(int width, int height, int cell_bytes, int window_overhead)
+    : width_(width), height_(height), cell_bytes_(cell_bytes), window_overhead_(window_overhead),
+      shown_(static_cast<size_t>(width) * height * cell_bytes) {}
+
+Status DirtyFramebuffer::Update(std::span<const uint8_t> frame, const SendFn &send) {
+  if (frame.size() != shown_.size()) {
+    return Status::Err("Frame is {} bytes, expected {}", frame.size(), shown_.size());
+  }
+  const size_t row_bytes = static_cast<size_t>(width_) * cell_bytes_;
+
+  for (const DirtyRect &rect : Diff(frame)) {
+    auto rows = frame.subspan(rect.y0 * row_bytes, rect.height() * row_bytes);
+    if (rect.width() == width_) {
+      // Full rows are contiguous already.
+      RETURN_IF_ERR(send(rect, rows));
+      continue;
+    }
+    const size_t rect_row_bytes = static_cast<size_t>(rect.width()) * cell_bytes_;
+    window_data_.resize(rect_row_bytes * rect.height());
+    for (int y = 0; y < rect.height(); y++) {
+      std::memcpy(window_data_.data() + y * rect_row_bytes,
+                  rows.data() + y * row_bytes + rect.x0 * cell_bytes_, rect_row_bytes);
+    }
+    RETURN_IF_ERR(send(rect, window_data_));
+  }
+
+  std::copy(frame.begin(), frame.end(), shown_.begin());
+  valid_ = true;
+  return Status::Ok();
+}
+
+const std::vector<DirtyRect> &DirtyFramebuffer::Diff(std::span<const uint8_t> frame) {
+  rects_.clear();
+  if (!valid_ || frame.size() != shown_.size()) {
+    rects_.push_back({0, 0, width_, height_});
+    return rects_;
+  }
+  const size_t row_bytes = static_cast<size_t>(width_) * cell_bytes_;
+
+  // Sweep the rows. Changed cells closer than the window overhead become one run, and each run
+  // either extends a rect ending at the row above or starts a new one.
+  for (int y = 0; y < height_; y++) {
+    const uint8_t *now = frame.data() + y * row_bytes;
+    const uint8_t *was = shown_.data() + y * row_bytes;
+    if (std::memcmp(now, was, row_bytes) == 0) continue;
+
+    auto changed = [&](int x) {
+      return std::memcmp(now + x * cell_bytes_, was + x * cell_bytes_, cell_bytes_) != 0;
+    };
+    auto add_run = [&](DirtyRect run) {
+      for (DirtyRect &rect : rects_) {
+        if (rect.y1 == y && WorthMerging(rect, run)) {
+          rect = Union(rect, run);
+          return;
+        }
+      }
+      rects_.push_back(run);
+    };
+    int run_start = -1;
+    int run_end = 0;
+    for (int x = 0; x < width_; x++) {
+      if (!changed(x)) continue;
+      if (run_start >= 0 && x - run_end >= window_overhead_) {
+        add_run({run_start, y, run_end, y + 1});
+        run_start = -1;
+      }
+      if (run_start < 0) run_start = x;
+      run_end = x + 1;
+    }
+    if (run_start >= 0) add_run({run_start, y, run_end, y + 1});
+  }
+
+  // Merge whatever is still cheaper together, e.g. rects side by side.
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < rects_.size() && !merged; i++) {
+      for (size_t j = i + 1; j < rects_.size(); j++) {
+        if (!WorthMerging(rects_[i], rects_[j])) continue;
+        rects_[i] = Union(rects_[i], rects_[j]);
+        rects_.erase(rects_.begin() + j);
+        merged = true;
+        break;
+      }
+    }
+  }
+  return rects_;
+}
+
+bool DirtyFramebuffer::WorthMerging(const DirtyRect &a, const DirtyRect &b) const {
+  return Union(a, b).area() <= a.area() + b.area() + window_overhead_;
+}
+
+DirtyRect DirtyFramebuffer::Union(const DirtyRect &a, const DirtyRect &b) {
+  return {std::min(a.x0, b.x0), std::min(a.y0, b.y0), std::max(a.x1, b.x1), std::max(a.y1, b.y1)};
+}
+
+void Rgb888ToRgb565(const uint8_t *src, size_t pixels, bool bgr, uint8_t *out) {
+  const size_t done = ConvertVector(src, pixels, bgr, out);
+  ConvertStrided(src + done * 3, 3, pixels - done, bgr, out + done * 2);
+}
+
+Status ConvertToRgb565(const Rgb888Image &src, Rotation rotation, int width, int height,
+                       std::span<uint8_t> out, uint16_t background) {
+  if (out.size() < static_cast<size_t>(width) * height * 2) {
+    return Status::Err("Frame is {} bytes, expected {}", out.size(), width * height * 2);
+  }
+  const bool swap = rotation == Rotation::k90 || rotation == Rotation::k270;
+  const int rotated_width = swap ? src.height : src.width;
+  const int rotated_height = swap ? src.width : src.height;
+  // Where the rotated image lands, negative if it's cropped.
+  const int ox = (width - rotated_width) / 2;
+  const int oy = (height - rotated_height) / 2;
+  const int x0 = std::max(0, ox);
+  const int x1 = std::min(width, ox + rotated_width);
+  const int y0 = std::max(0, oy);
+  const int y1 = std::min(height, oy + rotated_height);
+
+  const uint8_t bg[2] = {static_cast<uint8_t>(background >> 8), static_cast<uint8_t>(background)};
+  auto fill = [&bg](uint8_t *p, int n) {
+    for (int i = 0; i < n; i++, p += 2) std::memcpy(p, bg, 2);
+  };
+  const ptrdiff_t stride = src.stride;
+  for (int y = 0; y < height; y++) {
+    uint8_t *row = out.data() + static_cast<size_t>(y) * width * 2;
+    if (y < y0 || y >= y1 || x0 >= x1) {
+      fill(row, width);
+      continue;
+    }
+    fill(row, x0);
+    fill(row + x1 * 2, width - x1);
+
+    // First pixel of the row in the rotated image, and where it is in the source.
+    const int rx = x0 - ox;
+    const int ry = y - oy;
+    const size_t n = x1 - x0;
+    uint8_t *dst = row + x0 * 2;
+    switch (rotation) {
+    case Rotation::k0:
+      Rgb888ToRgb565(src.data + ry * stride + rx * 3, n, src.bgr, dst);
+      break;
+    case Rotation::k90:
+      // A rotated row is a source column, bottom up.
+      ConvertStrided(src.data + (src.height - 1 - rx) * stride + ry * 3, -stride, n, src.bgr, dst);
+      break;
+    case Rotation::k180:
+      ConvertStrided(src.data + (src.height - 1 - ry) * stride + (src.width - 1 - rx) * 3, -3, n,
+                     src.bgr, dst);
+      break;
+    case Rotation::k270:
+      ConvertStrided(src.data + rx * stride + (src.width - 1 - ry) * 3, stride, n, src.bgr, dst);
+      break;
+    }
+  }
+  return Status::Ok();
+}
+
+} // namespace mpsse_protocol
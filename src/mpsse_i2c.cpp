@@ -1,7 +1,11 @@
 #include "mpsse_protocol.h"
 
-#include <memory>
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <memory>
+#include <span>
+#include <vector>
 
 #define RETURN_IF(cond, ret, fmt, ...)                                                                  \
   do {                                                                                                  \
@@ -19,13 +23,51 @@
 
 namespace mpsse_protocol {
 
+namespace {
+// Rough execution time of one SET_BITS_LOW command. AN_113 repeats the command 4 times to get the
+// 600ns start hold time.
+constexpr double kPinCommandNs = 150;
+
+using mpsse_cmd::Bits;
+using mpsse_cmd::Pins;
+using mpsse_cmd::ReadBits;
+
+// Transfer 8 bits. Both SDA and SCL are LOW then, set ADBUS1 to INPUT mode so ADBUS2 can read the
+// ack. Take back the control of the SDA line right after and hold it low.
+// No time gaps needed, the clock extends 1/3 cycle each direction.
+// The byte to write is at offset 2.
+constexpr auto kWriteByte = Bits(MPSSE_IDLE_LOW_WRITE, 8) + Pins(0b00000000, 0b00000001) +
+                            ReadBits(MPSSE_IDLE_LOW_READ, 1) + Pins(0b00000000, 0b00000011);
+constexpr size_t kWriteByteData = 2;
+static_assert(kWriteByte.response_len == 1);
+
+// Release SDA, read 8 bits, re-acquire SDA and clock out the ACK or NACK. High(1) is NACK, and
+// MPSSE_LSB takes the bit from the LSB of the last byte.
+constexpr auto kReadByte = Pins(0b00000000, 0b00000001) + ReadBits(MPSSE_IDLE_LOW_READ, 8) +
+                           Pins(0b00000000, 0b00000011) + Bits(MPSSE_IDLE_LOW_WRITE | MPSSE_LSB, 1);
+constexpr size_t kReadByteAck = kReadByte.size() - 1;
+static_assert(kReadByte.response_len == 1);
+
+// Bytes per chunk of a pipelined ReadBytes(). Two chunks of commands are about the chip's TX
+// buffer, and at 400 kHz a chunk keeps SCL busy for ~6 ms, far more than a USB round trip.
+constexpr size_t kReadChunk = 256;
+static_assert(kReadChunk * kReadByte.size() < FtdiDevice::kChipBufferSize);
+} // namespace
+
+MpsseI2c::MpsseI2c(FtdiDevice *dev, float scl_khz)
+    : dev_(dev),
+      hold_repeat_(std::max(1, static_cast<int>(std::ceil(500'000 / scl_khz / kPinCommandNs)))) {}
+
 std::unique_ptr<MpsseI2c> MpsseI2c::Create(FtdiDevice *dev, float scl_khz) {
-  int err = ftdi_set_bitmode(dev->context(), 0xff, BITMODE_MPSSE);
-  RETURN_IF(err != 0, nullptr, "ftdi_set_bitmode() failed: %d", err);
+  Status st = dev->SetBitmode(0xff, BITMODE_MPSSE);
+  RETURN_IF(!st.ok(), nullptr, "SetBitmode() failed: %s", st.human().c_str());
   // Use the desctructor to cleanup the bitmode setting.
-  auto ret = std::unique_ptr<MpsseI2c>(new MpsseI2c(dev));
+  auto ret = std::unique_ptr<MpsseI2c>(new MpsseI2c(dev, scl_khz));
+
+  st = dev->ApplyDefaultTuning(FtdiTuning::LowLatency());
+  RETURN_IF(!st.ok(), nullptr, "ApplyDefaultTuning() failed: %s", st.human().c_str());
 
-  Status st = dev->MpsseSync();
+  st = dev->MpsseSync();
   RETURN_IF(!st.ok(), nullptr, "MpsseSync() failed: %s", st.human().c_str());
 
   st = dev->MpsseSetClockFreq(scl_khz, /*three_phase=*/true, /*adaptive=*/false);
@@ -45,9 +87,9 @@ std::unique_ptr<MpsseI2c> MpsseI2c::Create(FtdiDevice *dev, float scl_khz) {
 
 MpsseI2c::~MpsseI2c() {
   dev_->WaitTransmitterEmpty();
-  int ret = ftdi_set_bitmode(dev_->context(), 0xff, BITMODE_RESET);
-  if (ret != 0) {
-    std::fprintf(stderr, "ftdi_set_bitmode() reset failed: %d\n", ret);
+  Status st = dev_->SetBitmode(0xff, BITMODE_RESET);
+  if (!st.ok()) {
+    std::fprintf(stderr, "SetBitmode() reset failed: %s\n", st.human().c_str());
   }
 }
 
@@ -87,38 +129,17 @@ Status MpsseI2c::Stop() {
 }
 
 Status MpsseI2c::WriteByte(uint8_t data, bool *ack) {
-  // Transfer 8 bits.
-  RETURN_IF_ERR(dev_->BufferBytes({
-    MPSSE_IDLE_LOW_WRITE | MPSSE_BITMODE,
-    0x7,  // 0x7 == 8 bits
-    data,  // the byte
-  }));
-  // Both SDA and SCL should be LOW now, set ADBUS1 to INPUT mode so ADBUS2 can read the ack.
-  // Time gap is not needed since the write should hold the data for 1/3 cycle after the pulse.
-  RETURN_IF_ERR(dev_->MpsseBufferLowerPins(
-    0b00000000,
-    0b00000001
-  ));
-  // Read ACK bit
-  // Time gap is not needed before nor after because the clock should extend 1/3 cycle each direction.
-  RETURN_IF_ERR(dev_->BufferBytes({
-    MPSSE_IDLE_LOW_READ | MPSSE_BITMODE,
-    0,  // 0 = 1bit
-  }));
-  // Ask device to flush data back to PC, so the ftdi_read_byte below can be fast.
-  RETURN_IF_ERR(dev_->BufferByte(SEND_IMMEDIATE));
-  // Immediately take back the control of the SDA line and hold it low.
-  // This step can in theory be postponsed and be done before the next write, or omitted if an i2c read follows.
-  // But for simplicity of the reasoning about the pre/post cond, it's left here.
-  RETURN_IF_ERR(dev_->MpsseBufferLowerPins(
-    0b00000000,
-    0b00000011
-  ));
-  // Execute the sequence
-  RETURN_IF_ERR(dev_->BufferFlush());
-  // Read the ack bit back.
   uint8_t ack_bit;
-  RETURN_IF_ERR(dev_->Read(&ack_bit, 1));
+  Status st = BufferWriteByte(data, &ack_bit);
+  // Ask device to flush data back to PC, so the ack bit can be read back fast.
+  if (st.ok()) st = dev_->BufferByte(SEND_IMMEDIATE);
+  // Execute the sequence and read the ack bit back.
+  if (st.ok()) st = dev_->BufferFlush();
+  if (!st.ok()) {
+    // Don't leave the read into ack_bit for the next flush.
+    dev_->BufferClear();
+    return st;
+  }
   if (ack) {
     // Low is ACK, high is NACK
     *ack = (ack_bit & 0x1) == 0;
@@ -127,33 +148,27 @@ Status MpsseI2c::WriteByte(uint8_t data, bool *ack) {
   return Status::Ok();
 }
 
-Status MpsseI2c::ReadBytes(uint16_t len, void* buf) {
-  if (len > 320) return Status::Err("Too many data to read");
+Status MpsseI2c::ReadBytes(size_t len, void* buf) {
   if (len == 0) return Status::Ok();
-  // All operations can be done continuously without time gap in between.
-  for (int i = 0; i < len; ++i) {
-    // Release SDA line for reading.
-    RETURN_IF_ERR(dev_->MpsseBufferLowerPins(0b00000000, 0b00000001));
-
-    // READ 1 byte, 0x7=8bits
-    RETURN_IF_ERR(dev_->BufferBytes({MPSSE_IDLE_LOW_READ | MPSSE_BITMODE , 0x7}));
-
-    // Re-acquire SDA
-    RETURN_IF_ERR(dev_->MpsseBufferLowerPins(0b00000000, 0b00000011));
-
-    // Clock out the ACK or NACK.
-    // Note for I2C, high(1) is NACK.
-    // Also use MPSSE_LSB so the bit is taken from LSB, otherwise need to use 0x80.
-    RETURN_IF_ERR(dev_->BufferBytes({
-      MPSSE_IDLE_LOW_WRITE | MPSSE_BITMODE | MPSSE_LSB,
-      0, // 0=1bit
-      static_cast<uint8_t>((i == len-1) ? 1 : 0)}));
+  auto *out = static_cast<uint8_t *>(buf);
+  // Submit each chunk's commands and its read without waiting. ReadAsync() only waits for the
+  // previous chunk's read, by then this chunk's commands are already on the chip.
+  Status st = Status::Ok();
+  for (size_t offset = 0; offset < len && st.ok(); offset += kReadChunk) {
+    const size_t n = std::min(len - offset, kReadChunk);
+    for (size_t i = 0; i < n; i++) {
+      // Only the very last byte is NACKed, chunks are contiguous on the bus.
+      dev_->BufferSeq(kReadByte)[kReadByteAck] = (offset + i == len - 1) ? 1 : 0;
+    }
+    // Flush the chunk's data to PC.
+    st = dev_->BufferByte(SEND_IMMEDIATE);
+    if (st.ok()) st = dev_->BufferFlushAsync();
+    if (st.ok()) st = dev_->ReadAsync(out + offset, n);
   }
-  // Flush all data to PC.
-  RETURN_IF_ERR(dev_->BufferByte(SEND_IMMEDIATE));
-  // Execute
-  RETURN_IF_ERR(dev_->BufferFlush());
-  return dev_->Read(buf, len);
+  if (!st.ok()) dev_->BufferClear();
+  // The reads submitted still have to finish before the caller's buffer is released.
+  Status wait = dev_->WaitAll();
+  return st.ok() ? wait : st;
 }
 
 Status MpsseI2c::Transaction(uint8_t addr7,
@@ -161,6 +176,7 @@ Status MpsseI2c::Transaction(uint8_t addr7,
                           void* rx_buf, int rx_len) {
   if (tx_len < 0 || rx_len < 0) return Status::Err("Invalid arguments");
 
+  dev_->CountTransaction();
   RETURN_IF_ERR(Start());
   std::unique_ptr<MpsseI2c, std::function<void(MpsseI2c*)>> stop_on_exit(this, [](MpsseI2c *obj){
     // Make sure we issue the stop sequence when we return.
@@ -194,4 +210,249 @@ Status MpsseI2c::Transaction(uint8_t addr7,
   return ReadBytes(rx_len, rx_buf);
 }
 
+template <typename QueueFn>
+Status MpsseI2c::FlushQueued(const QueueFn &queue) {
+  Status st = queue();
+  if (st.ok()) st = dev_->BufferFlush();
+  if (!st.ok()) dev_->BufferClear();
+  return st;
+}
+
+Status MpsseI2c::BatchTransaction(uint8_t addr7, const uint8_t *tx_data, int tx_len, void *rx_buf,
+                                  int rx_len, int *nack_index) {
+  if (tx_len < 0) return Status::Err("Invalid arguments");
+  return BatchTransaction(addr7, {}, std::span(tx_data, tx_len), rx_buf, rx_len, nack_index);
+}
+
+Status MpsseI2c::BatchTransaction(uint8_t addr7, std::span<const uint8_t> cmd,
+                                  std::span<const uint8_t> data, void *rx_buf, int rx_len,
+                                  int *nack_index) {
+  const int tx_len = cmd.size() + data.size();
+  if (rx_len < 0 || rx_len > 0xffff) return Status::Err("Invalid arguments");
+  dev_->CountTransaction();
+
+  // One ACK bit for each byte written. Sized before queueing because the buffer keeps pointers.
+  const int ack_count = (tx_len > 0) ? 1 + tx_len + (rx_len > 0 ? 1 : 0) : 1;
+  ack_buf_.resize(ack_count);
+
+  // Queue the whole sequence. Leave the buffer clean if anything fails.
+  auto queue = [&]() -> Status {
+    uint8_t *ack = ack_buf_.data();
+    RETURN_IF_ERR(BufferStart());
+    if (tx_len > 0) {
+      RETURN_IF_ERR(BufferWriteByte(Addr7ToData(addr7, /*read=*/false), ack++));
+      for (uint8_t byte : cmd) RETURN_IF_ERR(BufferWriteByte(byte, ack++));
+      for (uint8_t byte : data) RETURN_IF_ERR(BufferWriteByte(byte, ack++));
+      if (rx_len > 0) RETURN_IF_ERR(BufferRestart());
+    }
+    if (tx_len == 0 || rx_len > 0) {
+      RETURN_IF_ERR(BufferWriteByte(Addr7ToData(addr7, /*read=*/true), ack++));
+      RETURN_IF_ERR(BufferReadBytes(rx_len, rx_buf));
+    }
+    RETURN_IF_ERR(dev_->BufferByte(SEND_IMMEDIATE));
+    return BufferStop();
+  };
+  RETURN_IF_ERR(FlushQueued(queue));
+
+  // Low is ACK, high is NACK
+  auto nack = std::find_if(ack_buf_.begin(), ack_buf_.end(), [](uint8_t bit) { return bit & 0x1; });
+  int first_nack = (nack == ack_buf_.end()) ? -1 : nack - ack_buf_.begin();
+  if (nack_index) *nack_index = first_nack;
+
+  if (tx_len > 0) {
+    if (first_nack == 0) return Status::Err("No ack from device");
+    if (first_nack > 0 && first_nack < tx_len) return Status::Err("NACK before all data sent");
+  }
+  // The read address is always the last one if there's any.
+  if ((tx_len == 0 || rx_len > 0) && (ack_buf_.back() & 0x1)) {
+    return Status::Err("No ack from device for read");
+  }
+  return Status::Ok();
+}
+
+Status MpsseI2c::Scan(std::vector<uint8_t> *found, uint8_t first, uint8_t last) {
+  if (first > last || last > 0x7f) return Status::Err("Invalid address range");
+  const int count = last - first + 1;
+  ack_buf_.resize(count);
+
+  auto queue = [&]() -> Status {
+    for (int i = 0; i < count; i++) {
+      dev_->CountTransaction();
+      RETURN_IF_ERR(BufferStart());
+      RETURN_IF_ERR(BufferWriteByte(Addr7ToData(first + i, /*read=*/false), &ack_buf_[i]));
+      RETURN_IF_ERR(BufferStop());
+    }
+    return dev_->BufferByte(SEND_IMMEDIATE);
+  };
+  RETURN_IF_ERR(FlushQueued(queue));
+
+  found->clear();
+  for (int i = 0; i < count; i++) {
+    // Low is ACK, high is NACK
+    if ((ack_buf_[i] & 0x1) == 0) found->push_back(first + i);
+  }
+  return Status::Ok();
+}
+
+Status MpsseI2c::ReadRegisters(uint8_t addr7, std::span<const uint8_t> regs, int count,
+                               void *rx_buf) {
+  if (count <= 0 || count > 0xffff) return Status::Err("Invalid arguments");
+  if (regs.empty()) return Status::Ok();
+  // Write address, register and read address for each.
+  constexpr int kAcks = 3;
+  ack_buf_.resize(regs.size() * kAcks);
+
+  auto queue = [&]() -> Status {
+    uint8_t *ack = ack_buf_.data();
+    auto *out = static_cast<uint8_t *>(rx_buf);
+    for (uint8_t reg : regs) {
+      dev_->CountTransaction();
+      RETURN_IF_ERR(BufferStart());
+      RETURN_IF_ERR(BufferWriteByte(Addr7ToData(addr7, /*read=*/false), ack++));
+      RETURN_IF_ERR(BufferWriteByte(reg, ack++));
+      RETURN_IF_ERR(BufferRestart());
+      RETURN_IF_ERR(BufferWriteByte(Addr7ToData(addr7, /*read=*/true), ack++));
+      RETURN_IF_ERR(BufferReadBytes(count, out));
+      RETURN_IF_ERR(BufferStop());
+      out += count;
+    }
+    return dev_->BufferByte(SEND_IMMEDIATE);
+  };
+  RETURN_IF_ERR(FlushQueued(queue));
+
+  for (size_t i = 0; i < regs.size(); i++) {
+    const uint8_t *ack = &ack_buf_[i * kAcks];
+    if ((ack[0] | ack[1] | ack[2]) & 0x1) {
+      return Status::Err("No ack from device 0x{:02x} for register 0x{:02x}", addr7, regs[i]);
+    }
+  }
+  return Status::Ok();
+}
+
+Status MpsseI2c::BufferTransaction(uint8_t addr7, std::span<const uint8_t> cmd,
+                                   std::span<const uint8_t> data, void *rx_data, int rx_len) {
+  const size_t tx_len = cmd.size() + data.size();
+  if (rx_len < 0 || rx_len > 0xffff) return Status::Err("Invalid arguments");
+
+  dev_->CountTransaction();
+  BufferedAcks acks{buffered_ack_bits_.size(), 0, 0};
+  auto write_byte = [&](uint8_t byte) {
+    buffered_ack_bits_.push_back(0);
+    acks.count++;
+    return BufferWriteByte(byte, &buffered_ack_bits_.back());
+  };
+  RETURN_IF_ERR(BufferStart());
+  if (tx_len > 0) {
+    RETURN_IF_ERR(write_byte(Addr7ToData(addr7, /*read=*/false)));
+    for (uint8_t byte : cmd) RETURN_IF_ERR(write_byte(byte));
+    for (uint8_t byte : data) RETURN_IF_ERR(write_byte(byte));
+    acks.optional = acks.count - 1;
+    if (rx_len > 0) RETURN_IF_ERR(BufferRestart());
+  }
+  if (tx_len == 0 || rx_len > 0) {
+    RETURN_IF_ERR(write_byte(Addr7ToData(addr7, /*read=*/true)));
+    if (tx_len == 0) acks.optional = acks.count;
+    RETURN_IF_ERR(BufferReadBytes(rx_len, rx_data));
+  }
+  RETURN_IF_ERR(BufferStop());
+  buffered_acks_.push_back(acks);
+  return Status::Ok();
+}
+
+Status MpsseI2c::Flush(int *failed) {
+  if (failed) *failed = -1;
+  Status st = Status::Ok();
+  // Get the ACK bits back right away.
+  if (!buffered_acks_.empty()) st = dev_->BufferByte(SEND_IMMEDIATE);
+  if (st.ok()) st = dev_->BufferFlush();
+  if (!st.ok()) {
+    BufferClear();
+    return st;
+  }
+
+  int first_failed = -1;
+  for (size_t i = 0; i < buffered_acks_.size() && first_failed < 0; i++) {
+    const BufferedAcks &acks = buffered_acks_[i];
+    for (size_t bit = 0; bit < acks.count; bit++) {
+      // Low is ACK, high is NACK
+      if (bit != acks.optional && (buffered_ack_bits_[acks.first + bit] & 0x1)) {
+        first_failed = i;
+        break;
+      }
+    }
+  }
+  buffered_acks_.clear();
+  buffered_ack_bits_.clear();
+  if (failed) *failed = first_failed;
+  if (first_failed >= 0) return Status::Err("No ack in buffered transaction #{}", first_failed);
+  return Status::Ok();
+}
+
+void MpsseI2c::BufferClear() {
+  dev_->BufferClear();
+  buffered_acks_.clear();
+  buffered_ack_bits_.clear();
+}
+
+Status MpsseI2c::BufferRecord(MpsseRecording *recording) {
+  if (!buffered_acks_.empty()) {
+    Status st = dev_->BufferByte(SEND_IMMEDIATE);
+    if (!st.ok()) {
+      BufferClear();
+      return st;
+    }
+  }
+  dev_->BufferRecord(recording);
+  for (const BufferedAcks &acks : buffered_acks_) {
+    for (size_t bit = 0; bit < acks.count; bit++) {
+      if (bit == acks.optional) continue;
+      // Low is ACK.
+      recording->AddCheck(recording->RxOffset(&buffered_ack_bits_[acks.first + bit]), 0x1, 0);
+    }
+  }
+  buffered_acks_.clear();
+  buffered_ack_bits_.clear();
+  return Status::Ok();
+}
+
+Status MpsseI2c::BufferHoldPins(uint8_t state) {
+  const auto pins = Pins(state, 0b00000011);
+  for (int i = 0; i < hold_repeat_; i++) dev_->BufferSeq(pins);
+  return Status::Ok();
+}
+
+// Same waveforms as Start(), Restart() and Stop().
+Status MpsseI2c::BufferStart() {
+  RETURN_IF_ERR(BufferHoldPins(0b00000001));
+  return BufferHoldPins(0b00000000);
+}
+
+Status MpsseI2c::BufferRestart() {
+  RETURN_IF_ERR(BufferHoldPins(0b00000010));
+  RETURN_IF_ERR(BufferHoldPins(0b00000011));
+  RETURN_IF_ERR(BufferHoldPins(0b00000001));
+  return BufferHoldPins(0b00000000);
 }
+
+Status MpsseI2c::BufferStop() {
+  RETURN_IF_ERR(BufferHoldPins(0b00000001));
+  return BufferHoldPins(0b00000011);
+}
+
+Status MpsseI2c::BufferWriteByte(uint8_t data, uint8_t *ack_bit) {
+  dev_->BufferSeq(kWriteByte)[kWriteByteData] = data;
+  dev_->BufferExpect(ack_bit, 1);
+  return Status::Ok();
+}
+
+Status MpsseI2c::BufferReadBytes(size_t len, void *buf) {
+  // All operations can be done continuously without time gap in between.
+  for (size_t i = 0; i < len; ++i) {
+    dev_->BufferSeq(kReadByte)[kReadByteAck] = (i == len - 1) ? 1 : 0;
+    // One response per byte, so a long read can be split anywhere.
+    dev_->BufferExpect(static_cast<uint8_t *>(buf) + i, 1);
+  }
+  return Status::Ok();
+}
+
+} // namespace mpsse_protocol
@@ -0,0 +1,287 @@
+#include "mpsse_sensor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#define RETURN_IF_ERR(st)                                                                               \
+  do {                                                                                                  \
+    Status s = (st);                                                                                    \
+    if (!s.ok()) return s;                                                                              \
+  } while (0)
+
+namespace mpsse_protocol {
+
+Status RegisterBus::Transfer(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) {
+  Status st = Queue(writes, reads);
+  if (st.ok()) st = Flush();
+  // Don't leave a failed transfer's commands for the next one.
+  if (!st.ok()) Clear();
+  return st;
+}
+
+Status I2cRegisterBus::Queue(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) {
+  for (const RegisterIo &w : writes) {
+    RETURN_IF_ERR(i2c_->BufferTransaction(addr7_, std::span(&w.reg, 1), std::span(w.data, w.len)));
+  }
+  for (const RegisterIo &r : reads) {
+    RETURN_IF_ERR(i2c_->BufferTransaction(addr7_, std::span(&r.reg, 1), {}, r.data, r.len));
+  }
+  return Status::Ok();
+}
+
+Status SpiRegisterBus::Queue(std::span<const RegisterIo> writes, std::span<const RegisterIo> reads) {
+  for (const RegisterIo &w : writes) {
+    const uint8_t cmd = w.reg | write_flag_;
+    RETURN_IF_ERR(spi_->BufferTransaction(std::span(&cmd, 1), std::span(w.data, w.len)));
+  }
+  for (const RegisterIo &r : reads) {
+    const uint8_t cmd = r.reg | read_flag_;
+    RETURN_IF_ERR(spi_->BufferTransaction(std::span(&cmd, 1), {}, r.data, r.len));
+  }
+  return Status::Ok();
+}
+
+RegisterCache::RegisterCache(std::unique_ptr<RegisterBus> bus, std::span<const Register> map,
+                             WriteMode mode)
+    : bus_(std::move(bus)), mode_(mode) {
+  uint32_t offset = 0;
+  for (const Register &reg : map) {
+    entries_.push_back({reg, offset, /*known=*/false, /*dirty=*/false});
+    index_[reg.reg] = entries_.size();
+    offset += reg.width;
+  }
+  values_.resize(offset);
+}
+
+RegisterCache::Entry *RegisterCache::Find(uint8_t reg) {
+  return index_[reg] ? &entries_[index_[reg] - 1] : nullptr;
+}
+
+int RegisterCache::width(uint8_t reg) const {
+  return index_[reg] ? entries_[index_[reg] - 1].info.width : 0;
+}
+
+Status RegisterCache::Read(uint8_t reg, void *data) { return Read(std::span(&reg, 1), data); }
+
+Status RegisterCache::Read(std::span<const uint8_t> regs, void *data) {
+  reads_.clear();
+  auto *out = static_cast<uint8_t *>(data);
+  for (uint8_t reg : regs) {
+    Entry *e = Find(reg);
+    if (e == nullptr) return Status::Err("Register 0x{:02x} is not in the map", reg);
+    stats_.reads++;
+    if (e->info.policy != Register::kVolatile && e->known) {
+      std::memcpy(out, values_.data() + e->offset, e->info.width);
+      stats_.read_hits++;
+    } else {
+      reads_.push_back({reg, e->info.width, out});
+    }
+    out += e->info.width;
+  }
+  if (reads_.empty()) return Status::Ok();
+  return Transfer({}, reads_);
+}
+
+Status RegisterCache::Write(uint8_t reg, const void *data) {
+  Entry *e = Find(reg);
+  if (e == nullptr) return Status::Err("Register 0x{:02x} is not in the map", reg);
+  if (e->info.policy == Register::kConstant) return Status::Err("Register 0x{:02x} is read only", reg);
+  stats_.writes++;
+
+  if (e->info.policy == Register::kVolatile) {
+    // Goes out now. Copied, the bus data isn't const.
+    scratch_.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + e->info.width);
+    const RegisterIo write{reg, e->info.width, scratch_.data()};
+    return Transfer(std::span(&write, 1), {});
+  }
+
+  uint8_t *value = values_.data() + e->offset;
+  if (e->known && std::memcmp(value, data, e->info.width) == 0) {
+    stats_.writes_elided++;
+    return Status::Ok();
+  }
+  if (e->dirty) stats_.writes_elided++;
+  std::memcpy(value, data, e->info.width);
+  e->known = true;
+  e->dirty = true;
+  return mode_ == kWriteThrough ? Flush() : Status::Ok();
+}
+
+Status RegisterCache::Flush() {
+  for (const Entry &e : entries_) {
+    if (e.dirty) return Transfer({}, {});
+  }
+  return Status::Ok();
+}
+
+void RegisterCache::Invalidate() {
+  for (Entry &e : entries_) e.known = e.dirty = false;
+}
+
+void RegisterCache::Invalidate(uint8_t reg) {
+  if (Entry *e = Find(reg)) e->known = e->dirty = false;
+}
+
+Status RegisterCache::Transfer(std::span<const RegisterIo> extra_writes,
+                               std::span<const RegisterIo> reads) {
+  writes_.clear();
+  for (const Entry &e : entries_) {
+    if (e.dirty) writes_.push_back({e.info.reg, e.info.width, values_.data() + e.offset});
+  }
+  writes_.insert(writes_.end(), extra_writes.begin(), extra_writes.end());
+
+  stats_.transfers++;
+  Status st = bus_->Transfer(writes_, reads);
+  for (Entry &e : entries_) {
+    // If the transfer failed, what the peripheral holds is unknown.
+    if (e.dirty && !st.ok()) e.known = false;
+    e.dirty = false;
+  }
+  RETURN_IF_ERR(st);
+
+  for (const RegisterIo &r : reads) {
+    Entry *e = Find(r.reg);
+    if (e->info.policy == Register::kVolatile) continue;
+    std::memcpy(values_.data() + e->offset, r.data, r.len);
+    e->known = true;
+  }
+  return Status::Ok();
+}
+
+SamplingScheduler::~SamplingScheduler() { Stop(); }
+
+int SamplingScheduler::AddSensor(RegisterBus *bus, std::span<const Read> reads,
+                                 Clock::duration period, Clock::duration phase) {
+  size_t len = 0;
+  for (const Read &read : reads) len += read.len;
+  if (len == 0 || len > Sample::kMaxBytes || period <= Clock::duration::zero()) return -1;
+
+  Sensor sensor{bus, std::vector<Read>(reads.begin(), reads.end()), {}, period, phase, {}, {}};
+  sensor.sample.sensor = sensors_.size();
+  sensor.sample.len = len;
+  sensors_.push_back(std::move(sensor));
+  return sensors_.size() - 1;
+}
+
+void SamplingScheduler::Start() {
+  if (thread_.joinable()) return;
+  stopping_ = false;
+  thread_ = std::thread([this]() { Loop(); });
+}
+
+void SamplingScheduler::Stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+void SamplingScheduler::Loop() {
+  Reset(Clock::now());
+  std::unique_lock lock(mutex_);
+  while (!stopping_) {
+    lock.unlock();
+    const Clock::time_point next = Tick(Clock::now());
+    lock.lock();
+    wake_.wait_until(lock, next, [this]() { return stopping_; });
+  }
+}
+
+void SamplingScheduler::Reset(Clock::time_point origin) {
+  for (Sensor &sensor : sensors_) sensor.due = origin + sensor.phase;
+}
+
+SamplingScheduler::Clock::time_point SamplingScheduler::Tick(Clock::time_point now) {
+  due_.clear();
+  for (size_t i = 0; i < sensors_.size(); i++) {
+    if (sensors_[i].due <= now) due_.push_back(i);
+  }
+  // Sensors sharing a flush next to each other, in the order they were added.
+  std::stable_sort(due_.begin(), due_.end(), [this](size_t a, size_t b) {
+    return std::less<const void *>()(sensors_[a].bus->group(), sensors_[b].bus->group());
+  });
+  for (size_t begin = 0; begin < due_.size();) {
+    size_t end = begin + 1;
+    while (end < due_.size() &&
+           sensors_[due_[end]].bus->group() == sensors_[due_[begin]].bus->group()) {
+      end++;
+    }
+    ReadGroup(begin, end);
+    begin = end;
+  }
+
+  Clock::time_point next = now + std::chrono::seconds(1);
+  for (Sensor &sensor : sensors_) {
+    if (sensor.due <= now) {
+      // Keep to the multiples of the period, skip the ones already missed.
+      sensor.due += sensor.period;
+      if (sensor.due <= now) {
+        const auto missed = (now - sensor.due) / sensor.period + 1;
+        sensor.due += missed * sensor.period;
+        sensor.stats.missed += missed;
+      }
+    }
+    next = std::min(next, sensor.due);
+  }
+  return next;
+}
+
+void SamplingScheduler::ReadGroup(size_t begin, size_t end) {
+  RegisterBus *bus = sensors_[due_[begin]].bus;
+  // The sensor's reads, into its sample.
+  auto reads = [this](Sensor *sensor) -> std::span<const RegisterIo> {
+    io_.clear();
+    uint8_t *data = sensor->sample.data.data();
+    for (const Read &read : sensor->reads) {
+      io_.push_back({read.reg, read.len, data});
+      data += read.len;
+    }
+    return io_;
+  };
+
+  Status st = Status::Ok();
+  for (size_t i = begin; i < end && st.ok(); i++) {
+    Sensor *sensor = &sensors_[due_[i]];
+    st = sensor->bus->Queue({}, reads(sensor));
+  }
+  if (st.ok()) st = bus->Flush();
+  flushes_++;
+  if (st.ok()) {
+    const Clock::time_point time = Clock::now();
+    for (size_t i = begin; i < end; i++) Publish(&sensors_[due_[i]], time);
+    return;
+  }
+  bus->Clear();
+  if (end - begin == 1) {
+    sensors_[due_[begin]].stats.errors++;
+    return;
+  }
+
+  // Find out which one failed.
+  for (size_t i = begin; i < end; i++) {
+    Sensor *sensor = &sensors_[due_[i]];
+    st = sensor->bus->Transfer({}, reads(sensor));
+    flushes_++;
+    if (st.ok()) {
+      Publish(sensor, Clock::now());
+    } else {
+      sensor->stats.errors++;
+    }
+  }
+}
+
+void SamplingScheduler::Publish(Sensor *sensor, Clock::time_point time) {
+  sensor->sample.time = time;
+  ring_.Push(sensor->sample);
+  sensor->stats.samples++;
+}
+
+} // namespace mpsse_protocol
@@ -0,0 +1,351 @@
+#include "mpsse_sim.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <span>
+
+namespace mpsse_protocol {
+
+namespace {
+
+// How long Finish() lets a read wait before the sim gives up on it. libftdi would wait forever.
+constexpr auto kAsyncReadTimeout = std::chrono::seconds(1);
+
+std::chrono::nanoseconds Ns(double ns) { return std::chrono::nanoseconds(static_cast<int64_t>(ns)); }
+
+} // namespace
+
+void MpsseSim::SetInputs(uint8_t low, uint8_t high) {
+  low_input_ = low;
+  high_input_ = high;
+  Run();
+}
+
+double MpsseSim::clock_hz() const {
+  double hz = (div5_ ? 12e6 : 60e6) / ((divisor_ + 1) * 2);
+  return three_phase_ ? hz * 2 / 3 : hz;
+}
+
+Status MpsseSim::Write(const uint8_t *buf, size_t len) {
+  size_t offset = 0;
+  while (offset < len) {
+    const size_t n = std::min<size_t>(len - offset, tuning_.write_chunk_size);
+    stats_.usb_writes++;
+    stats_.tx_bytes += n;
+    UsbTransfer(n);
+
+    if (mode_ == BITMODE_BITBANG) {
+      // Every byte is a sample of the pins.
+      low_state_ = buf[offset + n - 1];
+      Elapse(Ns(n * 1e9 / options_.bitbang_hz));
+    } else if (mode_ == BITMODE_MPSSE) {
+      // The chip takes what fits into its TX buffer, the rest waits for the MPSSE to make room.
+      size_t taken = 0;
+      while (taken < n) {
+        const size_t room = FtdiDevice::kChipBufferSize - TxPending();
+        if (room == 0) {
+          return Status::Errno(ETIMEDOUT, "MPSSE stalled with a full TX buffer, {} of {} bytes written",
+                               offset + taken, len);
+        }
+        const size_t m = std::min(room, n - taken);
+        tx_.insert(tx_.end(), buf + offset + taken, buf + offset + taken + m);
+        taken += m;
+        Run();
+      }
+    }
+    offset += n;
+  }
+  return Status::Ok();
+}
+
+Status MpsseSim::Read(uint8_t *buf, size_t len, std::chrono::duration<double> timeout) {
+  const auto timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout);
+  const auto latency = std::chrono::milliseconds(tuning_.latency_ms);
+  stats_.round_trips++;
+  size_t got = 0;
+  while (got < len) {
+    Run();
+    // The commands are done, cut off, or waiting on a pin: nothing more is coming.
+    bool timed_out = RxPending() == 0;
+    size_t sendable = std::max(rx_sendable_, rx_head_ + RxPending() / kPacketPayload * kPacketPayload);
+    sendable = std::min(sendable, rx_.size()) - std::min(sendable, rx_head_);
+    if (!timed_out && sendable == 0) {
+      // Held back until the latency timer expires.
+      if (latency > timeout_ns) {
+        timed_out = true;
+      } else {
+        stats_.latency_timer_flushes++;
+        Elapse(latency);
+        sendable = RxPending();
+      }
+    }
+    if (timed_out) {
+      stats_.timeouts++;
+      Elapse(timeout_ns);
+      return Status::Errno(ETIMEDOUT, "MpsseSim read timed out: expected {} got {}", len, got);
+    }
+
+    const size_t n = std::min(len - got, sendable);
+    std::memcpy(buf + got, rx_.data() + rx_head_, n);
+    rx_head_ += n;
+    got += n;
+    stats_.rx_bytes += n;
+    for (size_t done = 0; done < n; done += tuning_.read_chunk_size) {
+      stats_.usb_reads++;
+      UsbTransfer(std::min<size_t>(n - done, tuning_.read_chunk_size));
+    }
+    if (rx_head_ == rx_.size()) {
+      rx_.clear();
+      rx_head_ = 0;
+      rx_sendable_ = 0;
+    }
+  }
+  return Status::Ok();
+}
+
+FtdiTransfer *MpsseSim::SubmitWrite(const uint8_t *buf, size_t len) {
+  auto *transfer = new Transfer{/*read=*/false, nullptr, len, 0};
+  transfer->result = Write(buf, len).ok() ? static_cast<int>(len) : -1;
+  return reinterpret_cast<FtdiTransfer *>(transfer);
+}
+
+FtdiTransfer *MpsseSim::SubmitRead(uint8_t *buf, size_t len) {
+  return reinterpret_cast<FtdiTransfer *>(new Transfer{/*read=*/true, buf, len, 0});
+}
+
+int MpsseSim::Finish(FtdiTransfer *handle) {
+  std::unique_ptr<Transfer> transfer(reinterpret_cast<Transfer *>(handle));
+  if (transfer->read) {
+    Status st = Read(transfer->buf, transfer->len, kAsyncReadTimeout);
+    transfer->result = st.ok() ? static_cast<int>(transfer->len) : -1;
+  }
+  return transfer->result;
+}
+
+Status MpsseSim::PollModemStatus(uint16_t *status) {
+  stats_.control_transfers++;
+  UsbTransfer(2);
+  Run();
+  // Transmitter empty and holding register empty, once the MPSSE has taken everything.
+  *status = TxPending() == 0 && data_left_ == 0 ? 0x6000 : 0;
+  return Status::Ok();
+}
+
+Status MpsseSim::SetBitmode(uint8_t mask, uint8_t mode) {
+  stats_.control_transfers++;
+  UsbTransfer(0);
+  mode_ = mode;
+  if (mode == BITMODE_BITBANG) low_dir_ = mask;
+  return Status::Ok();
+}
+
+Status MpsseSim::SetBaudrate(int baud) {
+  if (baud <= 0) return Status::Err("Invalid baud rate {}", baud);
+  stats_.control_transfers++;
+  UsbTransfer(0);
+  baud_ = baud;
+  return Status::Ok();
+}
+
+Status MpsseSim::Purge() {
+  stats_.control_transfers += 2;
+  UsbTransfer(0);
+  UsbTransfer(0);
+  tx_.clear();
+  tx_head_ = 0;
+  rx_.clear();
+  rx_head_ = 0;
+  rx_sendable_ = 0;
+  rx_stalled_ = false;
+  data_left_ = 0;
+  return Status::Ok();
+}
+
+Status MpsseSim::ApplyTuning(const FtdiTuning &tuning) {
+  // Only the latency timer is on the chip, the chunk sizes are libftdi's.
+  stats_.control_transfers++;
+  UsbTransfer(0);
+  tuning_ = tuning;
+  return Status::Ok();
+}
+
+void MpsseSim::Run() {
+  while (true) {
+    if (data_left_ > 0) {
+      if (!RunData()) break;
+      continue;
+    }
+    if (TxPending() == 0) break;
+    const uint8_t *cmd = tx_.data() + tx_head_;
+    const uint8_t op = cmd[0];
+    if (op < 0x80 && !(op & (MPSSE_BITMODE | MPSSE_WRITE_TMS))) {
+      // Byte mode data: take the header, the payload is clocked as it comes.
+      if (TxPending() < 3) break;
+      data_op_ = op;
+      data_left_ = (cmd[1] | (cmd[2] << 8)) + 1;
+      tx_head_ += 3;
+      stats_.commands++;
+      continue;
+    }
+    const size_t len = mpsse_cmd::CommandLength(std::span(cmd, TxPending()));
+    // Cut off, wait for the rest.
+    if (len > TxPending()) break;
+    if (!Execute(cmd, len)) break;
+    rx_stalled_ = false;
+    tx_head_ += len;
+    stats_.commands++;
+  }
+  if (tx_head_ == tx_.size()) {
+    tx_.clear();
+    tx_head_ = 0;
+  } else if (tx_head_ >= 65536) {
+    // A long payload streaming through.
+    tx_.erase(tx_.begin(), tx_.begin() + tx_head_);
+    tx_head_ = 0;
+  }
+}
+
+bool MpsseSim::RunData() {
+  const bool write = data_op_ & MPSSE_DO_WRITE;
+  const bool read = data_op_ & MPSSE_DO_READ;
+  size_t n = data_left_;
+  if (write) n = std::min(n, TxPending());
+  if (read) {
+    if (RxFull(1)) return false;
+    n = std::min(n, FtdiDevice::kChipBufferSize - RxPending());
+  }
+  if (n == 0) return false;
+  rx_stalled_ = false;
+
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t out = write ? tx_[tx_head_ + i] : 0;
+    const uint8_t in = Shift(out, 8);
+    if (read) Respond(in);
+  }
+  if (write) tx_head_ += n;
+  data_left_ -= n;
+  Clock(8 * n);
+  return true;
+}
+
+bool MpsseSim::Execute(const uint8_t *cmd, size_t len) {
+  const uint8_t op = cmd[0];
+  const bool gpiol1 = low_pins() & (1 << 5);
+
+  if (op < 0x80) {
+    // Bit mode data, or TMS. TMS commands always carry a byte.
+    const bool read = op & MPSSE_DO_READ;
+    if (read && RxFull(1)) return false;
+    const int bits = cmd[1] + 1;
+    const uint8_t out = (op & (MPSSE_DO_WRITE | MPSSE_WRITE_TMS)) ? cmd[2] : 0;
+    const uint8_t in = Shift(out, bits);
+    if (read) Respond(in);
+    Clock(bits);
+    return true;
+  }
+
+  switch (op) {
+  case SET_BITS_LOW:
+    low_state_ = cmd[1];
+    low_dir_ = cmd[2];
+    break;
+  case SET_BITS_HIGH:
+    high_state_ = cmd[1];
+    high_dir_ = cmd[2];
+    break;
+  case GET_BITS_LOW:
+    if (RxFull(1)) return false;
+    Respond(low_pins());
+    break;
+  case GET_BITS_HIGH:
+    if (RxFull(1)) return false;
+    Respond(high_pins());
+    break;
+  case LOOPBACK_START:
+    loopback_ = true;
+    break;
+  case LOOPBACK_END:
+    loopback_ = false;
+    break;
+  case TCK_DIVISOR:
+    divisor_ = cmd[1] | (cmd[2] << 8);
+    break;
+  case SEND_IMMEDIATE:
+    rx_sendable_ = rx_.size();
+    stats_.send_immediates++;
+    break;
+  case WAIT_ON_HIGH:
+  case CLK_WAIT_HIGH:
+    // Blocks the MPSSE until SetInputs().
+    if (!gpiol1) return false;
+    break;
+  case WAIT_ON_LOW:
+  case CLK_WAIT_LOW:
+    if (gpiol1) return false;
+    break;
+  case DIS_DIV_5:
+    div5_ = false;
+    break;
+  case EN_DIV_5:
+    div5_ = true;
+    break;
+  case EN_3_PHASE:
+    three_phase_ = true;
+    break;
+  case DIS_3_PHASE:
+    three_phase_ = false;
+    break;
+  case EN_ADAPTIVE:
+  case DIS_ADAPTIVE:
+  case DRIVE_OPEN_COLLECTOR:
+    break;
+  case CLK_BITS:
+    Clock(cmd[1] + 1);
+    break;
+  case CLK_BYTES:
+    Clock(8 * ((cmd[1] | (cmd[2] << 8)) + 1));
+    break;
+  case CLK_BYTES_OR_HIGH:
+    if (!gpiol1) Clock(8 * ((cmd[1] | (cmd[2] << 8)) + 1));
+    break;
+  case CLK_BYTES_OR_LOW:
+    if (gpiol1) Clock(8 * ((cmd[1] | (cmd[2] << 8)) + 1));
+    break;
+  default:
+    // Bad command: echoed back right away, which is what MpsseSync() looks for.
+    if (RxFull(2)) return false;
+    Respond(0xfa);
+    Respond(op);
+    rx_sendable_ = rx_.size();
+    stats_.bad_commands++;
+    break;
+  }
+  return true;
+}
+
+uint8_t MpsseSim::Shift(uint8_t out, int bits) {
+  if (loopback_) return out;
+  return shift_ ? shift_(out, bits) : 0;
+}
+
+bool MpsseSim::RxFull(size_t n) {
+  if (RxPending() + n <= FtdiDevice::kChipBufferSize) return false;
+  if (!rx_stalled_) stats_.rx_stalls++;
+  rx_stalled_ = true;
+  return true;
+}
+
+void MpsseSim::Clock(uint64_t bits) {
+  const auto t = Ns(bits * 1e9 / clock_hz());
+  stats_.clock_time += t;
+  Elapse(t);
+}
+
+void MpsseSim::UsbTransfer(size_t bytes) {
+  Elapse(options_.usb_transfer_time + Ns(bytes * options_.usb_ns_per_byte));
+}
+
+} // namespace mpsse_protocol
@@ -1,5 +1,14 @@
 #include "mpsse_protocol.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <format>
+#include <string>
+#include <vector>
+
 #define RETURN_IF(cond, ret, fmt, ...)                                                                  \
   do {                                                                                                  \
     if (cond) {                                                                                         \
@@ -16,13 +25,35 @@
 
 namespace mpsse_protocol {
 
+namespace {
+
+// Indexed by CPOL. Lengths are patched in at offset 1.
+constexpr mpsse_cmd::Seq<3> kWriteHeader[] = {
+  mpsse_cmd::Bytes(MPSSE_IDLE_LOW_WRITE, 1),
+  mpsse_cmd::Bytes(MPSSE_IDLE_HIGH_WRITE, 1),
+};
+constexpr mpsse_cmd::Seq<2> kPhaseFixup[] = {
+  mpsse_cmd::ReadBits(MPSSE_IDLE_LOW_READ, 1),
+  mpsse_cmd::ReadBits(MPSSE_IDLE_HIGH_READ, 1),
+};
+constexpr mpsse_cmd::Seq<4> kRead[] = {
+  mpsse_cmd::Bytes(MPSSE_IDLE_LOW_READ, 1) + mpsse_cmd::SendImmediate(),
+  mpsse_cmd::Bytes(MPSSE_IDLE_HIGH_READ, 1) + mpsse_cmd::SendImmediate(),
+};
+constexpr auto kClockBytes = mpsse_cmd::Bytes(CLK_BYTES, 1);
+
+} // namespace
+
 std::unique_ptr<MpsseSpi> MpsseSpi::Create(FtdiDevice *dev, int cpol, int cpha, float clk_mhz) {
-  int err = ftdi_set_bitmode(dev->context(), 0xff, BITMODE_MPSSE);
-  RETURN_IF(err != 0, nullptr, "ftdi_set_bitmode() failed: %d", err);
+  Status st = dev->SetBitmode(0xff, BITMODE_MPSSE);
+  RETURN_IF(!st.ok(), nullptr, "SetBitmode() failed: %s", st.human().c_str());
   // Use the desctructor to cleanup the bitmode setting.
-  auto ret = std::unique_ptr<MpsseSpi>(new MpsseSpi(dev, cpol, cpha));
+  auto ret = std::unique_ptr<MpsseSpi>(new MpsseSpi(dev, cpol, cpha, clk_mhz * 1000));
 
-  Status st = dev->MpsseSync();
+  st = dev->ApplyDefaultTuning(FtdiTuning::BulkStreaming());
+  RETURN_IF(!st.ok(), nullptr, "ApplyDefaultTuning() failed: %s", st.human().c_str());
+
+  st = dev->MpsseSync();
   RETURN_IF(!st.ok(), nullptr, "MpsseSync() failed: %s", st.human().c_str());
 
   st = dev->MpsseSetClockFreq(clk_mhz * 1000, /*three_phase=*/cpha == 1, /*adaptive=*/false);
@@ -37,79 +68,411 @@ std::unique_ptr<MpsseSpi> MpsseSpi::Create(FtdiDevice *dev, int cpol, int cpha,
   return ret;
 }
 
-// TODO: revise all the flushes in this function.
 Status MpsseSpi::Transaction(const void* tx_data, int tx_len, void* rx_data, int rx_len) {
   if (tx_len == 0 && rx_len == 0) return Status::Err("tx & rx len cannot be both zero.");
+  if (tx_len < 0 || rx_len < 0) return Status::Err("Invalid length.");
+
+  Status st = StreamBegin();
+  if (st.ok()) st = StreamWrite(tx_data, tx_len);
+  if (st.ok()) st = StreamRead(rx_data, rx_len);
+  // Drop the partial transaction, StreamEnd() still pulls CS high.
+  if (!st.ok()) dev_->BufferClear();
+  // Issue the commands and read out data.
+  Status end = StreamEnd();
+  return st.ok() ? end : st;
+}
 
-  // pull down CS
-  RETURN_IF_ERR(dev_->MpsseSetLowerPins(
-    0b0000'0000 | (cpol_ & 1),
-    0b0000'1011
-  ));
+Status MpsseSpi::Transaction(std::span<const uint8_t> cmd, std::span<const uint8_t> data,
+                             void *rx_data, size_t rx_len) {
+  if (cmd.empty() && data.empty() && rx_len == 0) return Status::Err("tx & rx len cannot be both zero.");
 
-  // Transmit cmd
+  Status st = StreamBegin();
+  if (st.ok()) st = StreamWrite(cmd.data(), cmd.size());
+  if (st.ok()) st = StreamWrite(data.data(), data.size());
+  if (st.ok()) st = StreamRead(rx_data, rx_len);
+  if (!st.ok()) dev_->BufferClear();
+  Status end = StreamEnd();
+  return st.ok() ? end : st;
+}
+
+Status MpsseSpi::TransactionAsync(const void *tx_data, size_t tx_len, FtdiDevice::Ticket *ticket) {
+  if (tx_len == 0) return Status::Err("tx len must be positive.");
+
+  Status st = StreamBegin();
+  if (st.ok()) st = StreamWriteImpl(static_cast<const uint8_t *>(tx_data), tx_len, /*async=*/true);
+  if (!st.ok()) {
+    dev_->BufferClear();
+    StreamEnd();
+    return st;
+  }
+  streaming_ = false;
+  RETURN_IF_ERR(BufferCs(false));
+  return dev_->BufferFlushAsync(ticket);
+}
+
+Status MpsseSpi::StreamBegin() {
+  if (streaming_) return Status::Err("Stream already started.");
+  streaming_ = true;
+  stream_reading_ = false;
+  dev_->CountTransaction();
+  return BufferCs(true);
+}
+
+Status MpsseSpi::StreamWrite(const void *tx_data, size_t len) {
+  return StreamWriteImpl(static_cast<const uint8_t *>(tx_data), len, /*async=*/false);
+}
+
+Status MpsseSpi::StreamWriteImpl(const uint8_t *tx_data, size_t len, bool async) {
+  if (!streaming_) return Status::Err("Stream not started.");
+  if (len > 0) stream_reading_ = false;
+  while (len > 0) {
+    size_t n = std::min(len, kMaxCommandLen);
+    RETURN_IF_ERR(BufferWriteHeader(n));
+    // Leave room for what usually follows: a read and CS high.
+    if (n + CommandOverhead(0, 1) <= static_cast<size_t>(dev_->BufferAvailable())) {
+      RETURN_IF_ERR(dev_->BufferBytes(std::span(tx_data, n)));
+    } else if (async) {
+      RETURN_IF_ERR(dev_->WriteAsync(tx_data, n));
+    } else {
+      // Large payload: send it straight from the caller's buffer.
+      RETURN_IF_ERR(dev_->Write(tx_data, n));
+    }
+    tx_data += n;
+    len -= n;
+  }
+  return Status::Ok();
+}
+
+Status MpsseSpi::StreamRead(void *rx_data, size_t len) {
+  if (!streaming_) return Status::Err("Stream not started.");
+  auto *out = static_cast<uint8_t *>(rx_data);
+  while (len > 0) {
+    size_t n = std::min(len, kMaxCommandLen);
+    RETURN_IF_ERR(BufferReadCommand(n, out, /*phase_fixup=*/!stream_reading_));
+    stream_reading_ = true;
+    if (out) out += n;
+    len -= n;
+  }
+  return Status::Ok();
+}
+
+Status MpsseSpi::StreamEnd() {
+  if (!streaming_) return Status::Err("Stream not started.");
+  streaming_ = false;
+  Status st = BufferCs(false);
+  if (st.ok()) st = dev_->BufferFlush();
+  if (!st.ok()) {
+    // Don't leave CS low.
+    dev_->BufferClear();
+    BufferCs(false);
+    dev_->BufferFlush();
+  }
+  return st;
+}
+
+Status MpsseSpi::BufferTransaction(std::span<const uint8_t> cmd, std::span<const uint8_t> data,
+                                   void *rx_data, int rx_len) {
+  const size_t tx_len = cmd.size() + data.size();
+  if (tx_len == 0 && rx_len == 0) return Status::Err("tx & rx len cannot be both zero.");
+  if (tx_len > 65536 || rx_len < 0 || rx_len > 65536) {
+    return Status::Err("Buffered transaction is limited to 64 KiB each way.");
+  }
+
+  dev_->CountTransaction();
+  RETURN_IF_ERR(BufferCs(true));
   if (tx_len > 0) {
-    RETURN_IF_ERR(dev_->BufferBytes({
-      static_cast<uint8_t>(cpol_ ? MPSSE_IDLE_HIGH_WRITE : MPSSE_IDLE_LOW_WRITE),
-      static_cast<uint8_t>((tx_len-1) & 0xff),
-      static_cast<uint8_t>(((tx_len-1) >> 8) & 0xff),
-    }));
-    RETURN_IF_ERR(dev_->BufferFlush());
-    RETURN_IF_ERR(dev_->Write(static_cast<const uint8_t*>(tx_data), tx_len));
-  }
-
-  // Read cmd
-  if (rx_len > 0) {
-    if (cpha_ == 1) {  // Read extra bit if cpha == 1
-      RETURN_IF_ERR(dev_->BufferBytes({
-        static_cast<uint8_t>((cpol_ ? MPSSE_IDLE_HIGH_READ : MPSSE_IDLE_LOW_READ) | MPSSE_BITMODE),
-        0,
-      }));
+    RETURN_IF_ERR(BufferWriteHeader(tx_len));
+    RETURN_IF_ERR(dev_->BufferBytes(cmd));
+    RETURN_IF_ERR(dev_->BufferBytes(data));
+  }
+  if (rx_len > 0) RETURN_IF_ERR(BufferReadCommand(rx_len, rx_data));
+  return BufferCs(false);
+}
+
+Status MpsseSpi::BufferDelay(std::chrono::duration<double> delay) {
+  // CLK_BYTES clocks 8 bits per byte of its length, up to 64 KiB per command.
+  uint64_t bytes = std::ceil(delay.count() * dev_->MpsseClockKhz() * 1000 / 8);
+  while (bytes > 0) {
+    uint32_t n = std::min<uint64_t>(bytes, 65536);
+    mpsse_cmd::PatchLength(dev_->BufferSeq(kClockBytes) + 1, n);
+    bytes -= n;
+  }
+  return Status::Ok();
+}
+
+Status MpsseSpi::PollUntil(std::span<const uint8_t> cmd, uint8_t mask, uint8_t value,
+                           std::chrono::duration<double> timeout,
+                           std::chrono::duration<double> interval, uint8_t *last) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  uint8_t samples[kMaxPollSamples];
+  int n = 1;
+  while (true) {
+    for (int i = 0; i < n; i++) {
+      if (i > 0) RETURN_IF_ERR(BufferDelay(interval));
+      RETURN_IF_ERR(BufferTransaction(cmd, {}, &samples[i], 1));
+    }
+    Status st = Flush(interval * (n - 1));
+    if (!st.ok()) {
+      BufferClear();
+      return st;
     }
+    for (int i = 0; i < n; i++) {
+      if ((samples[i] & mask) != value) continue;
+      if (last) *last = samples[i];
+      return Status::Ok();
+    }
+    if (last) *last = samples[n - 1];
+    if (std::chrono::steady_clock::now() > deadline) {
+      return Status::Err("Polling timed out, status {:#04x}", samples[n - 1]);
+    }
+    n = std::min(n * 2, kMaxPollSamples);
+  }
+}
+
+Status MpsseSpi::BufferReplay(const MpsseRecording &recording, void *rx,
+                              std::span<const std::span<const uint8_t>> patches) {
+  // The bus can't tell what the recording changed, have it emit everything next time.
+  if (bus_) bus_->Invalidate();
+  return dev_->BufferReplay(recording, rx, patches);
+}
+
+Status MpsseSpi::Replay(const MpsseRecording &recording, void *rx,
+                        std::span<const std::span<const uint8_t>> patches) {
+  if (bus_) bus_->Invalidate();
+  return dev_->Replay(recording, rx, patches);
+}
+
+MpsseGpio MpsseSpi::Gpio() {
+  if (bus_) return bus_->Gpio();
+  return {dev_, 0xf0};
+}
+
+Status MpsseSpi::BufferCs(bool active) {
+  if (active && bus_) RETURN_IF_ERR(bus_->BufferSelect(*this));
+
+  // CS is active low.
+  if (cs_pin_ >= 8) {
+    const uint8_t cs = 1 << (cs_pin_ - 8);
+    return dev_->MpsseUpdateHigherPins(active ? 0 : cs, cs, cs, /*flush=*/false);
+  }
+  const uint8_t cs = 1 << cs_pin_;
+  return dev_->MpsseUpdateLowerPins(
+    (active ? 0 : cs) | (cpol_ & 1),
+    cs | 0b0000'0011,
+    cs | 0b0000'0111,  // MISO stays an input.
+    /*flush=*/false
+  );
+}
 
-    RETURN_IF_ERR(dev_->BufferBytes({
-      static_cast<uint8_t>(cpol_ ? MPSSE_IDLE_HIGH_READ : MPSSE_IDLE_LOW_READ),
-      static_cast<uint8_t>((rx_len-1) & 0xff),
-      static_cast<uint8_t>(((rx_len-1) >> 8) & 0xff),
-    }));
+Status MpsseSpi::BufferWriteHeader(int tx_len) {
+  mpsse_cmd::PatchLength(dev_->BufferSeq(kWriteHeader[cpol_ & 1]) + 1, tx_len);
+  return Status::Ok();
+}
 
-    // Flush
-    RETURN_IF_ERR(dev_->BufferByte(SEND_IMMEDIATE));
+Status MpsseSpi::BufferReadCommand(int rx_len, void *rx_data, bool phase_fixup) {
+  if (cpha_ == 1 && phase_fixup) {  // Read extra bit if cpha == 1
+    dev_->BufferSeq(kPhaseFixup[cpol_ & 1]);
+    // discard the extra bit (in a standalone byte)
+    dev_->BufferExpect(nullptr, 1);
   }
 
-  // pull up CS
-  RETURN_IF_ERR(dev_->MpsseSetLowerPins(
-    0b0000'1000 | (cpol_ & 1),
-    0b0000'1011
-  ));
+  // Read, then flush.
+  mpsse_cmd::PatchLength(dev_->BufferSeq(kRead[cpol_ & 1]) + 1, rx_len);
+  dev_->BufferExpect(rx_data, rx_len);
+  return Status::Ok();
+}
 
-  // Issue the commands
-  RETURN_IF_ERR(dev_->BufferFlush());
+Status MpsseSpi::SetClock(float clk_mhz) {
+  if (clk_mhz <= 0) return Status::Err("Invalid clock {} kHz", static_cast<int>(clk_mhz * 1000));
+  clk_khz_ = clk_mhz * 1000;
+  // On a bus BufferSelect() picks up the new rate.
+  if (bus_) return Status::Ok();
+  RETURN_IF_ERR(dev_->MpsseBufferClockFreq(clk_khz_, /*three_phase=*/cpha_ == 1, /*adaptive=*/false));
+  return dev_->BufferFlush();
+}
 
-  // Read out data.
-  if (rx_len > 0) {
-    if (cpha_ == 1) {  // discard the extra bit (in a standalone byte)
-      uint8_t bogus;
-      RETURN_IF_ERR(dev_->Read(&bogus, 1));
+Status MpsseSpi::CheckClock(std::span<const uint8_t> cmd, std::span<const uint8_t> expected,
+                            std::span<const uint8_t> mask) {
+  const size_t n = expected.size();
+  std::vector<uint8_t> rx(n * kCalibrationReads);
+  Status st = Status::Ok();
+  for (int i = 0; i < kCalibrationReads; i++) st |= BufferTransaction(cmd, {}, &rx[i * n], n);
+  if (st.ok()) st = Flush();
+  if (!st.ok()) {
+    BufferClear();
+    return st;
+  }
+  for (size_t i = 0; i < rx.size(); i++) {
+    const uint8_t bits = mask.empty() ? 0xff : mask[i % n];
+    if ((rx[i] ^ expected[i % n]) & bits) {
+      return Status::Err("Read {:#04x} at byte {}, expected {:#04x}", rx[i], i % n, expected[i % n]);
     }
-    RETURN_IF_ERR(dev_->Read(rx_data, rx_len));
   }
+  return Status::Ok();
+}
+
+Status MpsseSpi::Calibrate(std::span<const uint8_t> cmd, std::span<const uint8_t> expected,
+                           std::span<const uint8_t> mask, float max_mhz, float min_mhz) {
+  if (expected.empty()) return Status::Err("Nothing to compare with");
+  if (!mask.empty() && mask.size() != expected.size()) return Status::Err("Mask and expected sizes differ");
+  if (min_mhz <= 0 || max_mhz < min_mhz) return Status::Err("Invalid clock range");
+
+  const float original = clk_mhz();
+  // A divisor gives 60 MHz / ((div + 1) * 2), two thirds of that with 3-phase clocking.
+  const float base_mhz = cpha_ == 1 ? 20 : 30;
+  for (int div = std::max(0, static_cast<int>(std::ceil(base_mhz / max_mhz)) - 1);
+       div <= 0xffff && base_mhz / (div + 1) >= min_mhz; div++) {
+    RETURN_IF_ERR(SetClock(base_mhz / (div + 1)));
+    if (CheckClock(cmd, expected, mask).ok()) return Status::Ok();
+  }
+  RETURN_IF_ERR(SetClock(original));
+  return Status::Err("No clock from {} to {} kHz reads back the expected data",
+                     static_cast<int>(min_mhz * 1000), static_cast<int>(max_mhz * 1000));
+}
 
+namespace {
+
+struct CachedClock {
+  std::string key;
+  float clk_mhz;
+};
+
+// One "key clk_mhz" line per entry. A missing file is an empty cache.
+std::vector<CachedClock> LoadClockCache(const char *path) {
+  std::vector<CachedClock> entries;
+  FILE *f = std::fopen(path, "r");
+  if (f == nullptr) return entries;
+  char key[256];
+  float mhz;
+  while (std::fscanf(f, "%255s %f", key, &mhz) == 2) entries.push_back({key, mhz});
+  std::fclose(f);
+  return entries;
+}
+
+Status SaveClockCache(const char *path, const std::vector<CachedClock> &entries) {
+  FILE *f = std::fopen(path, "w");
+  if (f == nullptr) return Status::Errno(errno, "Cannot open the clock cache");
+  for (const CachedClock &e : entries) {
+    std::fprintf(f, "%s %.4f\n", e.key.c_str(), e.clk_mhz);
+  }
+  if (std::fclose(f) != 0) return Status::Errno(errno, "Cannot write the clock cache");
   return Status::Ok();
 }
 
+} // namespace
+
+Status MpsseSpi::CalibrateCached(const char *path, const std::string &key, std::span<const uint8_t> cmd,
+                                 std::span<const uint8_t> expected, std::span<const uint8_t> mask,
+                                 float max_mhz, float min_mhz) {
+  if (key.empty() || key.find_first_of(" \t\n") != std::string::npos) {
+    return Status::Err("Invalid clock cache key");
+  }
+  std::vector<CachedClock> entries = LoadClockCache(path);
+  auto it = std::find_if(entries.begin(), entries.end(),
+                         [&key](const CachedClock &e) { return e.key == key; });
+  // A remembered rate outside the range, e.g. after max_mhz was lowered, isn't tried.
+  if (it != entries.end() && it->clk_mhz >= min_mhz && it->clk_mhz <= max_mhz) {
+    const float original = clk_mhz();
+    if (SetClock(it->clk_mhz).ok() && CheckClock(cmd, expected, mask).ok()) return Status::Ok();
+    // So Calibrate() puts back the caller's clock if nothing passes, not the stale one.
+    RETURN_IF_ERR(SetClock(original));
+  }
+
+  RETURN_IF_ERR(Calibrate(cmd, expected, mask, max_mhz, min_mhz));
+  if (it != entries.end()) {
+    it->clk_mhz = clk_mhz();
+  } else {
+    entries.push_back({key, clk_mhz()});
+  }
+  return SaveClockCache(path, entries);
+}
+
+int MpsseSpi::CommandOverhead(int tx_len, int rx_len) const {
+  int bytes = 3 + 3;  // CS low and CS high
+  if (tx_len > 0) bytes += 3;
+  if (rx_len > 0) bytes += (cpha_ == 1 ? 2 : 0) + 3 + 1;
+  return bytes;
+}
+
 MpsseSpi::~MpsseSpi() {
   // Make sure we pull up CS before leaving.
   dev_->BufferClear();
-  dev_->MpsseSetLowerPins(
-    /*state=*/ 0b0000'1000 | (cpol_ & 1),
-    /*dir=*/   0b0000'1011);
+  BufferCs(false);
+  dev_->BufferFlush();
+  if (bus_) {
+    // The bus owns the interface.
+    bus_->ReleasePin(cs_pin_);
+    return;
+  }
+
+  dev_->WaitTransmitterEmpty();
+  Status st = dev_->SetBitmode(0xff, BITMODE_RESET);
+  if (!st.ok()) {
+    std::fprintf(stderr, "SetBitmode() reset failed: %s\n", st.human().c_str());
+  }
+}
+
+std::unique_ptr<MpsseSpiBus> MpsseSpiBus::Create(FtdiDevice *dev) {
+  Status st = dev->SetBitmode(0xff, BITMODE_MPSSE);
+  RETURN_IF(!st.ok(), nullptr, "SetBitmode() failed: %s", st.human().c_str());
+  // Use the desctructor to cleanup the bitmode setting.
+  auto ret = std::unique_ptr<MpsseSpiBus>(new MpsseSpiBus(dev));
+
+  st = dev->ApplyDefaultTuning(FtdiTuning::BulkStreaming());
+  RETURN_IF(!st.ok(), nullptr, "ApplyDefaultTuning() failed: %s", st.human().c_str());
+
+  st = dev->MpsseSync();
+  RETURN_IF(!st.ok(), nullptr, "MpsseSync() failed: %s", st.human().c_str());
+
+  // The clock and its idle level are set by the first transaction.
+  dev->BufferClear();
+  st = dev->MpsseUpdateLowerPins(
+    /*state=*/ 0b0000'0000,
+    /*dir=*/   0b0000'0011,  // CLK and MOSI out, MISO in.
+    /*mask=*/  0b0000'0111,
+    /*flush=*/ true
+  );
+  RETURN_IF(!st.ok(), nullptr, "MpsseUpdateLowerPins() failed: %s", st.human().c_str());
+  return ret;
+}
 
+MpsseSpiBus::~MpsseSpiBus() {
+  if (cs_pins_ != 0) std::fprintf(stderr, "MpsseSpiBus destroyed with devices attached\n");
   dev_->WaitTransmitterEmpty();
-  int ret = ftdi_set_bitmode(dev_->context(), 0xff, BITMODE_RESET);
-  if (ret != 0) {
-    std::fprintf(stderr, "ftdi_set_bitmode() reset failed: %d\n", ret);
+  Status st = dev_->SetBitmode(0xff, BITMODE_RESET);
+  if (!st.ok()) {
+    std::fprintf(stderr, "SetBitmode() reset failed: %s\n", st.human().c_str());
   }
 }
 
+std::unique_ptr<MpsseSpi> MpsseSpiBus::AddDevice(int cs_pin, int cpol, int cpha, float clk_mhz) {
+  RETURN_IF(cs_pin < 3 || cs_pin > 15, nullptr, "Invalid CS pin %d", cs_pin);
+  RETURN_IF(cs_pins_ & (1 << cs_pin), nullptr, "CS pin %d already used", cs_pin);
+  RETURN_IF(clk_mhz <= 0, nullptr, "Invalid clock %f MHz", clk_mhz);
+  cs_pins_ |= 1 << cs_pin;
+  auto ret = std::unique_ptr<MpsseSpi>(new MpsseSpi(dev_, cpol, cpha, clk_mhz * 1000, cs_pin, this));
+
+  // Deselect the new device right away.
+  dev_->BufferClear();
+  Status st = ret->BufferCs(false);
+  if (st.ok()) st = dev_->BufferFlush();
+  RETURN_IF(!st.ok(), nullptr, "Init CS failed: %s", st.human().c_str());
+  return ret;
+}
+
+Status MpsseSpiBus::BufferSelect(const MpsseSpi &spi) {
+  const bool three_phase = spi.cpha_ == 1;
+  if (spi.clk_khz_ != clk_khz_ || three_phase != three_phase_) {
+    RETURN_IF_ERR(dev_->MpsseBufferClockFreq(spi.clk_khz_, three_phase, /*adaptive=*/false));
+    clk_khz_ = spi.clk_khz_;
+    three_phase_ = three_phase;
+  }
+  if (spi.cpol_ != cpol_) {
+    // Move the clock to its idle level while every CS is still high.
+    RETURN_IF_ERR(dev_->MpsseUpdateLowerPins(spi.cpol_ & 1, 0b0000'0011, 0b0000'0011, /*flush=*/false));
+    cpol_ = spi.cpol_;
+  }
+  return Status::Ok();
+}
+
 } // namespace mpsse_protocol
@@ -0,0 +1,210 @@
+#include "mpsse_protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <span>
+
+#define RETURN_IF_ERR(st)                                                                               \
+  do {                                                                                                  \
+    Status s = (st);                                                                                    \
+    if (!s.ok()) return s;                                                                              \
+  } while (0)
+
+namespace mpsse_protocol {
+
+namespace {
+
+constexpr uint8_t kCmdWriteEnable = 0x06;
+constexpr uint8_t kCmdReadStatus1 = 0x05;
+constexpr uint8_t kCmdJedecId = 0x9f;
+constexpr uint8_t kCmdRead = 0x03;
+constexpr uint8_t kCmdFastRead = 0x0b;
+constexpr uint8_t kCmdPageProgram = 0x02;
+constexpr uint8_t kCmdSectorErase = 0x20;
+constexpr uint8_t kCmdBlockErase = 0xd8;
+constexpr uint8_t kCmdChipErase = 0xc7;
+
+constexpr uint8_t kStatusBusy = 0x01;
+constexpr auto kMaxPageProgramTime = std::chrono::microseconds(3000);
+// Give up after this many batches in a row where no page was taken.
+constexpr int kMaxStalledBatches = 16;
+
+} // namespace
+
+Status MpsseSpiFlash::ReadJedecId(JedecId *id) {
+  uint8_t cmd[] = {kCmdJedecId};
+  uint8_t out[3];
+  RETURN_IF_ERR(spi_->Transaction(cmd, 1, out, 3));
+  id->manufacturer = out[0];
+  id->memory_type = out[1];
+  id->size_bytes = 1 << (out[2] & 0x1f);
+  return Status::Ok();
+}
+
+Status MpsseSpiFlash::ReadStatus1(uint8_t *status) {
+  uint8_t cmd[] = {kCmdReadStatus1};
+  return spi_->Transaction(cmd, 1, status, 1);
+}
+
+Status MpsseSpiFlash::WaitReady(std::chrono::duration<double> timeout,
+                                std::chrono::duration<double> interval) {
+  uint8_t cmd[] = {kCmdReadStatus1};
+  return spi_->PollUntil(cmd, kStatusBusy, 0, timeout, interval);
+}
+
+Status MpsseSpiFlash::Read(uint32_t addr, void *buf, uint32_t len) {
+  return ReadCommand(kCmdRead, /*dummy=*/false, addr, buf, len);
+}
+
+Status MpsseSpiFlash::FastRead(uint32_t addr, void *buf, uint32_t len) {
+  return ReadCommand(kCmdFastRead, /*dummy=*/true, addr, buf, len);
+}
+
+Status MpsseSpiFlash::ReadCommand(uint8_t cmd, bool dummy, uint32_t addr, void *buf, uint32_t len) {
+  uint8_t header[] = {
+    cmd,
+    static_cast<uint8_t>(addr >> 16),
+    static_cast<uint8_t>(addr >> 8),
+    static_cast<uint8_t>(addr),
+    0,  // dummy
+  };
+  // The flash keeps incrementing the address, so any length is one continuous read.
+  return spi_->Transaction(header, dummy ? 5 : 4, buf, len);
+}
+
+Status MpsseSpiFlash::EraseSector(uint32_t addr) {
+  uint8_t a[] = {static_cast<uint8_t>(addr >> 16), static_cast<uint8_t>(addr >> 8),
+                 static_cast<uint8_t>(addr)};
+  // tSE is 45 ms typical, 400 ms max.
+  return Erase(kCmdSectorErase, a, std::chrono::milliseconds(1000), std::chrono::milliseconds(5));
+}
+
+Status MpsseSpiFlash::EraseBlock(uint32_t addr) {
+  uint8_t a[] = {static_cast<uint8_t>(addr >> 16), static_cast<uint8_t>(addr >> 8),
+                 static_cast<uint8_t>(addr)};
+  // tBE2 is 150 ms typical, 2 s max.
+  return Erase(kCmdBlockErase, a, std::chrono::seconds(4), std::chrono::milliseconds(20));
+}
+
+Status MpsseSpiFlash::EraseChip() {
+  // tCE is up to 100 s on the larger parts.
+  return Erase(kCmdChipErase, {}, std::chrono::seconds(200), std::chrono::milliseconds(100));
+}
+
+Status MpsseSpiFlash::Erase(uint8_t cmd, std::span<const uint8_t> addr,
+                            std::chrono::duration<double> timeout,
+                            std::chrono::duration<double> interval) {
+  uint8_t c[] = {cmd};
+  Status st = Status::Ok();
+  st |= BufferWriteEnable();
+  st |= spi_->BufferTransaction(c, addr);
+  if (st.ok()) st = spi_->Flush();
+  if (!st.ok()) {
+    spi_->BufferClear();
+    return st;
+  }
+  return WaitReady(timeout, interval);
+}
+
+Status MpsseSpiFlash::Program(uint32_t addr, const void *data, uint32_t len) {
+  const auto *src = static_cast<const uint8_t *>(data);
+  uint32_t offset = 0;
+  int stalled = 0;
+  retry_.clear();
+
+  while (offset < len || !retry_.empty()) {
+    // Pages that didn't take go first, then new pages up to the end of the current sector.
+    batch_.swap(retry_);
+    retry_.clear();
+    if (offset < len) {
+      uint32_t sector_end = (addr + offset) / kSectorSize * kSectorSize + kSectorSize;
+      while (offset < len && addr + offset < sector_end) {
+        uint32_t a = addr + offset;
+        // A page program wraps around within the page, so never cross a page boundary.
+        uint32_t n = std::min(len - offset, kPageSize - a % kPageSize);
+        batch_.push_back({a, src + offset, n});
+        offset += n;
+      }
+    }
+
+    status_.resize(batch_.size());
+    Status st = Status::Ok();
+    for (size_t i = 0; i < batch_.size() && st.ok(); i++) {
+      const PageWrite &page = batch_[i];
+      uint8_t cmd[] = {
+        kCmdPageProgram,
+        static_cast<uint8_t>(page.addr >> 16),
+        static_cast<uint8_t>(page.addr >> 8),
+        static_cast<uint8_t>(page.addr),
+      };
+      st |= BufferStatusRead(&status_[i]);
+      st |= BufferWriteEnable();
+      st |= spi_->BufferTransaction(cmd, std::span(page.data, page.len));
+      st |= spi_->BufferDelay(page_program_time_);
+    }
+    if (st.ok()) st = spi_->Flush(page_program_time_ * batch_.size());
+    if (!st.ok()) {
+      spi_->BufferClear();
+      return st;
+    }
+
+    // A busy sample means the page before outlasted its delay, and this one was likely ignored.
+    // But the flash may have come ready between the sample and the WREN, then the page was
+    // programmed, so read such pages back instead of programming them twice.
+    for (size_t i = 0; i < batch_.size(); i++) {
+      if (status_[i] & kStatusBusy) retry_.push_back(batch_[i]);
+    }
+    if (!retry_.empty()) {
+      page_program_time_ = std::min(page_program_time_ + page_program_time_ / 4, kMaxPageProgramTime);
+      RETURN_IF_ERR(DropProgrammed(&retry_));
+    }
+    stalled = retry_.size() == batch_.size() ? stalled + 1 : 0;
+    if (stalled >= kMaxStalledBatches) return Status::Err("Flash stays busy, no page was programmed.");
+  }
+  return WaitReady(kMaxPageProgramTime * 2, std::chrono::microseconds(100));
+}
+
+Status MpsseSpiFlash::DropProgrammed(std::vector<PageWrite> *pages) {
+  // The last page of the batch may still be programming.
+  RETURN_IF_ERR(WaitReady(kMaxPageProgramTime * 2, std::chrono::microseconds(100)));
+  verify_.resize(pages->size() * kPageSize);
+  Status st = Status::Ok();
+  for (size_t i = 0; i < pages->size() && st.ok(); i++) {
+    const PageWrite &page = (*pages)[i];
+    uint8_t cmd[] = {
+      kCmdRead,
+      static_cast<uint8_t>(page.addr >> 16),
+      static_cast<uint8_t>(page.addr >> 8),
+      static_cast<uint8_t>(page.addr),
+    };
+    st |= spi_->BufferTransaction(cmd, {}, &verify_[i * kPageSize], page.len);
+  }
+  if (st.ok()) st = spi_->Flush();
+  if (!st.ok()) {
+    spi_->BufferClear();
+    return st;
+  }
+
+  // An ignored page is still erased, so it differs unless the data is all 0xff, which needs no
+  // programming anyway.
+  size_t kept = 0;
+  for (size_t i = 0; i < pages->size(); i++) {
+    const PageWrite &page = (*pages)[i];
+    if (!std::equal(page.data, page.data + page.len, &verify_[i * kPageSize])) (*pages)[kept++] = page;
+  }
+  pages->resize(kept);
+  return Status::Ok();
+}
+
+Status MpsseSpiFlash::BufferWriteEnable() {
+  uint8_t cmd[] = {kCmdWriteEnable};
+  return spi_->BufferTransaction(cmd, {});
+}
+
+Status MpsseSpiFlash::BufferStatusRead(uint8_t *status) {
+  uint8_t cmd[] = {kCmdReadStatus1};
+  return spi_->BufferTransaction(cmd, {}, status, 1);
+}
+
+} // namespace mpsse_protocol
@@ -1,9 +1,16 @@
 #include "mpsse_protocol.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <ftdi.h>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #define RETURN_IF(cond, ret, fmt, ...)                                                                  \
   do {                                                                                                  \
@@ -21,13 +28,47 @@
 
 namespace mpsse_protocol {
 
+namespace {
+
+// Symbols of every byte value, 0 map to 0b100, 1 map to 0b110, MSB first.
+constexpr std::array<uint32_t, 256> MakeSymbolTable() {
+  std::array<uint32_t, 256> table{};
+  for (int byte = 0; byte < 256; byte++) {
+    uint32_t symbols = 0;
+    for (int bit = 7; bit >= 0; bit--) {
+      symbols = (symbols << 3) | ((byte >> bit) & 1 ? 0b110 : 0b100);
+    }
+    table[byte] = symbols;
+  }
+  return table;
+}
+
+constexpr std::array<uint32_t, 256> kSymbolTable = MakeSymbolTable();
+
+inline void PutSymbols(uint8_t byte, uint8_t *out) {
+  uint32_t symbols = kSymbolTable[byte];
+  out[0] = symbols >> 16;
+  out[1] = symbols >> 8;
+  out[2] = symbols;
+}
+
+// Length patched in at offset 1.
+constexpr auto kWriteHeader = mpsse_cmd::Bytes(MPSSE_IDLE_LOW_WRITE, 1);
+// Last bit is always zero. Clock 136 more zero bits to signal a reset.
+constexpr auto kReset = mpsse_cmd::Bytes(CLK_BYTES, 17);
+
+} // namespace
+
 std::unique_ptr<MpsseWs2812b> MpsseWs2812b::Create(FtdiDevice *dev) {
-  int err = ftdi_set_bitmode(dev->context(), 0xff, BITMODE_MPSSE);
-  RETURN_IF(err != 0, nullptr, "ftdi_set_bitmode() failed: %d", err);
+  Status st = dev->SetBitmode(0xff, BITMODE_MPSSE);
+  RETURN_IF(!st.ok(), nullptr, "SetBitmode() failed: %s", st.human().c_str());
   // Use the desctructor to cleanup the bitmode setting.
   auto ret = std::unique_ptr<MpsseWs2812b>(new MpsseWs2812b(dev));
 
-  Status st = dev->MpsseSync();
+  st = dev->ApplyDefaultTuning(FtdiTuning::BulkStreaming());
+  RETURN_IF(!st.ok(), nullptr, "ApplyDefaultTuning() failed: %s", st.human().c_str());
+
+  st = dev->MpsseSync();
   RETURN_IF(!st.ok(), nullptr, "MpsseSync() failed: %s", st.human().c_str());
 
   st = dev->MpsseSetClockFreq(2500, /*three_phase=*/false, /*adaptive=*/false);
@@ -45,9 +86,9 @@ std::unique_ptr<MpsseWs2812b> MpsseWs2812b::Create(FtdiDevice *dev) {
 
 MpsseWs2812b::~MpsseWs2812b() {
   dev_->WaitTransmitterEmpty();
-  int ret = ftdi_set_bitmode(dev_->context(), 0xff, BITMODE_RESET);
-  if (ret != 0) {
-    std::fprintf(stderr, "ftdi_set_bitmode() reset failed: %d\n", ret);
+  Status st = dev_->SetBitmode(0xff, BITMODE_RESET);
+  if (!st.ok()) {
+    std::fprintf(stderr, "SetBitmode() reset failed: %s\n", st.human().c_str());
   }
 }
 
@@ -65,33 +106,247 @@ void MpsseWs2812b::ExpandByte(uint8_t byte, uint8_t buf[]) {
   buf[2] |= (byte & 0x01) ? 0x06 : 0x04;
 }
 
-Status MpsseWs2812b::SendFrame(std::span<const uint32_t> rgb) {
-  auto raw = std::make_unique<uint8_t[]>(rgb.size() * 9);
+void MpsseWs2812b::Encode(std::span<const uint32_t> rgb, uint8_t *out) {
   // WS2812B wants the 3 bytes in GRB order.
-  for (size_t i = 0; i < rgb.size() ; i++) {
-    ExpandByte((rgb[i] >> 16) & 0xff, raw.get() + i*9 + 3);
-    ExpandByte((rgb[i] >> 8 ) & 0xff, raw.get() + i*9    );
-    ExpandByte((rgb[i]      ) & 0xff, raw.get() + i*9 + 6);
+  for (uint32_t color : rgb) {
+    PutSymbols(color >> 8, out);
+    PutSymbols(color >> 16, out + 3);
+    PutSymbols(color, out + 6);
+    out += 9;
   }
-  return SendRaw({raw.get(), rgb.size()*9});
 }
 
-Status MpsseWs2812b::SendRaw(std::span<const uint8_t> raw) {
-  // Header for writing bytes.
-  RETURN_IF_ERR(dev_->BufferBytes({
-    MPSSE_IDLE_LOW_WRITE,
-    static_cast<uint8_t>( (raw.size()-1)       & 0xff),
-    static_cast<uint8_t>(((raw.size()-1) >> 8) & 0xff)
-  }));
-  RETURN_IF_ERR(dev_->BufferFlush());
+void MpsseWs2812b::BuildFrame(std::span<const uint32_t> rgb, std::vector<uint8_t> *frame) {
+  // [write header][symbols] for every kLedsPerCommand LEDs, then the reset.
+  const size_t commands = (rgb.size() + kLedsPerCommand - 1) / kLedsPerCommand;
+  frame->resize(commands * 3 + rgb.size() * 9 + 3);
+  uint8_t *out = frame->data();
+  for (size_t i = 0; i < rgb.size(); i += kLedsPerCommand) {
+    auto leds = rgb.subspan(i, std::min(kLedsPerCommand, rgb.size() - i));
+    const size_t len = leds.size() * 9;
+    std::memcpy(out, kWriteHeader.bytes.data(), kWriteHeader.size());
+    mpsse_cmd::PatchLength(out + 1, len);
+    Encode(leds, out + 3);
+    out += 3 + len;
+  }
+  std::memcpy(out, kReset.bytes.data(), kReset.size());
+}
+
+Status MpsseWs2812b::SendFrame(std::span<const uint32_t> rgb) {
+  if (rgb.empty()) return Status::Ok();
+  BuildFrame(rgb, &frame_);
+  dev_->CountTransaction();
+  return dev_->Write(frame_.data(), frame_.size());
+}
+
+Status MpsseWs2812b::Animate(size_t leds, double fps, const RenderFn &render, AnimationStats *stats) {
+  if (leds == 0 || fps <= 0) return Status::Err("Invalid LED count or fps");
+  using Clock = std::chrono::steady_clock;
+
+  // Two slots: one on the wire, the other one being rendered. Guarded by mu.
+  struct Slot {
+    enum { kFree, kRendering, kReady, kSending } state = kFree;
+    uint64_t frame = 0;
+    std::vector<uint32_t> rgb;
+    std::vector<uint8_t> bytes;
+    FtdiDevice::Ticket ticket = 0;
+  };
+  Slot slots[2];
+  std::mutex mu;
+  std::condition_variable cv;
+  bool stop = false;           // Set by the sender on error or when done.
+  bool render_done = false;    // render() returned false.
 
-  // Because the data array can be huge, we use unbuffered write.
-  RETURN_IF_ERR(dev_->Write(raw.data(), raw.size()));
+  std::thread producer([&]() {
+    for (uint64_t frame = 0;; frame++) {
+      Slot *slot = nullptr;
+      {
+        std::unique_lock lock(mu);
+        cv.wait(lock, [&]() {
+          return stop || slots[0].state == Slot::kFree || slots[1].state == Slot::kFree;
+        });
+        if (stop) return;
+        slot = slots[0].state == Slot::kFree ? &slots[0] : &slots[1];
+        slot->state = Slot::kRendering;
+      }
+      slot->rgb.assign(leds, 0);
+      bool more = render(frame, &slot->rgb);
+      if (more) BuildFrame(slot->rgb, &slot->bytes);
+      {
+        std::lock_guard lock(mu);
+        if (more) {
+          slot->frame = frame;
+          slot->state = Slot::kReady;
+        } else {
+          slot->state = Slot::kFree;
+          render_done = true;
+        }
+      }
+      cv.notify_all();
+      if (!more) return;
+    }
+  });
+
+  AnimationStats local_stats;
+  if (stats == nullptr) stats = &local_stats;
+  *stats = {};
+  const auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / fps));
+  const auto start = Clock::now();
+  // Give the producer one period to render the first frame.
+  auto deadline = start + period;
+  Slot *sending = nullptr;
+  Status st = Status::Ok();
+
+  while (st.ok()) {
+    Slot *next = nullptr;
+    {
+      std::unique_lock lock(mu);
+      auto ready = [&]() {
+        Slot *best = nullptr;
+        for (Slot &slot : slots) {
+          if (slot.state == Slot::kReady && (best == nullptr || slot.frame < best->frame)) best = &slot;
+        }
+        return best;
+      };
+      cv.wait_until(lock, deadline, [&]() { return ready() != nullptr || render_done; });
+      next = ready();
+      if (next == nullptr && render_done) break;
+    }
+
+    if (next == nullptr) {
+      // Nothing rendered in time for this slot.
+      stats->frames_dropped++;
+    } else {
+      std::this_thread::sleep_until(deadline);
+      dev_->CountTransaction();
+      st = dev_->WriteAsync(next->bytes.data(), next->bytes.size(), &next->ticket);
+      if (!st.ok()) break;
+      {
+        std::lock_guard lock(mu);
+        next->state = Slot::kSending;
+      }
+      // The previous frame is done by now unless the wire is slower than the frame rate.
+      if (sending) {
+        st = dev_->Wait(sending->ticket);
+        std::lock_guard lock(mu);
+        sending->state = Slot::kFree;
+      }
+      cv.notify_all();
+      sending = next;
+      stats->frames_sent++;
+    }
+
+    // Slots missed while waiting for USB count as dropped too.
+    deadline += period;
+    auto now = Clock::now();
+    if (now > deadline + period) {
+      auto missed = (now - deadline) / period;
+      stats->frames_dropped += missed;
+      deadline += missed * period;
+    }
+    stats->achieved_fps = stats->frames_sent / std::chrono::duration<double>(now - start).count();
+  }
 
-  // Last bit must be zero. Clock 128bits to signal a reset.
-  RETURN_IF_ERR(dev_->BufferBytes({CLK_BYTES, 16, 0}));
-  RETURN_IF_ERR(dev_->BufferFlush());
+  if (sending) st |= dev_->Wait(sending->ticket);
+  {
+    std::lock_guard lock(mu);
+    stop = true;
+  }
+  cv.notify_all();
+  producer.join();
+  return st;
+}
+
+std::unique_ptr<ParallelWs2812b> ParallelWs2812b::Create(FtdiDevice *dev, uint8_t channel_mask, int baud) {
+  RETURN_IF(channel_mask == 0, nullptr, "No channel enabled");
+  Status st = dev->ApplyDefaultTuning(FtdiTuning::BulkStreaming());
+  RETURN_IF(!st.ok(), nullptr, "ApplyDefaultTuning() failed: %s", st.human().c_str());
+
+  st = dev->SetBitmode(channel_mask, BITMODE_BITBANG);
+  RETURN_IF(!st.ok(), nullptr, "SetBitmode() failed: %s", st.human().c_str());
+  // Use the desctructor to cleanup the bitmode setting.
+  auto ret = std::unique_ptr<ParallelWs2812b>(new ParallelWs2812b(dev, channel_mask));
+
+  st = dev->SetBaudrate(baud);
+  RETURN_IF(!st.ok(), nullptr, "SetBaudrate() failed: %s", st.human().c_str());
+
+  // Idle low.
+  uint8_t low = 0;
+  st = dev->Write(&low, 1);
+  RETURN_IF(!st.ok(), nullptr, "Write() failed: %s", st.human().c_str());
+  return ret;
+}
+
+ParallelWs2812b::~ParallelWs2812b() {
+  dev_->WaitAll();
+  dev_->WaitTransmitterEmpty();
+  Status st = dev_->SetBitmode(0xff, BITMODE_RESET);
+  if (!st.ok()) {
+    std::fprintf(stderr, "SetBitmode() reset failed: %s\n", st.human().c_str());
+  }
+}
+
+void ParallelWs2812b::TransposeBytes(const uint8_t bytes[8], uint8_t planes[8]) {
+  // 8x8 bit matrix transpose, Hacker's Delight 7-3. Rows go in reversed so that channel i ends
+  // up in bit i of each plane.
+  uint64_t x = 0;
+  for (int i = 0; i < 8; i++) x = (x << 8) | bytes[7 - i];
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+  x = x ^ t ^ (t << 28);
+  for (int i = 0; i < 8; i++) planes[i] = x >> (56 - i * 8);
+}
+
+Status ParallelWs2812b::SendFrames(std::span<const std::span<const uint32_t>> channels) {
+  // At 2.5 MHz, 750 samples of zero is 300 us, the reset time of the newer WS2812B parts.
+  constexpr size_t kResetSamples = 750;
+  if (channels.size() > kMaxChannels) return Status::Err("Too many channels");
+
+  size_t max_len = 0;
+  for (size_t c = 0; c < channels.size(); c++) {
+    if (channel_mask_ & (1 << c)) max_len = std::max(max_len, channels[c].size());
+  }
+
+  // Reuse the buffer of the frame before the last one, once it's sent.
+  std::vector<uint8_t> &samples = samples_[next_buffer_];
+  RETURN_IF_ERR(dev_->Wait(tickets_[next_buffer_]));
+  dev_->CountTransaction();
+  samples.resize(max_len * 24 * 3 + kResetSamples);
+
+  uint8_t *out = samples.data();
+  for (size_t led = 0; led < max_len; led++) {
+    // GRB bytes of this LED on every channel.
+    uint8_t grb[3][kMaxChannels] = {};
+    uint8_t active = 0;
+    for (size_t c = 0; c < channels.size(); c++) {
+      if (led >= channels[c].size()) continue;
+      uint32_t color = channels[c][led];
+      grb[0][c] = color >> 8;
+      grb[1][c] = color >> 16;
+      grb[2][c] = color;
+      active |= 1 << c;
+    }
+    active &= channel_mask_;
+
+    for (auto &bytes : grb) {
+      uint8_t planes[8];
+      TransposeBytes(bytes, planes);
+      for (uint8_t plane : planes) {
+        out[0] = active;
+        out[1] = plane & active;
+        out[2] = 0;
+        out += 3;
+      }
+    }
+  }
+  std::fill(out, samples.data() + samples.size(), 0);
 
+  RETURN_IF_ERR(dev_->WriteAsync(samples.data(), samples.size(), &tickets_[next_buffer_]));
+  next_buffer_ ^= 1;
   return Status::Ok();
 }
 